@@ -78,7 +78,9 @@ CPP_CLASSES = \
 	core/KeyvalIterator \
 	core/QtFuse \
 	core/QtFuseCallback \
+	core/QtFuseCallbackGroup \
 	core/QtFuseRequest \
+	core/QtFuseRequestQueue \
 	core/S3Fuse \
 	core/S3FS \
 	core/S3FS_fsck \
@@ -89,7 +91,16 @@ CPP_CLASSES = \
 	core/S3FS_Store \
 	core/S3FS_Store_MetaIterator \
 	core/S3FS_Store_InodeDoctor \
+	core/S3FS_Store_Journal \
+	core/S3FS_Store_DataCache \
+	core/S3FS_Store_BlockIndex \
+	core/S3FS_Store_BlockCache \
+	core/S3FS_Store_Worker \
+	core/S3FS_Hash \
 	core/S3FS_Aws \
+	core/S3FS_Aws_Limiter \
+	core/S3FS_Aws_Transport \
+	core/S3FS_Aws_Spill \
 	core/S3FS_Aws_S3 \
 	core/S3FS_Aws_SQS
 
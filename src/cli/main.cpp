@@ -20,6 +20,7 @@
 #include <S3FS.hpp>
 #include <S3Fuse.hpp>
 #include <S3FS_Config.hpp>
+#include <S3FS_Hash.hpp>
 
 int main(int argc, char *argv[]) {
 	QCoreApplication app(argc, argv);
@@ -43,10 +44,30 @@ int main(int argc, char *argv[]) {
 	parser.addOption({"quick-forget", QCoreApplication::translate("main", "Quickly purge data from the database. Useful if used as rsync target only.")});
 	parser.addOption({"disable-data-cache", QCoreApplication::translate("main", "Do not keep data in the LevelDB cache.")});
 	parser.addOption({"ec2-iam-role", QCoreApplication::translate("main", "Obtain AWS access from IAM role set to this EC2 instance."), "role"});
-	parser.addOption({"database-max-size", QCoreApplication::translate("main", "Maximum size of meta-data database. Values larger than 2GB are not supported on 32bits machines."), "GiB"});
+	parser.addOption({"database-max-size", QCoreApplication::translate("main", "Maximum size of meta-data database, it grows up to this size as needed. Values larger than 2GB are not supported on 32bits machines."), "GiB"});
+	parser.addOption({"fuse-threads", QCoreApplication::translate("main", "Number of threads receiving requests from the kernel, default 4."), "count"});
+	parser.addOption({"readahead", QCoreApplication::translate("main", "Maximum number of blocks fetched ahead of sequential reads, default 64. Use 0 to disable."), "blocks"});
+	parser.addOption({"prefetch-size", QCoreApplication::translate("main", "Files up to this size are fully fetched when opened, default 1024. Use 0 to disable."), "KiB"});
+	parser.addOption({"block-cache-size", QCoreApplication::translate("main", "Memory used to keep recently used blocks, default 256."), "MiB"});
+	parser.addOption({"data-cache-size", QCoreApplication::translate("main", "Maximum disk space used by cached data, least recently used blocks are removed past this. Default 0 for no limit."), "MiB"});
+	parser.addOption({"data-cache-min-free", QCoreApplication::translate("main", "Free disk space to leave where cached data is stored, default 1024."), "MiB"});
+	parser.addOption({"worker-threads", QCoreApplication::translate("main", "Number of threads hashing and reading blocks, default one per CPU."), "count"});
+	parser.addOption({"max-requests", QCoreApplication::translate("main", "Upper bound for concurrent S3 requests of each kind (GET, PUT), the actual number adapts to throughput and throttling. Default 512."), "count"});
+	parser.addOption({"http-threads", QCoreApplication::translate("main", "Number of threads running S3 requests, each keeps up to 6 connections per host open. Default is enough threads for --max-requests."), "count"});
+	parser.addOption({"upload-queue-memory", QCoreApplication::translate("main", "Memory used by uploads waiting to be sent, more are written to a spill file in the data path. Default 64."), "MiB"});
+	parser.addOption({"upload-spill-size", QCoreApplication::translate("main", "Disk space used by the spill file of uploads waiting to be sent, writes are held back past this. Default 2048, 0 keeps all of them in memory."), "MiB"});
+	parser.addOption({"upload-queue-size", QCoreApplication::translate("main", "Data waiting to be uploaded before writes are held back, default 1024."), "MiB"});
+	parser.addOption({"hash-algo", QCoreApplication::translate("main", "Hash used for block ids when creating a new filesystem: SHA3_256 (default), SHA256 or BLAKE2S_256. Existing filesystems keep the one they were created with."), "name"});
+	parser.addOption({"hash-benchmark", QCoreApplication::translate("main", "Measure the speed of each supported block hash on one core, then exit.")});
+	parser.addOption({"splice-read", QCoreApplication::translate("main", "Send data of blocks cached on disk to the kernel without copying it in memory.")});
 
 	parser.process(app);
 
+	if (parser.isSet("hash-benchmark")) {
+		S3FS_Hash::benchmark();
+		return 0;
+	}
+
 	const QStringList args = parser.positionalArguments();
 	if (args.length() != 2) {
 		parser.showHelp(1);
@@ -70,6 +91,27 @@ int main(int argc, char *argv[]) {
 		cfg.setAwsCredentialsUrl(QString("http://169.254.169.254/latest/meta-data/iam/security-credentials/")+parser.value("ec2-iam-role"));
 	}
 	if (parser.isSet("database-max-size")) cfg.setDatabaseMaxSize(parser.value(QStringLiteral("database-max-size")).toInt());
+	if (parser.isSet("fuse-threads")) cfg.setFuseThreads(parser.value(QStringLiteral("fuse-threads")).toInt());
+	if (parser.isSet("splice-read")) cfg.setSpliceRead(true);
+	if (parser.isSet("readahead")) cfg.setReadaheadMax(parser.value(QStringLiteral("readahead")).toInt());
+	if (parser.isSet("prefetch-size")) cfg.setPrefetchSize(parser.value(QStringLiteral("prefetch-size")).toULongLong() * 1024);
+	if (parser.isSet("block-cache-size")) cfg.setBlockCacheSize(parser.value(QStringLiteral("block-cache-size")).toULongLong() * 1048576);
+	if (parser.isSet("data-cache-size")) cfg.setDataCacheSize(parser.value(QStringLiteral("data-cache-size")).toULongLong() * 1048576);
+	if (parser.isSet("data-cache-min-free")) cfg.setDataCacheMinFree(parser.value(QStringLiteral("data-cache-min-free")).toULongLong() * 1048576);
+	if (parser.isSet("worker-threads")) cfg.setWorkerThreads(parser.value(QStringLiteral("worker-threads")).toInt());
+	if (parser.isSet("max-requests")) cfg.setMaxRequests(parser.value(QStringLiteral("max-requests")).toInt());
+	if (parser.isSet("http-threads")) cfg.setHttpThreads(parser.value(QStringLiteral("http-threads")).toInt());
+	if (parser.isSet("upload-queue-memory")) cfg.setUploadQueueMemory(parser.value(QStringLiteral("upload-queue-memory")).toULongLong() * 1048576);
+	if (parser.isSet("upload-spill-size")) cfg.setUploadSpillSize(parser.value(QStringLiteral("upload-spill-size")).toULongLong() * 1048576);
+	if (parser.isSet("upload-queue-size")) cfg.setUploadQueueSize(parser.value(QStringLiteral("upload-queue-size")).toULongLong() * 1048576);
+	if (parser.isSet("hash-algo")) {
+		QByteArray algo = parser.value(QStringLiteral("hash-algo")).toLatin1().toUpper();
+		if (S3FS_Hash::fromName(algo) == S3FS_Hash::Invalid) {
+			qCritical("Hash algorithm %s is not supported", algo.constData());
+			return 1;
+		}
+		cfg.setHashAlgo(algo);
+	}
 
 	S3FS s3clfs(&cfg);
 	S3Fuse fuse(&cfg, &s3clfs);
@@ -16,23 +16,36 @@
  */
 
 #include <QDir>
+#include <QStorageInfo>
 #include "Keyval.hpp"
 
 // DATA ACCESS LAYER (instance -> lmdb)
 
 Keyval::Keyval(QObject *parent): QObject(parent) {
 	mdb_env = NULL;
+	write_txn = NULL;
+	read_txn = NULL;
+	read_active = false;
+	batch_depth = 0;
+	flush_scheduled = false;
+	map_size = 0;
+	max_map_size = 0;
+	iterator_count = 0;
 }
 
 Keyval::~Keyval() {
-	if (mdb_env) {
-		mdb_env_close(mdb_env);
-		mdb_env = NULL;
-	}
+	close();
 }
 
 void Keyval::close() {
 	if (mdb_env) {
+		batch_depth = 0;
+		flush();
+		if (read_txn) {
+			mdb_txn_abort(read_txn);
+			read_txn = NULL;
+			read_active = false;
+		}
 		mdb_env_close(mdb_env);
 		mdb_env = NULL;
 	}
@@ -51,14 +64,22 @@ bool Keyval::open(const QString &filename, quint64 max_size) {
 		qCritical("Failed to initialize LMDB");
 		return false;
 	}
-	mdb_env_set_mapsize(mdb_env, max_size);
+	max_map_size = max_size;
+	mdb_env_set_mapsize(mdb_env, qMin(max_size, (quint64)KEYVAL_INITIAL_MAP_SIZE));
 	mdb_env_set_maxreaders(mdb_env, 1024);
+	mdb_env_set_maxdbs(mdb_env, KEYVAL_MAX_TABLES);
 	QDir(filename).mkpath(".");
 	rc = mdb_env_open(mdb_env, filename.toLocal8Bit().data(), MDB_NOMETASYNC | MDB_NOSYNC | MDB_NORDAHEAD | MDB_NOTLS, 0664);
 	if (rc != 0) {
 		qCritical("Failed to open database %s: %s", qPrintable(filename), mdb_strerror(rc));
 		return false;
 	}
+	location = filename;
+
+	// an existing database keeps the size it was grown to
+	MDB_envinfo info;
+	mdb_env_info(mdb_env, &info);
+	map_size = info.me_mapsize;
 
 	// open in a transaction
 	MDB_txn *mdb_txn;
@@ -77,100 +98,326 @@ bool Keyval::open(const QString &filename, quint64 max_size) {
 	return true;
 }
 
+bool Keyval::openTable(const char *name, KeyvalTable &table, bool integer_key) {
+	// handles opened in a transaction are only visible to others once it is committed
+	commit();
+	releaseSnapshot();
+
+	MDB_txn *mdb_txn;
+	int rc = mdb_txn_begin(mdb_env, NULL, 0, &mdb_txn);
+	if (rc != 0) {
+		qCritical("Failed to create transaction: %s", mdb_strerror(rc));
+		return false;
+	}
+	rc = mdb_dbi_open(mdb_txn, name, MDB_CREATE | (integer_key ? MDB_INTEGERKEY : 0), &table);
+	if (rc != 0) {
+		qCritical("Failed to open table %s: %s", name, mdb_strerror(rc));
+		mdb_txn_abort(mdb_txn);
+		return false;
+	}
+	rc = mdb_txn_commit(mdb_txn);
+	if (rc != 0) {
+		qCritical("Failed to open table %s: %s", name, mdb_strerror(rc));
+		return false;
+	}
+	return true;
+}
+
 bool Keyval::create(const QString &filename) {
 	return open(filename); // TODO
 }
 
-bool Keyval::insert(const QByteArray &key, const QByteArray &value) {
-	MDB_val db_key, db_data;
-	MDB_txn *txn;
+MDB_txn *Keyval::writeTxn() {
+	if (write_txn) return write_txn;
+
+	int rc = mdb_txn_begin(mdb_env, NULL, 0, &write_txn);
+	if (rc != 0) {
+		qCritical("Failed to create transaction: %s", mdb_strerror(rc));
+		write_txn = NULL;
+		return NULL;
+	}
+	if ((batch_depth == 0) && (!flush_scheduled)) {
+		// commit everything written until we get back to the event loop
+		flush_scheduled = true;
+		QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+	}
+	if (!replay_log.isEmpty()) {
+		// writes of a transaction that could not be committed, they were already reported as done
+		if (!replay()) return NULL;
+	}
+	return write_txn;
+}
+
+MDB_txn *Keyval::readTxn() {
+	if (write_txn) return write_txn; // see our own pending writes
+	if (!replay_log.isEmpty()) {
+		// pending writes not in a transaction anymore, try to get them back in one
+		MDB_txn *txn = writeTxn();
+		if (txn) return txn;
+	}
+	if (read_active) return read_txn;
+
 	int rc;
-	db_key.mv_size = key.length();
-	db_key.mv_data = const_cast<char*>(key.data());
-	db_data.mv_size = value.length();
-	db_data.mv_data = const_cast<char*>(value.data());
+	if (read_txn) {
+		rc = mdb_txn_renew(read_txn);
+	} else {
+		rc = mdb_txn_begin(mdb_env, NULL, MDB_RDONLY, &read_txn);
+	}
+	if (rc != 0) {
+		qCritical("Failed to create read transaction: %s", mdb_strerror(rc));
+		if (read_txn) mdb_txn_abort(read_txn);
+		read_txn = NULL;
+		return NULL;
+	}
+	read_active = true;
+	// keep the snapshot for the rest of this event loop iteration only, an old snapshot
+	// prevents lmdb from reusing freed pages
+	QMetaObject::invokeMethod(this, "releaseSnapshot", Qt::QueuedConnection);
+	return read_txn;
+}
+
+void Keyval::releaseSnapshot() {
+	if (!read_active) return;
+	mdb_txn_reset(read_txn);
+	read_active = false;
+}
 
-	rc = mdb_txn_begin(mdb_env, NULL, 0, &txn);
-	rc = mdb_put(txn, mdb_dbi, &db_key, &db_data, 0);
-	rc = mdb_txn_commit(txn);
+bool Keyval::flush() {
+	flush_scheduled = false;
+	if (batch_depth > 0) return true; // endBatch() will take care of it
+	return commit();
+}
+
+bool Keyval::sync() {
+	if (batch_depth == 0) {
+		if (!commit()) return false;
+	}
+	// database is opened with MDB_NOSYNC, only data committed so far is written
+	int rc = mdb_env_sync(mdb_env, 1);
 	if (rc != 0) {
-		qCritical("Failed to insert in db: %s", mdb_strerror(rc));
+		qCritical("Failed to sync db: %s", mdb_strerror(rc));
 		return false;
 	}
 	return true;
 }
 
-bool Keyval::remove(const QByteArray &key) {
-	MDB_val db_key;
-	MDB_txn *txn;
-	int rc;
+bool Keyval::commit() {
+	if (!write_txn) {
+		if (replay_log.isEmpty()) return true;
+		// left over from a transaction that could not be committed
+		if (!writeTxn()) return false;
+	}
 
-	db_key.mv_size = key.length();
-	db_key.mv_data = const_cast<char*>(key.data());
+	int rc = mdb_txn_commit(write_txn);
+	write_txn = NULL;
+	releaseSnapshot(); // snapshot predates this commit, next read needs a new one
+	if ((rc == MDB_MAP_FULL) && growMap()) {
+		// writes were replayed in a new transaction
+		return commit();
+	}
+	if (rc != 0) {
+		// keep the writes, they are replayed and committed again with the next ones
+		qCritical("Failed to commit %d writes to db: %s", replay_log.size(), mdb_strerror(rc));
+		return false;
+	}
+	replay_log.clear();
+	return true;
+}
+
+void Keyval::beginBatch() {
+	batch_depth++;
+}
+
+bool Keyval::endBatch() {
+	if (batch_depth <= 0) return false;
+	if (--batch_depth > 0) return true;
+	return commit();
+}
 
-	rc = mdb_txn_begin(mdb_env, NULL, 0, &txn);
-	rc = mdb_del(txn, mdb_dbi, &db_key, NULL);
-	rc = mdb_txn_commit(txn);
+bool Keyval::commitPrevious() {
+	// the failed transaction cannot be used anymore, writes made before the failing one are
+	// replayed in a new transaction and committed so they are not lost with it
+	if (write_txn) mdb_txn_abort(write_txn);
+	write_txn = NULL;
+	if (replay_log.isEmpty()) return true;
+	qWarning("Keyval: transaction full, committing %d pending writes early", replay_log.size());
+	return commit();
+}
+
+bool Keyval::growMap() {
+	quint64 new_size = qMin(map_size * 2, max_map_size);
+	if (new_size > map_size) {
+		// do not grow past what the disk can hold
+		QStorageInfo storage(location);
+		qint64 avail = storage.bytesAvailable() - KEYVAL_MIN_FREE_SPACE;
+		if (storage.isValid() && (avail < (qint64)(new_size - map_size)))
+			new_size = map_size + qMax(avail, (qint64)0);
+	}
+	if ((new_size <= map_size) || (iterator_count > 0)) {
+		if (iterator_count > 0) {
+			qCritical("Keyval: map is full and cannot be grown while %d iterators are open", iterator_count);
+		} else {
+			qCritical("Keyval: map is full at %llu MB", map_size / 1024 / 1024);
+		}
+		mapFull();
+		return false; // caller decides what to do with the failed transaction
+	}
+
+	// the failed transaction cannot be used anymore, its writes will be replayed
+	if (write_txn) mdb_txn_abort(write_txn);
+	write_txn = NULL;
+
+	// no transaction may be active in this process while resizing
+	if (read_txn) mdb_txn_abort(read_txn);
+	read_txn = NULL;
+	read_active = false;
+
+	int rc = mdb_env_set_mapsize(mdb_env, new_size);
 	if (rc != 0) {
-		qCritical("Failed to remove from db: %s", mdb_strerror(rc));
+		qCritical("Keyval: failed to grow map: %s", mdb_strerror(rc));
 		return false;
 	}
+	qDebug("Keyval: map grown from %llu MB to %llu MB", map_size / 1024 / 1024, new_size / 1024 / 1024);
+	map_size = new_size;
+	return replay();
+}
+
+bool Keyval::replay() {
+	QList<KeyvalOp> log;
+	log.swap(replay_log);
+	foreach(const KeyvalOp &op, log) {
+		if (!apply(op)) {
+			// keep all of them for the next attempt
+			if (write_txn) mdb_txn_abort(write_txn);
+			write_txn = NULL;
+			replay_log = log;
+			return false;
+		}
+	}
 	return true;
 }
 
-QByteArray Keyval::value(const QByteArray &key) {
+bool Keyval::apply(const KeyvalOp &op) {
 	MDB_val db_key, db_data;
-	MDB_txn *txn;
 	int rc;
-	db_key.mv_size = key.length();
-	db_key.mv_data = const_cast<char*>(key.data());
+	db_key.mv_size = op.key.length();
+	db_key.mv_data = const_cast<char*>(op.key.data());
+	db_data.mv_size = op.value.length();
+	db_data.mv_data = const_cast<char*>(op.value.data());
 
-	rc = mdb_txn_begin(mdb_env, NULL, MDB_RDONLY, &txn);
-	rc = mdb_get(txn, mdb_dbi, &db_key, &db_data);
-	if (rc != 0) {
-		mdb_txn_abort(txn);
-		return QByteArray();
+	bool alone = false;
+	while(true) {
+		MDB_txn *txn = writeTxn();
+		if (!txn) return false;
+		if (op.remove) {
+			rc = mdb_del(txn, dbi(op.table), &db_key, NULL);
+			if (rc == MDB_NOTFOUND) rc = 0;
+		} else {
+			rc = mdb_put(txn, dbi(op.table), &db_key, &db_data, 0);
+		}
+		if (rc == 0) break;
+		// growing replays everything written so far in a new transaction, then we try again
+		if ((rc == MDB_MAP_FULL) && growMap()) continue;
+		if (((rc == MDB_MAP_FULL) || (rc == MDB_TXN_FULL)) && (!alone)) {
+			// only this write fails, not the ones before it that were already reported as done
+			alone = true;
+			if (commitPrevious()) continue;
+		}
+
+		qCritical("Failed to %s db: %s", op.remove ? "remove from" : "insert in", mdb_strerror(rc));
+		if ((rc == MDB_MAP_FULL) || (rc == MDB_TXN_FULL)) {
+			// transaction is unusable, anything still pending in it is replayed by the next one
+			if (write_txn) mdb_txn_abort(write_txn);
+			write_txn = NULL;
+		}
+		return false;
 	}
-	QByteArray res((char*)db_data.mv_data, db_data.mv_size); // deep copy
-	mdb_txn_commit(txn);
+
+	replay_log.append(op);
+	// keys and values may point to memory we do not own
+	replay_log.last().key.detach();
+	replay_log.last().value.detach();
+	return true;
+}
+
+bool Keyval::insert(const QByteArray &key, const QByteArray &value, KeyvalTable table) {
+	KeyvalOp op;
+	op.remove = false;
+	op.table = table;
+	op.key = key;
+	op.value = value;
+	return apply(op);
+}
+
+bool Keyval::remove(const QByteArray &key, KeyvalTable table) {
+	KeyvalOp op;
+	op.remove = true;
+	op.table = table;
+	op.key = key;
+	return apply(op);
+}
+
+QByteArray Keyval::value(const QByteArray &key, KeyvalTable table) {
+	QByteArray res = valueView(key, table);
+	res.detach(); // deep copy
 	return res;
 }
 
-bool Keyval::contains(const QByteArray &key) {
+QByteArray Keyval::valueView(const QByteArray &key, KeyvalTable table) {
 	MDB_val db_key, db_data;
-	MDB_txn *txn;
 	int rc;
 	db_key.mv_size = key.length();
 	db_key.mv_data = const_cast<char*>(key.data());
 
-	rc = mdb_txn_begin(mdb_env, NULL, MDB_RDONLY, &txn);
-	if (rc != 0) {
-		qFatal("Failed to create transaction: %s", mdb_strerror(rc));
-	}
-	rc = mdb_get(txn, mdb_dbi, &db_key, &db_data);
-	mdb_txn_commit(txn);
+	MDB_txn *txn = readTxn();
+	if (!txn) return QByteArray();
+	rc = mdb_get(txn, dbi(table), &db_key, &db_data);
+	if (rc != 0) return QByteArray();
+	return QByteArray::fromRawData((const char*)db_data.mv_data, db_data.mv_size);
+}
+
+bool Keyval::contains(const QByteArray &key, KeyvalTable table) {
+	MDB_val db_key, db_data;
+	int rc;
+	db_key.mv_size = key.length();
+	db_key.mv_data = const_cast<char*>(key.data());
+
+	MDB_txn *txn = readTxn();
+	if (!txn) return false;
+	rc = mdb_get(txn, dbi(table), &db_key, &db_data);
 	if (rc != 0) { // ie. MDB_NOTFOUND
 		return false;
 	}
 	return true;
 }
 
+quint64 Keyval::mapSize() const {
+	return map_size;
+}
+
 bool Keyval::isValid() const {
 	return (bool)mdb_dbi;
 }
 
-bool Keyval::isEmpty() {
-	MDB_txn *txn;
+bool Keyval::isEmpty(KeyvalTable table) {
+	MDB_txn *txn = readTxn();
 	MDB_cursor *cursor;
 	int rc;
 
-	rc = mdb_txn_begin(mdb_env, NULL, MDB_RDONLY, &txn);
-	rc = mdb_cursor_open(txn, mdb_dbi, &cursor);
+	if (!txn) return true;
+	rc = mdb_cursor_open(txn, dbi(table), &cursor);
 	rc = mdb_cursor_get(cursor, NULL, NULL, MDB_FIRST);
 	
 	mdb_cursor_close(cursor);
-	mdb_txn_commit(txn);
 
 	return rc == MDB_NOTFOUND;
 }
 
+KeyvalBatch::KeyvalBatch(Keyval *_kv) {
+	kv = _kv;
+	kv->beginBatch();
+}
+
+KeyvalBatch::~KeyvalBatch() {
+	kv->endBatch();
+}
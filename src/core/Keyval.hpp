@@ -17,11 +17,28 @@
 #include <QObject>
 #include <lmdb.h>
 #include <QCache>
+#include <QList>
 
 #pragma once
 
 class KeyvalIterator;
 
+// tables are lmdb named databases, 0 stands for the main (unnamed) one
+typedef MDB_dbi KeyvalTable;
+#define KEYVAL_MAIN_TABLE 0
+#define KEYVAL_MAX_TABLES 8
+// the map starts small and is grown on demand up to the size given to open()
+#define KEYVAL_INITIAL_MAP_SIZE (256LL * 1024 * 1024)
+#define KEYVAL_MIN_FREE_SPACE (512LL * 1024 * 1024) // never grow into the last bytes of the disk
+
+// a write in the current transaction, kept so it can be replayed after the map has been grown
+struct KeyvalOp {
+	bool remove;
+	KeyvalTable table;
+	QByteArray key;
+	QByteArray value;
+};
+
 class Keyval: public QObject {
 	Q_OBJECT
 public:
@@ -31,19 +48,64 @@ public:
 	bool open(const QString &filename, quint64 max_size = 2LL * 1024 * 1024 * 1024);
 	void close();
 	bool create(const QString &filename);
-	bool insert(const QByteArray &key, const QByteArray &value);
-	bool remove(const QByteArray &key);
-	QByteArray value(const QByteArray &key);
-	bool contains(const QByteArray &key);
+	bool openTable(const char *name, KeyvalTable &table, bool integer_key = false); // integer keys are native quint64
+	bool insert(const QByteArray &key, const QByteArray &value, KeyvalTable table = KEYVAL_MAIN_TABLE);
+	bool remove(const QByteArray &key, KeyvalTable table = KEYVAL_MAIN_TABLE);
+	QByteArray value(const QByteArray &key, KeyvalTable table = KEYVAL_MAIN_TABLE);
+	QByteArray valueView(const QByteArray &key, KeyvalTable table = KEYVAL_MAIN_TABLE); // borrowed, valid until kv is written to or control returns to the event loop
+	bool contains(const QByteArray &key, KeyvalTable table = KEYVAL_MAIN_TABLE);
 
 	bool isValid() const;
-	bool isEmpty();
+	bool isEmpty(KeyvalTable table = KEYVAL_MAIN_TABLE);
+	quint64 mapSize() const;
+
+	// writes are grouped in a single transaction, committed once control returns to the event loop
+	// or when the outermost batch ends
+	void beginBatch();
+	bool endBatch();
 
 	static bool destroy(const QString &filename);
 
+signals:
+	void mapFull(); // map reached its maximum size, space needs to be freed
+
+public slots:
+	bool flush(); // commit pending writes now
+	bool sync(); // commit pending writes and wait for them to reach the disk
+	void releaseSnapshot(); // let lmdb reuse pages held by the read snapshot
+
 private:
+	MDB_txn *writeTxn();
+	MDB_txn *readTxn();
+	bool commit();
+	bool commitPrevious();
+	bool apply(const KeyvalOp &op);
+	bool growMap();
+	bool replay();
+	MDB_dbi dbi(KeyvalTable table) const { return table == KEYVAL_MAIN_TABLE ? mdb_dbi : table; }
+
 	MDB_env *mdb_env;
 	MDB_dbi mdb_dbi;
+	MDB_txn *write_txn; // pending writes, also used for reads so they see them
+	MDB_txn *read_txn; // read snapshot, reset when back to the event loop and renewed on next read
+	bool read_active;
+	int batch_depth;
+	bool flush_scheduled;
+	QString location;
+	quint64 map_size;
+	quint64 max_map_size;
+	QList<KeyvalOp> replay_log; // writes of write_txn
+	int iterator_count; // open iterators hold read transactions, which prevent resizing the map
 	friend class KeyvalIterator; // grants access to private and protected members of KeyvalIterator
 }; 
 
+// commits everything written to kv during its lifetime in a single transaction
+class KeyvalBatch {
+public:
+	KeyvalBatch(Keyval *kv);
+	~KeyvalBatch();
+
+private:
+	Keyval *kv;
+};
+
@@ -19,11 +19,14 @@
 #include "Keyval.hpp"
 
 // lmdb iterator for Keyval
-KeyvalIterator::KeyvalIterator(Keyval *_kv) {
+KeyvalIterator::KeyvalIterator(Keyval *_kv, KeyvalTable _table) {
 	kv = _kv;
+	table = _table;
+	kv->iterator_count++;
+	kv->commit(); // iterators run on their own snapshot, make sure it has pending writes
 	mdb_txn_begin(kv->mdb_env, NULL, MDB_RDONLY, &txn);
 	Q_CHECK_PTR(txn);
-	mdb_cursor_open(txn, kv->mdb_dbi, &cursor);
+	mdb_cursor_open(txn, kv->dbi(table), &cursor);
 	Q_CHECK_PTR(cursor);
 
 	mdb_cursor_get(cursor, NULL, NULL, MDB_FIRST);
@@ -33,6 +36,7 @@ KeyvalIterator::KeyvalIterator(Keyval *_kv) {
 KeyvalIterator::~KeyvalIterator() {
 	mdb_cursor_close(cursor);
 	mdb_txn_commit(txn);
+	kv->iterator_count--;
 }
 
 void KeyvalIterator::toBack() {
@@ -55,6 +59,12 @@ bool KeyvalIterator::find(const QByteArray &s) {
 	return (rc == 0);
 }
 
+bool KeyvalIterator::first() {
+	location = 0;
+	int rc = mdb_cursor_get(cursor, NULL, NULL, MDB_FIRST);
+	return (rc == 0);
+}
+
 bool KeyvalIterator::hasNext() {
 	int rc;
 	switch(location) {
@@ -155,14 +165,17 @@ QByteArray KeyvalIterator::value() {
 }
 
 void KeyvalIterator::operator=(Keyval*_kv) {
+	kv->iterator_count--;
 	kv = _kv;
+	kv->iterator_count++;
 
 	mdb_cursor_close(cursor);
 	mdb_txn_commit(txn);
 
+	kv->commit();
 	mdb_txn_begin(kv->mdb_env, NULL, MDB_RDONLY, &txn);
 	Q_CHECK_PTR(txn);
-	mdb_cursor_open(txn, kv->mdb_dbi, &cursor);
+	mdb_cursor_open(txn, kv->dbi(table), &cursor);
 	Q_CHECK_PTR(cursor);
 
 	mdb_cursor_get(cursor, NULL, NULL, MDB_FIRST);
@@ -24,10 +24,11 @@ namespace leveldb {
 	class Iterator;
 }
 class Keyval;
+typedef MDB_dbi KeyvalTable;
 
 class KeyvalIterator {
 public:
-	KeyvalIterator(Keyval*);
+	KeyvalIterator(Keyval*, KeyvalTable table = 0);
 	~KeyvalIterator();
 	QByteArray key();
 	QByteArray value();
@@ -43,6 +44,7 @@ public:
 	void toFront();
 
 	bool find(const QByteArray &);
+	bool first();
 	bool isValid();
 
 	void operator=(Keyval*);
@@ -51,6 +53,7 @@ private:
 	MDB_txn *txn;
 	MDB_cursor *cursor;
 	Keyval *kv;
+	KeyvalTable table;
 	int location;
 };
 
@@ -18,16 +18,29 @@
 #include "QtFuseRequest.hpp"
 #include <signal.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <QCoreApplication>
 #if QT_VERSION < 0x050300
 #include <contrib/QByteArrayList.hpp>
 #endif
 
 #define QTFUSE_OBJ_FROM_REQ() Q_CHECK_PTR(req); QtFuse *c = (QtFuse*)fuse_req_userdata(req); Q_CHECK_PTR(c)
-#define QTFUSE_REQ() (new QtFuseRequest(req, *c))
-#define QTFUSE_REQ_FI() (new QtFuseRequest(req, *c, fi))
+#define QTFUSE_REQ() (c->takeRequest(req))
+#define QTFUSE_REQ_FI() (c->takeRequest(req, fi))
+// ops with extra arguments pointing in the receive buffer are still handled in the receiver thread
+#define QTFUSE_DIRECT_REQ() (new QtFuseRequest(req, *c))
+#define QTFUSE_DIRECT_REQ_FI() (new QtFuseRequest(req, *c, fi))
 #define QTFUSE_NOT_IMPL(e) qDebug("fuse: %s not implemented, returning " #e, __FUNCTION__); req->error(e)
 
+#ifndef FUSE_DEV_IOC_CLONE
+// from linux/fuse.h (kernel 4.2+), not exposed by libfuse 2.x
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+
 void QtFuse::priv_qtfuse_init(void *userdata, struct fuse_conn_info *conn) {
 	QtFuse *c = (QtFuse*) userdata;
 	c->fuse_init(conn);
@@ -51,7 +64,7 @@ void QtFuse::priv_qtfuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *n
 	auto _req = QTFUSE_REQ();
 	_req->fuse_ino = parent;
 	_req->fuse_name = QByteArray(name); // null-terminated
-	c->fuse_lookup(_req);
+	c->dispatch(_req, &QtFuse::fuse_lookup);
 }
 
 void QtFuse::fuse_lookup(QtFuseRequest *req) {
@@ -72,7 +85,7 @@ void QtFuse::priv_qtfuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_fil
 	QTFUSE_OBJ_FROM_REQ();
 	auto _req = QTFUSE_REQ_FI();
 	_req->fuse_ino = ino;
-	c->fuse_getattr(_req);
+	c->dispatch(_req, &QtFuse::fuse_getattr);
 }
 
 void QtFuse::fuse_getattr(QtFuseRequest *req) {
@@ -85,7 +98,7 @@ void QtFuse::priv_qtfuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *at
 	_req->setAttr(attr);
 	_req->fuse_ino = ino;
 	_req->fuse_int = to_set;
-	c->fuse_setattr(_req);
+	c->dispatch(_req, &QtFuse::fuse_setattr);
 }
 
 void QtFuse::fuse_setattr(QtFuseRequest *req) {
@@ -96,7 +109,7 @@ void QtFuse::priv_qtfuse_readlink(fuse_req_t req, fuse_ino_t ino) {
 	QTFUSE_OBJ_FROM_REQ();
 	auto _req = QTFUSE_REQ();
 	_req->fuse_ino = ino;
-	c->fuse_readlink(_req);
+	c->dispatch(_req, &QtFuse::fuse_readlink);
 }
 
 void QtFuse::fuse_readlink(QtFuseRequest *req) {
@@ -110,7 +123,7 @@ void QtFuse::priv_qtfuse_mknod(fuse_req_t req, fuse_ino_t parent, const char *na
 	_req->fuse_name = QByteArray(name);
 	_req->fuse_int = mode;
 	_req->fuse_newino = rdev; // 64bits int, shouldn't be used for that but well...
-	c->fuse_mknod(_req);
+	c->dispatch(_req, &QtFuse::fuse_mknod);
 }
 
 void QtFuse::fuse_mknod(QtFuseRequest *req) {
@@ -123,7 +136,7 @@ void QtFuse::priv_qtfuse_mkdir(fuse_req_t req, fuse_ino_t parent, const char *na
 	_req->fuse_ino = parent;
 	_req->fuse_name = QByteArray(name);
 	_req->fuse_int = mode;
-	c->fuse_mkdir(_req);
+	c->dispatch(_req, &QtFuse::fuse_mkdir);
 }
 
 void QtFuse::fuse_mkdir(QtFuseRequest *req) {
@@ -135,7 +148,7 @@ void QtFuse::priv_qtfuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *n
 	auto _req = QTFUSE_REQ();
 	_req->fuse_ino = parent;
 	_req->fuse_name = name;
-	c->fuse_unlink(_req);
+	c->dispatch(_req, &QtFuse::fuse_unlink);
 }
 
 void QtFuse::fuse_unlink(QtFuseRequest *req) {
@@ -147,7 +160,7 @@ void QtFuse::priv_qtfuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *na
 	auto _req = QTFUSE_REQ();
 	_req->fuse_ino = parent;
 	_req->fuse_name = name;
-	c->fuse_rmdir(_req);
+	c->dispatch(_req, &QtFuse::fuse_rmdir);
 }
 
 void QtFuse::fuse_rmdir(QtFuseRequest *req) {
@@ -160,7 +173,7 @@ void QtFuse::priv_qtfuse_symlink(fuse_req_t req, const char *link, fuse_ino_t pa
 	_req->fuse_ino = parent;
 	_req->fuse_name = QByteArray(name);
 	_req->fuse_value = QByteArray(link);
-	c->fuse_symlink(_req);
+	c->dispatch(_req, &QtFuse::fuse_symlink);
 }
 
 void QtFuse::fuse_symlink(QtFuseRequest *req) {
@@ -174,7 +187,7 @@ void QtFuse::priv_qtfuse_rename(fuse_req_t req, fuse_ino_t parent, const char *n
 	_req->fuse_newino = newparent;
 	_req->fuse_name = QByteArray(name);
 	_req->fuse_value = QByteArray(newname);
-	c->fuse_rename(_req);
+	c->dispatch(_req, &QtFuse::fuse_rename);
 }
 
 void QtFuse::fuse_rename(QtFuseRequest *req) {
@@ -187,7 +200,7 @@ void QtFuse::priv_qtfuse_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newpare
 	_req->fuse_ino = ino;
 	_req->fuse_newino = newparent;
 	_req->fuse_value = QByteArray(newname);
-	c->fuse_link(_req);
+	c->dispatch(_req, &QtFuse::fuse_link);
 }
 
 void QtFuse::fuse_link(QtFuseRequest *req) {
@@ -198,7 +211,7 @@ void QtFuse::priv_qtfuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_i
 	QTFUSE_OBJ_FROM_REQ();
 	auto _req = QTFUSE_REQ_FI();
 	_req->fuse_ino = ino;
-	c->fuse_open(_req);
+	c->dispatch(_req, &QtFuse::fuse_open);
 }
 
 void QtFuse::fuse_open(QtFuseRequest *req) {
@@ -211,7 +224,7 @@ void QtFuse::priv_qtfuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t
 	_req->fuse_ino = ino;
 	_req->fuse_size = size;
 	_req->fuse_offset = off;
-	c->fuse_read(_req);
+	c->dispatch(_req, &QtFuse::fuse_read);
 }
 
 void QtFuse::fuse_read(QtFuseRequest *req) {
@@ -224,7 +237,7 @@ void QtFuse::priv_qtfuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 	_req->fuse_ino = ino;
 	_req->fuse_value = QByteArray(buf, size);
 	_req->fuse_offset = off;
-	c->fuse_write(_req);
+	c->dispatch(_req, &QtFuse::fuse_write);
 }
 
 void QtFuse::fuse_write(QtFuseRequest *req) {
@@ -235,7 +248,7 @@ void QtFuse::priv_qtfuse_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_
 	QTFUSE_OBJ_FROM_REQ();
 	auto _req = QTFUSE_REQ_FI();
 	_req->fuse_ino = ino;
-	c->fuse_flush(_req);
+	c->dispatch(_req, &QtFuse::fuse_flush);
 }
 
 void QtFuse::fuse_flush(QtFuseRequest *req) {
@@ -246,7 +259,7 @@ void QtFuse::priv_qtfuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_fil
 	QTFUSE_OBJ_FROM_REQ();
 	auto _req = QTFUSE_REQ_FI();
 	_req->fuse_ino = ino;
-	c->fuse_release(_req);
+	c->dispatch(_req, &QtFuse::fuse_release);
 }
 
 void QtFuse::fuse_release(QtFuseRequest *req) {
@@ -258,7 +271,7 @@ void QtFuse::priv_qtfuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, str
 	auto _req = QTFUSE_REQ_FI();
 	_req->fuse_ino = ino;
 	_req->fuse_int = datasync;
-	c->fuse_fsync(_req);
+	c->dispatch(_req, &QtFuse::fuse_fsync);
 }
 
 void QtFuse::fuse_fsync(QtFuseRequest *req) {
@@ -269,7 +282,7 @@ void QtFuse::priv_qtfuse_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_fil
 	QTFUSE_OBJ_FROM_REQ();
 	auto _req = QTFUSE_REQ_FI();
 	_req->fuse_ino = ino;
-	c->fuse_opendir(_req);
+	c->dispatch(_req, &QtFuse::fuse_opendir);
 }
 
 void QtFuse::fuse_opendir(QtFuseRequest *req) {
@@ -282,7 +295,7 @@ void QtFuse::priv_qtfuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, of
 	_req->prepareBuffer(size);
 	_req->fuse_ino = ino;
 	_req->fuse_offset = off;
-	c->fuse_readdir(_req);
+	c->dispatch(_req, &QtFuse::fuse_readdir);
 }
 
 void QtFuse::fuse_readdir(QtFuseRequest *req) {
@@ -293,7 +306,7 @@ void QtFuse::priv_qtfuse_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_
 	QTFUSE_OBJ_FROM_REQ();
 	auto _req = QTFUSE_REQ_FI();
 	_req->fuse_ino = ino;
-	c->fuse_releasedir(_req);
+	c->dispatch(_req, &QtFuse::fuse_releasedir);
 }
 
 void QtFuse::fuse_releasedir(QtFuseRequest *req) {
@@ -305,7 +318,7 @@ void QtFuse::priv_qtfuse_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
 	auto _req = QTFUSE_REQ_FI();
 	_req->fuse_ino = ino;
 	_req->fuse_int = datasync;
-	c->fuse_fsyncdir(_req);
+	c->dispatch(_req, &QtFuse::fuse_fsyncdir);
 }
 
 void QtFuse::fuse_fsyncdir(QtFuseRequest *req) {
@@ -316,7 +329,7 @@ void QtFuse::priv_qtfuse_statfs(fuse_req_t req, fuse_ino_t ino) {
 	QTFUSE_OBJ_FROM_REQ();
 	auto _req = QTFUSE_REQ();
 	_req->fuse_ino = ino;
-	c->fuse_statfs(_req);
+	c->dispatch(_req, &QtFuse::fuse_statfs);
 }
 
 void QtFuse::fuse_statfs(QtFuseRequest *req) {
@@ -331,7 +344,7 @@ void QtFuse::priv_qtfuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *na
 	_req->fuse_value = QByteArray(value);
 	_req->fuse_size = size;
 	_req->fuse_int = flags;
-	c->fuse_setxattr(_req);
+	c->dispatch(_req, &QtFuse::fuse_setxattr);
 }
 
 void QtFuse::fuse_setxattr(QtFuseRequest *req) {
@@ -344,7 +357,7 @@ void QtFuse::priv_qtfuse_getxattr(fuse_req_t req, fuse_ino_t ino, const char *na
 	_req->fuse_ino = ino;
 	_req->fuse_name = QByteArray(name);
 	_req->fuse_size = size;
-	c->fuse_getxattr(_req);
+	c->dispatch(_req, &QtFuse::fuse_getxattr);
 }
 
 void QtFuse::fuse_getxattr(QtFuseRequest *req) {
@@ -356,7 +369,7 @@ void QtFuse::priv_qtfuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 	auto _req = QTFUSE_REQ();
 	_req->fuse_ino = ino;
 	_req->fuse_size = size;
-	c->fuse_listxattr(_req);
+	c->dispatch(_req, &QtFuse::fuse_listxattr);
 }
 
 void QtFuse::fuse_listxattr(QtFuseRequest *req) {
@@ -368,7 +381,7 @@ void QtFuse::priv_qtfuse_removexattr(fuse_req_t req, fuse_ino_t ino, const char
 	auto _req = QTFUSE_REQ();
 	_req->fuse_ino = ino;
 	_req->fuse_name = QByteArray(name);
-	c->fuse_removexattr(_req);
+	c->dispatch(_req, &QtFuse::fuse_removexattr);
 }
 
 void QtFuse::fuse_removexattr(QtFuseRequest *req) {
@@ -380,7 +393,7 @@ void QtFuse::priv_qtfuse_access(fuse_req_t req, fuse_ino_t ino, int mask) {
 	auto _req = QTFUSE_REQ();
 	_req->fuse_ino = ino;
 	_req->fuse_int = mask;
-	c->fuse_access(_req);
+	c->dispatch(_req, &QtFuse::fuse_access);
 }
 
 void QtFuse::fuse_access(QtFuseRequest *req) {
@@ -393,7 +406,7 @@ void QtFuse::priv_qtfuse_create(fuse_req_t req, fuse_ino_t parent, const char *n
 	_req->fuse_ino = parent;
 	_req->fuse_name = QByteArray(name);
 	_req->fuse_int = mode;
-	c->fuse_create(_req);
+	c->dispatch(_req, &QtFuse::fuse_create);
 }
 
 void QtFuse::fuse_create(QtFuseRequest *req) {
@@ -402,7 +415,7 @@ void QtFuse::fuse_create(QtFuseRequest *req) {
 
 void QtFuse::priv_qtfuse_getlk(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct flock *lock) {
 	QTFUSE_OBJ_FROM_REQ();
-	c->fuse_getlk(QTFUSE_REQ_FI(), ino, lock);
+	c->fuse_getlk(QTFUSE_DIRECT_REQ_FI(), ino, lock);
 }
 
 void QtFuse::fuse_getlk(QtFuseRequest *req, fuse_ino_t, struct flock*) {
@@ -411,7 +424,7 @@ void QtFuse::fuse_getlk(QtFuseRequest *req, fuse_ino_t, struct flock*) {
 
 void QtFuse::priv_qtfuse_setlk(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct flock *lock, int sleep) {
 	QTFUSE_OBJ_FROM_REQ();
-	c->fuse_setlk(QTFUSE_REQ_FI(), ino, lock, sleep);
+	c->fuse_setlk(QTFUSE_DIRECT_REQ_FI(), ino, lock, sleep);
 }
 
 void QtFuse::fuse_setlk(QtFuseRequest *req, fuse_ino_t, struct flock*, int) {
@@ -420,7 +433,7 @@ void QtFuse::fuse_setlk(QtFuseRequest *req, fuse_ino_t, struct flock*, int) {
 
 void QtFuse::priv_qtfuse_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize, uint64_t idx) {
 	QTFUSE_OBJ_FROM_REQ();
-	c->fuse_bmap(QTFUSE_REQ(), ino, blocksize, idx);
+	c->fuse_bmap(QTFUSE_DIRECT_REQ(), ino, blocksize, idx);
 }
 
 void QtFuse::fuse_bmap(QtFuseRequest *req, fuse_ino_t, size_t, uint64_t) {
@@ -429,7 +442,7 @@ void QtFuse::fuse_bmap(QtFuseRequest *req, fuse_ino_t, size_t, uint64_t) {
 
 void QtFuse::priv_qtfuse_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
 	QTFUSE_OBJ_FROM_REQ();
-	c->fuse_ioctl(QTFUSE_REQ_FI(), ino, cmd, arg, flags, in_buf, in_bufsz, out_bufsz);
+	c->fuse_ioctl(QTFUSE_DIRECT_REQ_FI(), ino, cmd, arg, flags, in_buf, in_bufsz, out_bufsz);
 }
 
 void QtFuse::fuse_ioctl(QtFuseRequest *req, fuse_ino_t, int, void *, unsigned, const void *, size_t, size_t) {
@@ -438,7 +451,7 @@ void QtFuse::fuse_ioctl(QtFuseRequest *req, fuse_ino_t, int, void *, unsigned, c
 
 void QtFuse::priv_qtfuse_poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct fuse_pollhandle *ph) {
 	QTFUSE_OBJ_FROM_REQ();
-	c->fuse_poll(QTFUSE_REQ_FI(), ino, ph);
+	c->fuse_poll(QTFUSE_DIRECT_REQ_FI(), ino, ph);
 }
 
 void QtFuse::fuse_poll(QtFuseRequest *req, fuse_ino_t, struct fuse_pollhandle*) {
@@ -447,7 +460,6 @@ void QtFuse::fuse_poll(QtFuseRequest *req, fuse_ino_t, struct fuse_pollhandle*)
 
 void QtFuse::priv_qtfuse_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
 	QTFUSE_OBJ_FROM_REQ();
-	auto _req = QTFUSE_REQ_FI();
 
 	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
 	QByteArray dst_buf;
@@ -456,21 +468,22 @@ void QtFuse::priv_qtfuse_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_b
 	ssize_t res = fuse_buf_copy(&dst, bufv, FUSE_BUF_NO_SPLICE);
 
 	if (res < 0) {
-		_req->error(-res);
+		fuse_reply_err(req, -res);
 		return;
 	}
 
 	dst_buf.resize(res);
 
+	auto _req = QTFUSE_REQ_FI();
 	_req->fuse_ino = ino;
 	_req->fuse_value = dst_buf;
 	_req->fuse_offset = off;
-	c->fuse_write(_req);
+	c->dispatch(_req, &QtFuse::fuse_write);
 }
 
 void QtFuse::priv_qtfuse_retrieve_reply(fuse_req_t req, void *cookie, fuse_ino_t ino, off_t offset, struct fuse_bufvec *bufv) {
 	QTFUSE_OBJ_FROM_REQ();
-	c->fuse_retrieve_reply(QTFUSE_REQ(), cookie, ino, offset, bufv);
+	c->fuse_retrieve_reply(QTFUSE_DIRECT_REQ(), cookie, ino, offset, bufv);
 }
 
 void QtFuse::fuse_retrieve_reply(QtFuseRequest *req, void*, fuse_ino_t, off_t, struct fuse_bufvec *) {
@@ -490,7 +503,7 @@ void QtFuse::fuse_forget_multi(size_t count, struct fuse_forget_data *forgets) {
 
 void QtFuse::priv_qtfuse_flock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, int op) {
 	QTFUSE_OBJ_FROM_REQ();
-	c->fuse_flock(QTFUSE_REQ_FI(), ino, op);
+	c->fuse_flock(QTFUSE_DIRECT_REQ_FI(), ino, op);
 }
 
 void QtFuse::fuse_flock(QtFuseRequest *req, fuse_ino_t, int) {
@@ -499,7 +512,7 @@ void QtFuse::fuse_flock(QtFuseRequest *req, fuse_ino_t, int) {
 
 void QtFuse::priv_qtfuse_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
 	QTFUSE_OBJ_FROM_REQ();
-	c->fuse_fallocate(QTFUSE_REQ_FI(), ino, mode, offset, length);
+	c->fuse_fallocate(QTFUSE_DIRECT_REQ_FI(), ino, mode, offset, length);
 }
 
 void QtFuse::fuse_fallocate(QtFuseRequest *req, fuse_ino_t, int, off_t, off_t) {
@@ -555,6 +568,10 @@ static void exit_handler(int) {
 	QCoreApplication::quit();
 }
 
+static void wakeup_handler(int) {
+	// nothing to do, only there so a blocking read() of the device fails with EINTR
+}
+
 static int set_one_signal_handler(int sig, void (*handler)(int)) {
 	struct sigaction sa;
 
@@ -566,6 +583,181 @@ static int set_one_signal_handler(int sig, void (*handler)(int)) {
 	return sigaction(sig, &sa, NULL);
 }
 
+// channel operations for cloned /dev/fuse file descriptors, libfuse 2.x only knows about one channel per session
+static int qtfuse_clone_receive(struct fuse_chan **chp, char *buf, size_t size) {
+	struct fuse_chan *ch = *chp;
+	ssize_t res;
+
+	while(true) {
+		res = read(fuse_chan_fd(ch), buf, size);
+		if (res != -1) return res;
+		int err = errno;
+		if (err == ENOENT) continue; // request was interrupted, try again
+		if (err == ENODEV) return 0; // filesystem was unmounted
+		if ((err != EINTR) && (err != EAGAIN)) perror("fuse: reading device");
+		return -err;
+	}
+}
+
+static int qtfuse_clone_send(struct fuse_chan *ch, const struct iovec iov[], size_t count) {
+	if (!iov) return 0;
+
+	ssize_t res = writev(fuse_chan_fd(ch), iov, count);
+	if (res == -1) {
+		int err = errno;
+		if ((err != ENOENT) && (err != ENODEV)) perror("fuse: writing device"); // ENOENT means request was interrupted
+		return -err;
+	}
+	return 0;
+}
+
+static void qtfuse_clone_destroy(struct fuse_chan *ch) {
+	close(fuse_chan_fd(ch));
+}
+
+static struct fuse_chan_ops qtfuse_clone_op = {
+	qtfuse_clone_receive,
+	qtfuse_clone_send,
+	qtfuse_clone_destroy,
+};
+
+struct fuse_chan *QtFuse::cloneChannel() {
+	// a cloned fd gets its own request queue in the kernel, avoiding all threads fighting over a single fd
+	int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fd == -1) return NULL;
+
+	uint32_t master_fd = fuse_chan_fd(chan);
+	if (ioctl(fd, FUSE_DEV_IOC_CLONE, &master_fd) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	struct fuse_chan *ch = fuse_chan_new(&qtfuse_clone_op, fd, fuse_chan_bufsize(chan), this);
+	if (!ch) close(fd);
+	return ch;
+}
+
+void QtFuse::receiveLoop(struct fuse_chan *ch) {
+	struct fuse_buf fuse_buf;
+	memset(&fuse_buf, 0, sizeof(fuse_buf));
+	size_t bufsize = fuse_chan_bufsize(ch);
+	char *fuse_buf_mem = (char *) malloc(bufsize);
+	Q_CHECK_PTR(fuse_buf_mem);
+
+	while (!fuse_session_exited(fuse)) {
+		struct fuse_chan *tmpch = ch;
+		fuse_buf.size = bufsize;
+		fuse_buf.mem = fuse_buf_mem;
+		fuse_buf.flags = (enum fuse_buf_flags)0;
+
+		int res = fuse_session_receive_buf(fuse, &fuse_buf, &tmpch);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0)
+			break;
+
+		fuse_session_process_buf(fuse, &fuse_buf, tmpch);
+	}
+	fuse_session_exit(fuse);
+
+	free(fuse_buf_mem);
+}
+
+void *QtFuse::qtfuse_start_thread(void *_c) {
+	qtfuse_receiver *r = (qtfuse_receiver*)_c;
+	r->parent->receiveLoop(r->chan);
+	return NULL;
+}
+
+void QtFuse::wakeReceiver(pthread_t thread) {
+	// the session is flagged as exited, the signal interrupts a read() waiting for the kernel so the
+	// receive loop sees it. The signal may land right before read() is entered, so keep sending it
+	// until the thread is gone.
+	while(true) {
+		pthread_kill(thread, QTFUSE_WAKEUP_SIGNAL);
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 50000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (pthread_timedjoin_np(thread, NULL, &ts) != ETIMEDOUT) return;
+	}
+}
+
+void QtFuse::stopReceivers() {
+	// only called from run(), receivers are started and stopped by the same thread
+	fuse_session_exit(fuse);
+	foreach(auto r, receivers) {
+		wakeReceiver(r->thread);
+		if (r->chan != chan) fuse_chan_destroy(r->chan);
+		delete r;
+	}
+	receivers.clear();
+}
+
+QtFuseRequest *QtFuse::takeRequest(fuse_req_t req, struct fuse_file_info *fi) {
+	QtFuseRequest *r = pool.dequeue();
+	if (!r) r = new QtFuseRequest(*this); // pool empty, this request will join it once answered
+	r->reset(req, fi);
+	return r;
+}
+
+void QtFuse::dispatch(QtFuseRequest *r, qtfuse_handler handler) {
+	r->handler = handler;
+	while(!pending.enqueue(r)) {
+		if (fuse_session_exited(fuse)) {
+			// shutting down, nobody is going to empty the queue anymore
+			fuse_reply_err(r->req, EINTR);
+			delete r;
+			return;
+		}
+		// main thread is lagging behind, give it a chance to catch up
+		wakeup();
+		QThread::yieldCurrentThread();
+	}
+	wakeup();
+}
+
+void QtFuse::wakeup() {
+	// only one wakeup event in flight at any given time
+	if (wakeup_pending.testAndSetOrdered(0, 1))
+		QCoreApplication::postEvent(this, new QEvent((QEvent::Type)QTFUSE_QUEUE_EVENT));
+}
+
+void QtFuse::customEvent(QEvent *e) {
+	if (e->type() == QTFUSE_QUEUE_EVENT) {
+		processQueue();
+		return;
+	}
+	QThread::customEvent(e);
+}
+
+void QtFuse::processQueue() {
+	wakeup_pending.storeRelease(0);
+
+	// requests answered since last run are not referenced anymore
+	foreach(auto r, released) {
+		r->recycle();
+		if (!pool.enqueue(r)) delete r;
+	}
+	released.clear();
+
+	for(int i = 0; i < QTFUSE_QUEUE_BATCH; i++) {
+		QtFuseRequest *r = pending.dequeue();
+		if (!r) return;
+		(this->*(r->handler))(r);
+	}
+	// more work pending, let other events through before continuing
+	wakeup();
+}
+
+void QtFuse::releaseRequest(QtFuseRequest *r) {
+	released.append(r);
+	wakeup();
+}
+
 void QtFuse::run() {
 	fuse_cleaned = false;
 
@@ -594,32 +786,37 @@ void QtFuse::run() {
 	fuse_opt_free_args(&args);
 
 	fuse_session_add_chan(fuse, chan);
-
-	struct fuse_buf fuse_buf;
-	memset(&fuse_buf, 0, sizeof(fuse_buf));
-	size_t bufsize = fuse_chan_bufsize(chan);
-	char *fuse_buf_mem = (char *) malloc(bufsize);
-	Q_CHECK_PTR(fuse_buf_mem);
+	fuse_thread = pthread_self();
+	fuse_running.storeRelease(1);
+
+	// start extra receivers, this thread counts as one
+	int cloned = 0;
+	for(int i = 1; i < thread_count; i++) {
+		auto r = new qtfuse_receiver;
+		r->parent = this;
+		r->chan = cloneChannel();
+		if (r->chan) {
+			cloned++;
+		} else {
+			r->chan = chan; // kernel too old, share main channel
+		}
+		if (pthread_create(&r->thread, NULL, qtfuse_start_thread, r) != 0) {
+			qWarning("QtFuse: failed to start receiver thread, running with %d threads", i);
+			if (r->chan != chan) fuse_chan_destroy(r->chan);
+			delete r;
+			break;
+		}
+		receivers.append(r);
+	}
+	if (thread_count > 1)
+		qDebug("QtFuse: receiving requests on %d threads (%d cloned channels)", receivers.size()+1, cloned);
 
 	ready();
 
-	while (!fuse_session_exited(fuse)) {
-		tmpch = chan;
-		fuse_buf.size = bufsize;
-		fuse_buf.mem = fuse_buf_mem;
-		fuse_buf.flags = (enum fuse_buf_flags)0;
-
-		res = fuse_session_receive_buf(fuse, &fuse_buf, &tmpch);
-//		res = fuse_chan_recv_buf(&tmpch, &fuse_buf, bufsize);
-		if (res == -EINTR)
-			continue;
-		if (res <= 0)
-			break;
-		//fuse_session_process(fuse, fuse_buf, fuse_buf_len, tmpch);
-		fuse_session_process_buf(fuse, &fuse_buf, tmpch);
-	}
+	receiveLoop(chan);
 
-//	free(fuse_buf);
+	fuse_running.storeRelease(0);
+	stopReceivers();
 	fuse_session_reset(fuse);
 
 	fuse_unmount(mountpoint, chan);
@@ -644,36 +841,51 @@ void QtFuse::prepare() {
 	qRegisterMetaType<struct fuse_bufvec*>("struct fuse_bufvec*");
 }
 
-QtFuse::QtFuse(const QByteArray &_mp, const QByteArray &_src, const QByteArray &_opts, QObject *parent): QThread(parent) {
+QtFuse::QtFuse(const QByteArray &_mp, const QByteArray &_src, const QByteArray &_opts, QObject *parent): QThread(parent), pending(QTFUSE_QUEUE_SIZE), pool(QTFUSE_QUEUE_SIZE) {
 	// required in some cases by Qt
 	prepare();
 
 	mp = _mp;
 	src = _src;
 	opts = _opts;
+	thread_count = 1;
+	fuse_cleaned = true; // nothing to clean until run() mounts
+	fuse_running.store(0);
+	wakeup_pending.store(0);
 	// so we can catch ^C and killed processes, make those signal call QCoreApplication::quit()
 	if (!signals_set) {
 		signals_set = true;
 		set_one_signal_handler(SIGHUP, exit_handler);
 		set_one_signal_handler(SIGINT, exit_handler);
 		set_one_signal_handler(SIGTERM, exit_handler);
+		set_one_signal_handler(QTFUSE_WAKEUP_SIGNAL, wakeup_handler);
 	}
 	connect(QCoreApplication::instance(), SIGNAL(aboutToQuit()), this, SLOT(quit()));
 }
 
 void QtFuse::quit() {
 	if (fuse_cleaned) return;
-	// attempt to stop fuse thread (we might die here)
-	terminate();
-	// teardown fuse
-	fuse_session_reset(fuse);
-	fuse_unmount(mountpoint, chan);
-	fuse_session_destroy(fuse);
-	fuse_cleaned = true;
+	// let run() leave its receive loop, it then stops the other receivers and unmounts
+	if (fuse_running.loadAcquire()) {
+		fuse_session_exit(fuse);
+		pthread_kill(fuse_thread, QTFUSE_WAKEUP_SIGNAL);
+	}
+	while(!wait(50)) {
+		if (fuse_running.loadAcquire()) pthread_kill(fuse_thread, QTFUSE_WAKEUP_SIGNAL);
+	}
 }
 
 QtFuse::~QtFuse() {
 	quit();
+	qDeleteAll(released);
+	released.clear();
+	QtFuseRequest *r;
+	while((r = pool.dequeue()) != NULL) delete r;
+}
+
+void QtFuse::setThreadCount(int c) {
+	if (c < 1) c = 1;
+	thread_count = c;
 }
 
 void QtFuse::start() {
@@ -6,6 +6,8 @@
 #include <pthread.h>
 #include <errno.h>
 #include <QThread>
+#include <QAtomicInt>
+#include "QtFuseRequestQueue.hpp"
 
 /*  S3ClFS - AWS S3 backed cluster filesystem
  *  Copyright (C) 2015 Mark Karpeles
@@ -34,8 +36,25 @@ struct qtfuse_callback_data {
 };
 
 class QtFuse;
+
+struct qtfuse_receiver {
+	QtFuse *parent;
+	struct fuse_chan *chan; // either the main channel, or a cloned /dev/fuse fd
+	pthread_t thread;
+};
+
 class QtFuseRequest;
 
+// requests are handed from receiver threads to the main thread through a lock-free queue,
+// request objects are recycled through a pool rather than allocated for each call
+#define QTFUSE_QUEUE_SIZE 4096
+#define QTFUSE_QUEUE_BATCH 64
+#define QTFUSE_QUEUE_EVENT (QEvent::User+2)
+// sent to receiver threads to interrupt a blocking read of the device on shutdown
+#define QTFUSE_WAKEUP_SIGNAL SIGUSR2
+
+typedef void (QtFuse::*qtfuse_handler)(QtFuseRequest *req);
+
 class QtFuse: public QThread {
 	Q_OBJECT;
 public:
@@ -43,6 +62,8 @@ public:
 	~QtFuse();
 	static void prepare();
 	void start();
+	void setThreadCount(int); // number of threads receiving requests from the kernel
+	void releaseRequest(QtFuseRequest *req); // called by answered pooled requests
 
 signals:
 	void ready();
@@ -52,6 +73,7 @@ public slots:
 
 protected:
 	void run();
+	void customEvent(QEvent *e);
 	virtual void fuse_init(struct fuse_conn_info *);
 	virtual void fuse_destroy();
 	virtual void fuse_lookup(QtFuseRequest *req);
@@ -98,8 +120,24 @@ private:
 	QByteArray mp; // mount point
 	QByteArray src;
 	QByteArray opts;
-	pthread_t thread;
 	bool fuse_cleaned;
+	int thread_count;
+	pthread_t fuse_thread; // runs run(), also the first receiver
+	QAtomicInt fuse_running; // fuse_thread is in its receive loop
+	QList<qtfuse_receiver*> receivers;
+	QtFuseRequestQueue pending; // requests waiting to be handled by the main thread
+	QtFuseRequestQueue pool; // free request objects
+	QAtomicInt wakeup_pending;
+	QList<QtFuseRequest*> released; // answered requests, returned to pool on next queue run
+
+	QtFuseRequest *takeRequest(fuse_req_t req, struct fuse_file_info *fi = 0);
+	void dispatch(QtFuseRequest *req, qtfuse_handler handler);
+	void wakeup();
+	void processQueue();
+	void receiveLoop(struct fuse_chan *ch);
+	struct fuse_chan *cloneChannel();
+	void wakeReceiver(pthread_t thread);
+	void stopReceivers();
 
 	static void *qtfuse_start_thread(void *_c);
 	static void priv_qtfuse_init(void *userdata, struct fuse_conn_info *conn);
@@ -148,7 +186,7 @@ private:
 
 	// for fuse use
 	struct fuse_session *fuse;
-	struct fuse_chan *chan, *tmpch;
+	struct fuse_chan *chan;
 	char *mountpoint;
 };
 
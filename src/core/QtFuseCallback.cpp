@@ -11,6 +11,12 @@ void QtFuseCallback::setMethod(QtFuseCallbackDummyCallback *obj, void (QtFuseCal
 	cb_func = cb;
 }
 
+void QtFuseCallback::resetCallback() {
+	QCoreApplication::removePostedEvents(this);
+	cb_obj = NULL;
+	error_no = 0;
+}
+
 void QtFuseCallback::trigger() {
 	if (cb_obj == NULL) return; // nope!
 	(cb_obj->*cb_func)(this);
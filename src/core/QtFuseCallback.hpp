@@ -37,6 +37,7 @@ public slots:
 
 protected:
 	virtual void customEvent(QEvent *e);
+	void resetCallback(); // forget method and error, for objects being reused
 
 private:
 	QtFuseCallbackDummyCallback *cb_obj;
@@ -0,0 +1,59 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "QtFuseCallbackGroup.hpp"
+#include <errno.h>
+
+QtFuseCallbackGroup::QtFuseCallbackGroup(QtFuseCallback *_target, QObject *parent): QtFuseCallback(parent) {
+	target = _target;
+	pending = 0;
+	started = false;
+	failed = false;
+	setMethod(this, &QtFuseCallbackGroup::done);
+}
+
+void QtFuseCallbackGroup::addPending() {
+	pending++;
+}
+
+void QtFuseCallbackGroup::start() {
+	started = true;
+	check();
+}
+
+void QtFuseCallbackGroup::error(int) {
+	// do not call QtFuseCallback::error() as it would trigger later, after we may already be gone
+	failed = true;
+	done(this);
+}
+
+void QtFuseCallbackGroup::done(QtFuseCallback *) {
+	pending--;
+	check();
+}
+
+void QtFuseCallbackGroup::check() {
+	if ((!started) || (pending > 0)) return;
+	started = false; // only once
+
+	if (failed) {
+		target->error(EIO);
+	} else {
+		target->trigger();
+	}
+	deleteLater();
+}
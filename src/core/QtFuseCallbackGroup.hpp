@@ -0,0 +1,43 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "QtFuseCallback.hpp"
+
+#pragma once
+
+// waits for several callbacks, then triggers target once (or calls target->error(EIO) if any failed)
+// the group registers itself in place of target in each wait list, and deletes itself when done
+class QtFuseCallbackGroup: public QtFuseCallback {
+	Q_OBJECT
+public:
+	QtFuseCallbackGroup(QtFuseCallback *target, QObject *parent = 0);
+
+	void addPending(); // one more trigger to wait for
+	void start(); // all pending triggers have been added
+
+public slots:
+	virtual void error(int);
+
+private:
+	void done(QtFuseCallback *);
+	void check();
+
+	QtFuseCallback *target;
+	int pending;
+	bool started;
+	bool failed;
+};
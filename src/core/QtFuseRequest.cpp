@@ -19,7 +19,7 @@
 #include <QCoreApplication>
 #include <QTimer>
 
-#define CHECK_ANSWER() if (answered) return; answered = true; QTimer::singleShot(0,this,SLOT(deleteLater()))
+#define CHECK_ANSWER() if (answered) return; answered = true; release()
 
 QtFuseRequest::QtFuseRequest(fuse_req_t _req, QtFuse &_parent, struct fuse_file_info *_fi): parent(_parent) {
 	Q_CHECK_PTR(_req);
@@ -27,13 +27,75 @@ QtFuseRequest::QtFuseRequest(fuse_req_t _req, QtFuse &_parent, struct fuse_file_
 	req = _req;
 	if (_fi) fuse_fi = *_fi;
 	answered = false;
+	pooled = false;
+	handler = NULL;
+	op_state = NULL;
 	data_buf = NULL;
 	buf_size = 0;
 	buf_pos = 0;
 }
 
+QtFuseRequest::QtFuseRequest(QtFuse &_parent): parent(_parent) {
+	moveToThread(QCoreApplication::instance()->thread());
+	req = NULL;
+	answered = true;
+	pooled = true;
+	handler = NULL;
+	op_state = NULL;
+	data_buf = NULL;
+	buf_size = 0;
+	buf_pos = 0;
+}
+
+void QtFuseRequest::reset(fuse_req_t _req, struct fuse_file_info *_fi) {
+	// called from a receiver thread, the object is not visible to anyone else at this point
+	Q_CHECK_PTR(_req);
+	req = _req;
+	if (_fi) {
+		fuse_fi = *_fi;
+	} else {
+		memset(&fuse_fi, 0, sizeof(fuse_fi));
+	}
+	answered = false;
+	fuse_ino = fuse_newino = 0;
+	fuse_int = 0;
+	fuse_size = 0;
+	fuse_offset = 0;
+}
+
+void QtFuseRequest::recycle() {
+	// called from main thread before the object goes back to the pool
+	resetCallback();
+	setState(NULL);
+	fuse_name.clear();
+	fuse_value.clear();
+	if (data_buf != NULL) delete data_buf;
+	data_buf = NULL;
+	buf_size = 0;
+	buf_pos = 0;
+	req = NULL;
+}
+
+void QtFuseRequest::release() {
+	if (pooled) {
+		parent.releaseRequest(this);
+		return;
+	}
+	QTimer::singleShot(0,this,SLOT(deleteLater()));
+}
+
 QtFuseRequest::~QtFuseRequest() {
 	if (data_buf != NULL) delete data_buf;
+	if (op_state != NULL) delete op_state;
+}
+
+void QtFuseRequest::setState(QtFuseRequestState *s) {
+	if ((op_state != NULL) && (op_state != s)) delete op_state;
+	op_state = s;
+}
+
+QtFuseRequestState *QtFuseRequest::state() const {
+	return op_state;
 }
 
 const struct fuse_ctx *QtFuseRequest::context() const {
@@ -121,6 +183,12 @@ void QtFuseRequest::iov(const struct iovec *iov, int count) {
 	fuse_reply_iov(req, iov, count);
 }
 
+void QtFuseRequest::data(struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags) {
+	CHECK_ANSWER();
+
+	fuse_reply_data(req, bufv, flags);
+}
+
 void QtFuseRequest::statfs(const struct statvfs *stbuf) {
 	CHECK_ANSWER();
 
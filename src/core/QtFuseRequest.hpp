@@ -20,10 +20,17 @@
 
 #pragma once
 
+// state kept by a handler while a request waits for something, so it can resume where it stopped
+class QtFuseRequestState {
+public:
+	virtual ~QtFuseRequestState() {}
+};
+
 class QtFuseRequest: public QtFuseCallback {
 	Q_OBJECT
 public:
 	QtFuseRequest(fuse_req_t req, QtFuse &_parent, struct fuse_file_info *fi = 0);
+	QtFuseRequest(QtFuse &_parent); // pooled request, see QtFuse::takeRequest()
 	~QtFuseRequest();
 
 public slots:
@@ -39,6 +46,7 @@ public:
 	void write(size_t count);
 	void buf(const QByteArray &data);
 	void iov(const struct iovec *iov, int count);
+	void data(struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags = (enum fuse_buf_copy_flags)0);
 	void statfs(const struct statvfs *stbuf);
 	void xattr(size_t count);
 	void lock(struct flock *lock);
@@ -59,6 +67,9 @@ public:
 
 	const struct fuse_ctx *context() const;
 
+	void setState(QtFuseRequestState *); // request takes ownership
+	QtFuseRequestState *state() const;
+
 	bool dir_add(const QByteArray &name, const struct stat *stbuf, off_t next_offset);
 	void dir_send();
 
@@ -67,6 +78,8 @@ public:
 
 protected:
 	void prepareBuffer(size_t size);
+	void reset(fuse_req_t req, struct fuse_file_info *fi);
+	void recycle();
 
 	friend class QtFuse;
 
@@ -74,6 +87,11 @@ private:
 	fuse_req_t req;
 	QtFuse &parent;
 	bool answered;
+	bool pooled;
+	qtfuse_handler handler;
+	QtFuseRequestState *op_state;
+
+	void release();
 
 	char *data_buf;
 	size_t buf_pos, buf_size;
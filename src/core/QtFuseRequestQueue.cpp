@@ -0,0 +1,75 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "QtFuseRequestQueue.hpp"
+
+QtFuseRequestQueue::QtFuseRequestQueue(quint32 size) {
+	Q_ASSERT((size >= 2) && ((size & (size - 1)) == 0));
+	buffer = new cell[size];
+	mask = size - 1;
+	for(quint32 i = 0; i < size; i++) {
+		buffer[i].seq.store(i);
+		buffer[i].data = NULL;
+	}
+	enqueue_pos.store(0);
+	dequeue_pos.store(0);
+}
+
+QtFuseRequestQueue::~QtFuseRequestQueue() {
+	delete[] buffer;
+}
+
+bool QtFuseRequestQueue::enqueue(QtFuseRequest *r) {
+	cell *c;
+	quint32 pos = enqueue_pos.load();
+	while(true) {
+		c = &buffer[pos & mask];
+		quint32 seq = c->seq.loadAcquire();
+		qint32 dif = (qint32)(seq - pos);
+		if (dif == 0) {
+			if (enqueue_pos.testAndSetRelaxed(pos, pos + 1)) break;
+			pos = enqueue_pos.load();
+		} else if (dif < 0) {
+			return false; // full
+		} else {
+			pos = enqueue_pos.load(); // another producer got there first
+		}
+	}
+	c->data = r;
+	c->seq.storeRelease(pos + 1);
+	return true;
+}
+
+QtFuseRequest *QtFuseRequestQueue::dequeue() {
+	cell *c;
+	quint32 pos = dequeue_pos.load();
+	while(true) {
+		c = &buffer[pos & mask];
+		quint32 seq = c->seq.loadAcquire();
+		qint32 dif = (qint32)(seq - (pos + 1));
+		if (dif == 0) {
+			if (dequeue_pos.testAndSetRelaxed(pos, pos + 1)) break;
+			pos = dequeue_pos.load();
+		} else if (dif < 0) {
+			return NULL; // empty
+		} else {
+			pos = dequeue_pos.load();
+		}
+	}
+	QtFuseRequest *r = c->data;
+	c->seq.storeRelease(pos + mask + 1);
+	return r;
+}
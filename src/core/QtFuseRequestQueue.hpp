@@ -0,0 +1,45 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QAtomicInteger>
+
+#pragma once
+
+class QtFuseRequest;
+
+// bounded lock-free queue of requests, safe for any number of producers and consumers
+// (see Dmitry Vyukov's bounded MPMC queue)
+class QtFuseRequestQueue {
+public:
+	QtFuseRequestQueue(quint32 size); // size must be a power of 2
+	~QtFuseRequestQueue();
+
+	bool enqueue(QtFuseRequest *); // returns false if queue is full
+	QtFuseRequest *dequeue(); // returns NULL if queue is empty
+
+private:
+	struct cell {
+		QAtomicInteger<quint32> seq;
+		QtFuseRequest *data;
+	};
+
+	cell *buffer;
+	quint32 mask;
+	char pad0[64]; // keep producers and consumers on separate cache lines
+	QAtomicInteger<quint32> enqueue_pos;
+	char pad1[64];
+	QAtomicInteger<quint32> dequeue_pos;
+};
@@ -23,9 +23,43 @@
 #include "S3FS_Store_MetaIterator.hpp"
 #include <QDateTime>
 #include <QDataStream>
+#include <QVarLengthArray>
+#include <QVector>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// shared source of zeroes for holes in files
+static const char s3fs_zero_block[S3FUSE_BLOCK_SIZE] = {};
+
+// blocks of a read, kept between calls so only blocks still missing are looked at again
+struct S3FS_ReadState: public QtFuseRequestState {
+	quint64 offset;
+	quint64 size;
+	QVector<QByteArray> block_id; // empty for holes and pending writes
+	QVector<QByteArray> block_data; // set once data is in memory
+	QVector<bool> resolved; // data is available locally
+	bool loaded; // blocks only on disk were read in background already, read any left directly
+};
+
+// position in a write where we stopped to wait for a block
+struct S3FS_WriteState: public QtFuseRequestState {
+	int pos;
+};
+
+// block sized piece of a write, shares buf when it is the whole of it
+static inline QByteArray s3fs_slice(const QByteArray &buf, int pos, int len) {
+	if ((pos == 0) && (len == buf.length())) return buf;
+	return QByteArray(buf.constData() + pos, len);
+}
 
-#define WAIT_READY() if (!is_ready) { connect(this, SIGNAL(ready()), req, SLOT(trigger())); return; } if (is_overloaded) { connect(this, SIGNAL(loadReduced()), req, SLOT(trigger())); return; }
+#define WAIT_READY() if (!is_ready) { ready_callback.append(req); return; } if (is_overloaded) { load_callback.append(req); return; }
+// fetch all given inodes at once if needed, rather than waiting for each of them in turn
+#define FETCH_INODES(...) { \
+	QList<quint64> missing_inodes; \
+	foreach(quint64 i, QList<quint64>({__VA_ARGS__})) { if (store.hasInode(i) && !store.hasInodeLocally(i) && !missing_inodes.contains(i)) missing_inodes.append(i); } \
+	if (!missing_inodes.isEmpty()) { store.callbackOnInodesCached(missing_inodes, req); return; } }
 #define GET_INODE(ino) \
 	if (!store.hasInode(ino)) { req->error(ENOENT); return; } \
 	if (!store.hasInodeLocally(ino)) { store.callbackOnInodeCached(ino, req); return; } S3FS_Obj &ino ## _o = *store.getInode(ino);
@@ -34,14 +68,29 @@ S3FS::S3FS(S3FS_Config *_cfg): store(_cfg) {
 	cfg = _cfg;
 	is_ready = false;
 	is_overloaded = false;
+	dirty_count = 0;
+	storing_count = 0;
+	storing_seq = 0;
 	cluster_node_id = cfg->clusterId();
 
+	writeback_timer.setInterval(1000);
+	writeback_timer.setSingleShot(false);
+	connect(&writeback_timer, SIGNAL(timeout()), this, SLOT(writebackTick()));
+	writeback_timer.start();
+
 	connect(&store, SIGNAL(ready()), this, SLOT(storeIsReady()));
 	connect(&store, SIGNAL(overloadStatus(bool)), this, SLOT(setOverload(bool)));
+	connect(&store, SIGNAL(uploadFailed(quint64)), this, SLOT(uploadFailed(quint64)));
 
 	new S3FS_Control(this, cfg);
 }
 
+S3FS::~S3FS() {
+	// do not lose pending writes
+	writebackAll();
+	store.waitForWorkers();
+}
+
 S3FS_Store &S3FS::getStore() {
 	return store;
 }
@@ -58,6 +107,7 @@ void S3FS::storeIsReady() {
 	qDebug("S3FS: ready!");
 	is_ready = true;
 	ready();
+	triggerCallbacks(ready_callback);
 	// force caching root & lost+found immediately
 	store.callbackOnInodeCached(1, NULL);
 }
@@ -66,11 +116,11 @@ void S3FS::format() {
 	qDebug("S3FS: Formatting...");
 
 	// create config
-	QVariantMap cfg;
-	cfg.insert("block_size", S3FUSE_BLOCK_SIZE);
-	cfg.insert("hash_algo", "SHA3_256");
+	QVariantMap format_cfg;
+	format_cfg.insert("block_size", S3FUSE_BLOCK_SIZE);
+	format_cfg.insert("hash_algo", QString::fromLatin1(cfg->hashAlgo()));
 
-	store.setConfig(cfg);
+	store.setConfig(format_cfg);
 
 	// create empty directory inode 1, increments generation
 	S3FS_Obj root;
@@ -102,7 +152,7 @@ void S3FS::fuse_lookup(QtFuseRequest *req) {
 		return;
 	}
 
-	QByteArray res_ino_bin = store.getInodeMeta(ino, req->name());
+	QByteArray res_ino_bin = store.getInodeMetaView(ino, req->name());
 	quint64 res_ino;
 	QDataStream(res_ino_bin) >> res_ino;
 	if (res_ino <= 1) {
@@ -142,7 +192,10 @@ void S3FS::fuse_setattr(QtFuseRequest *req) {
 	if (to_set & FUSE_SET_ATTR_UID) s.st_uid = attr->st_uid;
 	if (to_set & FUSE_SET_ATTR_GID) s.st_gid = attr->st_gid;
 	if (ino_o.isFile()) { // do not allow setting size on anything else than a file
-		if (to_set & FUSE_SET_ATTR_SIZE) s.st_size = attr->st_size; // TODO drop data that shouldn't be there anymore
+		if (to_set & FUSE_SET_ATTR_SIZE) {
+			s.st_size = attr->st_size; // TODO drop stored data that shouldn't be there anymore
+			truncateDirtyBlocks(ino, attr->st_size);
+		}
 	}
 	if ((to_set & FUSE_SET_ATTR_ATIME_NOW) || (to_set & FUSE_SET_ATTR_MTIME_NOW)) {
 		struct timeval tmp;
@@ -183,7 +236,7 @@ void S3FS::fuse_unlink(QtFuseRequest *req) {
 
 	quint64 ino_n;
 	quint32 type_n;
-	QDataStream(store.getInodeMeta(parent, req->name())) >> ino_n >> type_n;
+	QDataStream(store.getInodeMetaView(parent, req->name())) >> ino_n >> type_n;
 	if (ino_n <= 1) {
 		qDebug("S3FS: filesystem seems corrupted, please run fsck");
 		req->error(ENOENT);
@@ -270,7 +323,7 @@ void S3FS::fuse_rmdir(QtFuseRequest *req) {
 
 	quint64 ino_n;
 	quint32 type_n;
-	QDataStream(store.getInodeMeta(parent, req->name())) >> ino_n >> type_n;
+	QDataStream(store.getInodeMetaView(parent, req->name())) >> ino_n >> type_n;
 	if (ino_n <= 1) {
 		qDebug("S3FS: filesystem seems corrupted, please run fsck");
 		req->error(ENOENT);
@@ -342,6 +395,7 @@ void S3FS::fuse_rename(QtFuseRequest *req) {
 	WAIT_READY();
 	quint64 parent = req->inode();
 	quint64 newparent = req->newInode();
+	FETCH_INODES(parent, newparent);
 	GET_INODE(parent);
 	GET_INODE(newparent);
 
@@ -372,7 +426,7 @@ void S3FS::fuse_rename(QtFuseRequest *req) {
 	QDataStream(file_ino_type) >> file_ino >> file_type;
 
 	quint64 newfile_ino, newfile_type;
-	QByteArray newfile_ino_type = store.getInodeMeta(newparent, req->value());
+	QByteArray newfile_ino_type = store.getInodeMetaView(newparent, req->value());
 	QDataStream(newfile_ino_type) >> newfile_ino >> newfile_type;
 
 	if (file_ino == newfile_ino) {
@@ -412,6 +466,7 @@ void S3FS::fuse_link(QtFuseRequest *req) {
 	WAIT_READY();
 	quint64 ino = req->inode();
 	quint64 newparent = req->newInode();
+	FETCH_INODES(ino, newparent);
 	GET_INODE(ino);
 	GET_INODE(newparent);
 
@@ -442,12 +497,44 @@ void S3FS::fuse_link(QtFuseRequest *req) {
 }
 
 void S3FS::fuse_flush(QtFuseRequest *req) {
-	// nothing here for now
+	// called on each close(), store pending writes
+	quint64 ino = req->inode();
+	if (store_failed.remove(ino)) {
+		req->error(EIO);
+		return;
+	}
+	if (!writebackInode(ino, req)) return; // resumed once blocks are stored
 	req->error(0);
 }
 
 void S3FS::fuse_release(QtFuseRequest *req) {
-	// nothing here for now
+	auto fi = req->fi();
+	if (fi->fh) {
+		delete (S3FS_Readahead*)fi->fh;
+		fi->fh = 0;
+	}
+	quint64 ino = req->inode();
+	if (store_failed.remove(ino)) {
+		req->error(EIO);
+		return;
+	}
+	if (!writebackInode(ino, req)) return;
+	req->error(0);
+}
+
+void S3FS::fuse_fsync(QtFuseRequest *req) {
+	WAIT_READY();
+	quint64 ino = req->inode();
+	if (store_failed.remove(ino)) {
+		req->error(EIO);
+		return;
+	}
+	if (!writebackInode(ino, req)) return;
+	// data is safe once it is in the local journal, S3 upload happens in background
+	if (!store.sync()) {
+		req->error(EIO);
+		return;
+	}
 	req->error(0);
 }
 
@@ -470,11 +557,13 @@ void S3FS::fuse_open(QtFuseRequest *req) {
 	// TODO check fi->flags
 	if (fi->flags & O_TRUNC) {
 		// need to truncate whole file
+		truncateDirtyBlocks(ino, 0);
 		store.clearInodeMeta(ino);
 		ino_o.setSize(0);
 		store.storeInode(ino_o);
 	}
 
+	fi->fh = (uintptr_t)openReadahead(ino_o, fi->flags);
 	req->open(fi);
 }
 
@@ -566,16 +655,18 @@ void S3FS::fuse_create(QtFuseRequest *req) {
 	if (store.hasInodeMeta(parent, req->name())) {
 		// TODO handle fi->flags (open file)
 		quint64 child_ino;
-		QDataStream(store.getInodeMeta(parent, req->name())) >> child_ino;
+		QDataStream(store.getInodeMetaView(parent, req->name())) >> child_ino;
 		if (child_ino > 1) {
 			GET_INODE(child_ino);
 			// should we truncate file?
 			if (fi->flags & O_TRUNC) {
 				// need to truncate whole file
+				truncateDirtyBlocks(child_ino, 0);
 				store.clearInodeMeta(child_ino);
 				child_ino_o.setSize(0);
 				store.storeInode(child_ino_o);
 			}
+			fi->fh = (uintptr_t)openReadahead(child_ino_o, fi->flags);
 			req->create(&child_ino_o.constAttr(), fi);
 			return;
 		}
@@ -593,6 +684,7 @@ void S3FS::fuse_create(QtFuseRequest *req) {
 	parent_o.touch(true);
 	store.storeInode(parent_o);
 
+	fi->fh = (uintptr_t)openReadahead(new_file, fi->flags);
 	req->create(&new_file.constAttr(), fi);
 }
 
@@ -601,59 +693,164 @@ void S3FS::fuse_read(QtFuseRequest *req) {
 	quint64 ino = req->inode();
 	GET_INODE(ino);
 
-	QByteArray buf;
+	S3FS_ReadState *st = (S3FS_ReadState*)req->state();
+	if (!st) {
+		// first call, find out which blocks we need
+		size_t size = req->size();
+		off_t offset = req->offset();
 
-	size_t size = req->size();
-	off_t offset = req->offset();
-
-	if ((quint64)offset >= ino_o.size()) {
-		req->buf(QByteArray()); // no data
-		return;
-	}
+		if ((quint64)offset >= ino_o.size()) {
+			req->buf(QByteArray()); // no data
+			return;
+		}
 
-	if (size + offset > ino_o.size()) {
-		size = ino_o.size() - offset;
-	}
+		if (size + offset > ino_o.size()) {
+			size = ino_o.size() - offset;
+		}
 
-	// check for block(s)
-	quint64 pos = offset;
-	quint64 final_pos = offset+size;
+		S3FS_Readahead *ra = (S3FS_Readahead*)req->fi()->fh;
+		if (ra) readahead(ino_o, ra, offset, size);
+
+		st = new S3FS_ReadState;
+		st->offset = offset;
+		st->size = size;
+		quint64 first_block = offset - (offset % S3FUSE_BLOCK_SIZE);
+		int count = (offset + size - first_block + S3FUSE_BLOCK_SIZE - 1) / S3FUSE_BLOCK_SIZE;
+		st->block_id.resize(count);
+		st->block_data.resize(count);
+		st->resolved.fill(false, count);
+		st->loaded = false;
+
+		for(int i = 0; i < count; i++) {
+			qint64 offset_block = first_block + (quint64)i * S3FUSE_BLOCK_SIZE;
+			const QByteArray *dirty = dirtyBlock(ino, offset_block);
+			if (dirty) {
+				// data not stored yet
+				st->block_data[i] = *dirty;
+				st->resolved[i] = true;
+				continue;
+			}
 
-	// read while we need to read more
-	while(pos < final_pos) {
-		qint64 offset_block = pos - (pos % S3FUSE_BLOCK_SIZE);
+			QByteArray offset_block_b;
+			QDataStream(&offset_block_b, QIODevice::WriteOnly) << offset_block;
+			if (store.hasInodeMeta(ino, offset_block_b)) {
+				st->block_id[i] = store.getInodeMeta(ino, offset_block_b);
+			} else {
+				st->resolved[i] = true; // hole
+			}
+		}
+		req->setState(st);
+	}
 
-		QByteArray offset_block_b;
-		QDataStream(&offset_block_b, QIODevice::WriteOnly) << offset_block;
-		QByteArray tmp_buf;
+	// check for block(s) still missing
+	QList<QByteArray> missing; // blocks to fetch before we can reply
+	QList<QByteArray> loading; // blocks to read from local cache before we can reply
+	for(int i = 0; i < st->resolved.size(); i++) {
+		if (st->resolved[i]) continue;
+		const QByteArray &block_id = st->block_id[i];
+		if (!store.hasBlockLocally(block_id)) {
+			// keep looking for other missing blocks so they are all fetched together
+			if (!missing.contains(block_id)) missing.append(block_id);
+			continue;
+		}
+		// with splice, blocks only on disk are read from file when replying
+		if (!cfg->spliceRead() || store.hasBlockInMemory(block_id)) {
+			if ((!st->loaded) && (!store.hasBlockInMemory(block_id))) {
+				// disk read happens in background, not in the thread serving everyone
+				if (!loading.contains(block_id)) loading.append(block_id);
+				continue;
+			}
+			st->block_data[i] = store.readBlock(block_id);
+		}
+		st->resolved[i] = true;
+	}
 
-		if (store.hasInodeMeta(ino, offset_block_b)) {
-			QByteArray block_id = store.getInodeMeta(ino, offset_block_b);
+	if (!missing.isEmpty()) {
+		// resume once everything is there
+		store.callbackOnBlocksCached(missing, req);
+		return;
+	}
+	if (!loading.isEmpty()) {
+		st->loaded = true;
+		store.loadBlocks(loading, req);
+		return;
+	}
 
-			if (!store.hasBlockLocally(block_id)) {
-				// need to get block & retry
-				store.callbackOnBlockCached(block_id, req);
-				return;
-			}
-			quint64 block_pos = pos % S3FUSE_BLOCK_SIZE;
-			tmp_buf = store.readBlock(block_id).mid(block_pos, S3FUSE_BLOCK_SIZE - block_pos);
+	// reply points directly at block data (or block files), those are kept open here until it is sent
+	QVarLengthArray<QByteArray, 8> blocks;
+	QVarLengthArray<int, 8> fds;
+	QVarLengthArray<struct fuse_buf, 16> bufs;
+
+	quint64 pos = st->offset;
+	quint64 final_pos = st->offset + st->size;
+
+	for(int i = 0; pos < final_pos; i++) {
+		quint64 block_pos = pos % S3FUSE_BLOCK_SIZE;
+		quint64 len = qMin((quint64)S3FUSE_BLOCK_SIZE - block_pos, final_pos - pos);
+		quint64 avail = 0;
+		struct fuse_buf b;
+		memset(&b, 0, sizeof(b));
+
+		const QByteArray &block_id = st->block_id[i];
+		int fd = -1;
+		qint64 fd_pos = 0, fd_size = 0;
+		if ((st->block_data[i].isNull()) && (!block_id.isEmpty())) {
+			fd = store.openBlockFile(block_id, fd_pos, fd_size);
+			if (fd == -1) st->block_data[i] = store.readBlock(block_id); // not there anymore?
+		}
 
-			quint64 need_add = S3FUSE_BLOCK_SIZE - block_pos - tmp_buf.length();
-			if (need_add) tmp_buf.append(QByteArray(need_add, '\0'));
+		if (fd != -1) {
+			// block only on disk, let kernel move data from file
+			fds.append(fd);
+			if ((quint64)fd_size > block_pos)
+				avail = qMin(len, (quint64)fd_size - block_pos);
+			b.flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+			b.fd = fd;
+			b.pos = fd_pos + block_pos;
 		} else {
-			quint64 block_pos = pos % S3FUSE_BLOCK_SIZE;
-			tmp_buf = QByteArray(S3FUSE_BLOCK_SIZE - block_pos, '\0');
+			blocks.append(st->block_data[i]);
+			const QByteArray &data = blocks.last();
+			if ((quint64)data.size() > block_pos)
+				avail = qMin(len, (quint64)data.size() - block_pos);
+			b.mem = (void*)(data.constData() + block_pos);
+		}
+		if (avail) {
+			b.size = avail;
+			bufs.append(b);
+		}
+		if (avail < len) {
+			// hole or short block, fill with zeroes
+			memset(&b, 0, sizeof(b));
+			b.mem = (void*)s3fs_zero_block;
+			b.size = len - avail;
+			bufs.append(b);
 		}
-		if ((quint64)tmp_buf.length() > final_pos-pos)
-			tmp_buf.resize(final_pos-pos);
 
-		if (tmp_buf.length() == 0) abort();
+		pos += len;
+	}
 
-		buf += tmp_buf;
-		pos += tmp_buf.length();
+	if (fds.isEmpty()) {
+		// all in memory
+		QVarLengthArray<struct iovec, 16> iov(bufs.size());
+		for(int i = 0; i < bufs.size(); i++) {
+			iov[i].iov_base = bufs[i].mem;
+			iov[i].iov_len = bufs[i].size;
+		}
+		req->iov(iov.constData(), iov.size());
+		return;
 	}
 
-	req->buf(buf);
+	// struct fuse_bufvec ends with a variable length array of fuse_buf
+	QVarLengthArray<char, sizeof(struct fuse_bufvec) + 15 * sizeof(struct fuse_buf)> bufv_mem(sizeof(struct fuse_bufvec) + (bufs.size() - 1) * sizeof(struct fuse_buf));
+	struct fuse_bufvec *bufv = (struct fuse_bufvec*)bufv_mem.data();
+	bufv->count = bufs.size();
+	bufv->idx = 0;
+	bufv->off = 0;
+	memcpy(bufv->buf, bufs.constData(), bufs.size() * sizeof(struct fuse_buf));
+
+	req->data(bufv);
+
+	foreach(int fd, fds) close(fd);
 }
 
 void S3FS::fuse_write(QtFuseRequest *req) {
@@ -671,138 +868,336 @@ void S3FS::fuse_write(QtFuseRequest *req) {
 		return;
 	}
 
-	// OK, now cut buffer into pieces that fit into S3FUSE_BLOCK_SIZE
-	size_t pos = 0;
-	
-	if (offset % S3FUSE_BLOCK_SIZE) {
-		qint64 maxlen = S3FUSE_BLOCK_SIZE - (offset % S3FUSE_BLOCK_SIZE);
-		if (buf.length() < maxlen) {
-			if (!real_write(ino_o, buf, offset, req, need_wait)) {
-				ino_o.touch(true);
-				store.storeInode(ino_o);
-				if (need_wait) return;
-				req->error(EIO);
-				return;
-			}
-			ino_o.touch(true);
-			store.storeInode(ino_o);
-			req->write(buf.length());
-			return;
-		}
-		// too bad, buf doesn't fit
-		if (!real_write(ino_o, buf.left(maxlen), offset, req, need_wait)) {
-			store.storeInode(ino_o);
-			if (need_wait) return;
-			req->error(EIO);
-			return;
-		}
-		pos = maxlen;
-	}
-
-	size_t len = buf.length();
+	// OK, now cut buffer into pieces that fit into S3FUSE_BLOCK_SIZE, pieces are passed as views on buf
+	int len = buf.length();
+	S3FS_WriteState *st = (S3FS_WriteState*)req->state();
+	int pos = st ? st->pos : 0; // pieces before pos were written before we had to wait
 
 	while(pos < len) {
-		if (pos + S3FUSE_BLOCK_SIZE > len) {
-			// final block
-			if (!real_write(ino_o, buf.mid(pos), offset+pos, req, need_wait)) {
-				ino_o.touch(true);
-				store.storeInode(ino_o);
-				if (need_wait) return;
-				req->error(EIO);
-				return;
-			}
-			ino_o.touch(true);
-			store.storeInode(ino_o);
-			req->write(len);
-			return;
-		}
-		// middle write
-		if (!real_write(ino_o, buf.mid(pos, S3FUSE_BLOCK_SIZE), offset+pos, req, need_wait)) {
+		int piece = qMin((int)(S3FUSE_BLOCK_SIZE - ((offset+pos) % S3FUSE_BLOCK_SIZE)), len - pos);
+		if (!real_write(ino_o, buf, pos, piece, offset+pos, req, need_wait)) {
 			ino_o.touch(true);
 			store.storeInode(ino_o);
-			if (need_wait) return;
+			if (need_wait) {
+				if (!st) {
+					st = new S3FS_WriteState;
+					req->setState(st);
+				}
+				st->pos = pos;
+				return;
+			}
 			req->error(EIO);
 			return;
 		}
-		pos += S3FUSE_BLOCK_SIZE;
+		pos += piece;
 	}
 	ino_o.touch(true);
 	store.storeInode(ino_o);
-	req->write(pos); // if len was a multiple of S3FUSE_BLOCK_SIZE
+	req->write(len);
 }
 
 // hing this as inline for optimization
-inline bool S3FS::real_write(S3FS_Obj &ino, const QByteArray &buf, off_t offset, QtFuseRequest *req, bool &need_wait) {
+inline bool S3FS::real_write(S3FS_Obj &ino, const QByteArray &buf, int buf_pos, int len, off_t offset, QtFuseRequest *req, bool &need_wait) {
+	quint64 inode = ino.getInode();
 	qint64 offset_block = offset - (offset % S3FUSE_BLOCK_SIZE);
 	qint64 offset_in_block = offset - offset_block;
+	const char *data = buf.constData() + buf_pos;
 
 	QByteArray offset_block_b;
 	QDataStream(&offset_block_b, QIODevice::WriteOnly) << offset_block;
 
-	if ((offset == offset_block) && (buf.length() == S3FUSE_BLOCK_SIZE)) {
-		// ok, that's easy
-		QByteArray block_id = store.writeBlock(buf);
-		store.setInodeMeta(ino.getInode(), offset_block_b, block_id);
-		// update size if needed
-		if (((quint64)offset + S3FUSE_BLOCK_SIZE) > ino.size())
-			ino.setSize(offset + S3FUSE_BLOCK_SIZE);
-		return true;
+	if (storing_count >= S3FS_WRITEBACK_MAX_STORING) {
+		// hashing is behind, wait for it before taking more data
+		storing_slot_callback.append(req);
+		need_wait = true;
+		return false;
 	}
 
-	if ((offset == offset_block) && ((quint64)(buf.length() + offset) >= ino.size())) {
-		// writing a block that will be at the end of this file, easy
-		QByteArray block_id = store.writeBlock(buf);
-		store.setInodeMeta(ino.getInode(), offset_block_b, block_id);
-		ino.setSize(offset + buf.length());
+	if ((offset == offset_block) && (len == S3FUSE_BLOCK_SIZE)) {
+		// full block, that's easy, and replaces any pending write
+		dropDirtyBlock(inode, offset_block);
+		storeBlock(inode, offset_block, s3fs_slice(buf, buf_pos, len));
+		// update size if needed
+		if ((quint64)(offset + len) > ino.size())
+			ino.setSize(offset + len);
 		return true;
 	}
 
-	if (store.hasInodeMeta(ino.getInode(), offset_block_b)) {
-		// need to get that block, update it, and write it again
-		QByteArray old_block_id = store.getInodeMeta(ino.getInode(), offset_block_b);
-		if (!store.hasBlockLocally(old_block_id)) {
-			// need to get block & retry
-			store.callbackOnBlockCached(old_block_id, req);
-			need_wait = true;
-			return false;
+	QMap<qint64, S3FS_DirtyBlock> &inode_blocks = dirty_blocks[inode];
+	auto i = inode_blocks.find(offset_block);
+	if (i == inode_blocks.end()) {
+		// start a new dirty block with current content
+		QByteArray block_data;
+		bool keep_old = !((offset == offset_block) && ((quint64)(len + offset) >= ino.size()));
+		const QByteArray *storing = storingBlock(inode, offset_block);
+		if (keep_old && storing) {
+			// previous version is still being stored, start from it
+			block_data = *storing;
+		} else if (keep_old && store.hasInodeMeta(inode, offset_block_b)) {
+			// writing within existing data, need to get that block first
+			QByteArray old_block_id = store.getInodeMeta(inode, offset_block_b);
+			if (!store.hasBlockLocally(old_block_id)) {
+				// need to get block & retry
+				if (inode_blocks.isEmpty()) dirty_blocks.remove(inode);
+				store.callbackOnBlockCached(old_block_id, req);
+				need_wait = true;
+				return false;
+			}
+			block_data = store.readBlock(old_block_id);
 		}
-		QByteArray block_data = store.readBlock(old_block_id);
-
-		if (block_data.length() <= offset_in_block) {
-			// add zeroes (note, we could have used block_data.resize() but then empty data would be undefined, we want it to be zeroes)
-			block_data.append(QByteArray(offset_in_block-block_data.length(), '\0'));
-			// add actual data
-			block_data.append(buf);
-		} else if (block_data.length() > (offset_in_block+buf.length())) {
-			// need to insert buf in there
-			block_data = block_data.mid(0, offset_in_block) + buf + block_data.mid(offset_in_block+buf.length());
-		} else if (block_data.length() > offset_in_block) {
-			// need to replace existing data with new data
-			block_data = block_data.mid(0, offset_in_block);
-			// add actual data
-			block_data.append(buf);
+		// else we are writing a block that will be at the end of this file, or there was no data here
+
+		S3FS_DirtyBlock d;
+		d.data = block_data;
+		d.since = QDateTime::currentMSecsSinceEpoch();
+		i = inode_blocks.insert(offset_block, d);
+		dirty_count++;
+	}
+
+	// apply write, possibly adding zeroes if block was shorter than offset
+	QByteArray &block_data = i->data;
+	int old_len = block_data.length();
+	if (old_len < offset_in_block + len) {
+		block_data.resize(offset_in_block + len);
+		if (old_len < offset_in_block) memset(block_data.data() + old_len, 0, offset_in_block - old_len);
+	}
+	memcpy(block_data.data() + offset_in_block, data, len);
+
+	// it is quite likely we caused file size to change
+	if ((quint64)(offset + len) > ino.size())
+		ino.setSize(offset + len);
+
+	if ((offset_in_block + len == S3FUSE_BLOCK_SIZE) && (block_data.length() == S3FUSE_BLOCK_SIZE)) {
+		// block was filled up to its end, no point in waiting for more
+		if (!sealDirtyBlock(inode, offset_block)) return false;
+	}
+
+	if (dirty_count > S3FS_WRITEBACK_MAX_BLOCKS) {
+		qDebug("S3FS: too many pending writes, storing everything now");
+		writebackAll();
+	}
+	return true;
+}
+
+const QByteArray *S3FS::dirtyBlock(quint64 ino, qint64 offset_block) const {
+	auto i = dirty_blocks.constFind(ino);
+	if (i != dirty_blocks.constEnd()) {
+		auto j = i->constFind(offset_block);
+		if (j != i->constEnd()) return &j->data;
+	}
+	return storingBlock(ino, offset_block);
+}
+
+const QByteArray *S3FS::storingBlock(quint64 ino, qint64 offset_block) const {
+	auto i = storing_blocks.constFind(ino);
+	if (i == storing_blocks.constEnd()) return NULL;
+	auto j = i->constFind(offset_block);
+	if (j == i->constEnd()) return NULL;
+	return &j->data;
+}
+
+bool S3FS::sealDirtyBlock(quint64 ino, qint64 offset_block) {
+	auto i = dirty_blocks.find(ino);
+	if (i == dirty_blocks.end()) return true;
+	auto j = i->find(offset_block);
+	if (j == i->end()) return true;
+
+	QByteArray data = j->data;
+	i->erase(j);
+	dirty_count--;
+	if (i->isEmpty()) dirty_blocks.erase(i);
+
+	storeBlock(ino, offset_block, data);
+	return true;
+}
+
+void S3FS::storeBlock(quint64 ino, qint64 offset_block, const QByteArray &data) {
+	// replaces any older version still being stored, its id will be ignored once known
+	quint64 seq = ++storing_seq;
+	S3FS_StoringBlock b;
+	b.data = data;
+	b.seq = seq;
+	storing_blocks[ino].insert(offset_block, b);
+	storing_count++;
+
+	// hashing happens in background, results for an inode come back in the order blocks were sent
+	store.writeBlock(data, ino, [this, ino, offset_block, seq](const QByteArray &block_id) { blockStored(ino, offset_block, seq, block_id); });
+}
+
+void S3FS::blockStored(quint64 ino, qint64 offset_block, quint64 seq, const QByteArray &block_id) {
+	storing_count--;
+
+	auto i = storing_blocks.find(ino);
+	if (i != storing_blocks.end()) {
+		auto j = i->find(offset_block);
+		if ((j != i->end()) && (j->seq == seq)) {
+			if (block_id.isEmpty()) {
+				// keep data around as a pending write, will be retried
+				qDebug("S3FS: failed to store block at %lld for inode %llu", offset_block, ino);
+				store_failed.insert(ino);
+				QMap<qint64, S3FS_DirtyBlock> &inode_blocks = dirty_blocks[ino];
+				if (!inode_blocks.contains(offset_block)) {
+					S3FS_DirtyBlock d;
+					d.data = j->data;
+					d.since = QDateTime::currentMSecsSinceEpoch();
+					inode_blocks.insert(offset_block, d);
+					dirty_count++;
+				}
+			} else {
+				QByteArray offset_block_b;
+				QDataStream(&offset_block_b, QIODevice::WriteOnly) << offset_block;
+				store.setInodeMeta(ino, offset_block_b, block_id);
+			}
+			i->erase(j);
+			if (i->isEmpty()) storing_blocks.erase(i);
 		}
+		// else a newer version was sent, or the file was truncated meanwhile
+	}
 
-		// store new block
-		QByteArray block_id = store.writeBlock(block_data);
-		store.setInodeMeta(ino.getInode(), offset_block_b, block_id);
-		// it is quite likely we caused file size to change
-		if ((quint64)(offset + buf.length()) > ino.size())
-			ino.setSize(offset + buf.length());
-		return true;
+	if (!storing_blocks.contains(ino)) {
+		QList<QtFuseCallback*> list = storing_callback.take(ino);
+		triggerCallbacks(list);
 	}
+	if (storing_count < S3FS_WRITEBACK_MAX_STORING)
+		triggerCallbacks(storing_slot_callback);
+}
+
+void S3FS::dropDirtyBlock(quint64 ino, qint64 offset_block) {
+	auto i = dirty_blocks.find(ino);
+	if (i == dirty_blocks.end()) return;
+	if (i->remove(offset_block)) dirty_count--;
+	if (i->isEmpty()) dirty_blocks.erase(i);
+}
 
-	// there was no data here, create a block to hold the data we received
-	// possibly prefix zeroes because offset is not at block start
-	QByteArray block_data(offset-offset_block, '\0');
-	block_data.append(buf);
-	QByteArray block_id = store.writeBlock(block_data);
-	store.setInodeMeta(ino.getInode(), offset_block_b, block_id);
-	if ((quint64)(offset + buf.length()) > ino.size())
-		ino.setSize(offset + buf.length());
+bool S3FS::writebackInode(quint64 ino, QtFuseCallback *cb) {
+	if (dirty_blocks.contains(ino)) {
+		foreach(qint64 offset_block, dirty_blocks.value(ino).keys())
+			sealDirtyBlock(ino, offset_block);
+	}
+	if ((cb) && (storing_blocks.contains(ino))) {
+		storing_callback[ino].append(cb);
+		return false;
+	}
 	return true;
 }
 
+void S3FS::writebackAll() {
+	foreach(quint64 ino, dirty_blocks.keys())
+		writebackInode(ino);
+}
+
+void S3FS::writebackTick() {
+	if (dirty_blocks.isEmpty()) return;
+	qint64 limit = QDateTime::currentMSecsSinceEpoch() - S3FS_WRITEBACK_MAX_AGE;
+
+	foreach(quint64 ino, dirty_blocks.keys()) {
+		QList<qint64> expired;
+		const QMap<qint64, S3FS_DirtyBlock> &blocks = dirty_blocks[ino];
+		for(auto j = blocks.constBegin(); j != blocks.constEnd(); j++) {
+			if (j->since <= limit) expired.append(j.key());
+		}
+		foreach(qint64 offset_block, expired)
+			sealDirtyBlock(ino, offset_block);
+	}
+}
+
+void S3FS::uploadFailed(quint64 ino) {
+	// reported once, like a block that could not be stored
+	store_failed.insert(ino);
+}
+
+S3FS_Readahead *S3FS::openReadahead(S3FS_Obj &ino, int flags) {
+	auto ra = new S3FS_Readahead;
+	ra->next_offset = 0;
+	ra->prefetched = 0;
+	ra->window = 0;
+
+	// write only or truncating opens will not read what is there now
+	bool reading = ((flags & O_ACCMODE) != O_WRONLY) && !(flags & O_TRUNC);
+	if (reading && (ino.size() > 0) && (ino.size() <= cfg->prefetchSize())) {
+		// small file, likely to be read whole
+		prefetch(ino.getInode(), 0, ino.size());
+		ra->prefetched = ino.size();
+	}
+	return ra;
+}
+
+void S3FS::readahead(S3FS_Obj &ino, S3FS_Readahead *ra, quint64 offset, quint64 size) {
+	if (offset == ra->next_offset) {
+		// sequential access, grow window
+		ra->window = ra->window ? qMin(ra->window * 2, cfg->readaheadMax()) : qMin(S3FS_READAHEAD_MIN, cfg->readaheadMax());
+	} else {
+		// random access, shrink window and start over
+		ra->window /= 2;
+		if (ra->window < S3FS_READAHEAD_MIN) ra->window = 0;
+		ra->prefetched = 0;
+	}
+	ra->next_offset = offset + size;
+	if (ra->window <= 0) return;
+
+	quint64 from = qMax(offset + size, ra->prefetched);
+	quint64 to = qMin(offset + size + (quint64)ra->window * S3FUSE_BLOCK_SIZE, ino.size());
+	if (from >= to) return;
+
+	prefetch(ino.getInode(), from, to);
+	ra->prefetched = to;
+}
+
+void S3FS::prefetch(quint64 ino, quint64 from, quint64 to) {
+	for(quint64 pos = from - (from % S3FUSE_BLOCK_SIZE); pos < to; pos += S3FUSE_BLOCK_SIZE) {
+		if (dirtyBlock(ino, pos)) continue;
+
+		QByteArray offset_block_b;
+		QDataStream(&offset_block_b, QIODevice::WriteOnly) << (qint64)pos;
+		if (!store.hasInodeMeta(ino, offset_block_b)) continue; // hole
+
+		store.prefetchBlock(store.getInodeMeta(ino, offset_block_b));
+	}
+}
+
+void S3FS::truncateDirtyBlocks(quint64 ino, quint64 size) {
+	// blocks being stored past size must not update the inode once stored
+	auto s = storing_blocks.find(ino);
+	if (s != storing_blocks.end()) {
+		auto j = s->lowerBound(size - (size % S3FUSE_BLOCK_SIZE));
+		if ((j != s->end()) && ((quint64)j.key() < size)) {
+			if ((quint64)(j.key() + j->data.length()) > size) {
+				// block containing new end of file goes on as a shorter pending write
+				QMap<qint64, S3FS_DirtyBlock> &inode_blocks = dirty_blocks[ino];
+				if (!inode_blocks.contains(j.key())) {
+					S3FS_DirtyBlock d;
+					d.data = j->data.left(size - j.key());
+					d.since = QDateTime::currentMSecsSinceEpoch();
+					inode_blocks.insert(j.key(), d);
+					dirty_count++;
+				}
+				j = s->erase(j);
+			} else {
+				j++;
+			}
+		}
+		while(j != s->end())
+			j = s->erase(j);
+		if (s->isEmpty()) storing_blocks.erase(s);
+	}
+
+	// drop pending writes beyond size
+	auto i = dirty_blocks.find(ino);
+	if (i == dirty_blocks.end()) return;
+
+	auto j = i->lowerBound(size - (size % S3FUSE_BLOCK_SIZE));
+	if ((j != i->end()) && ((quint64)j.key() < size)) {
+		// block containing new end of file
+		if ((quint64)(j.key() + j->data.length()) > size) j->data.resize(size - j.key());
+		j++;
+	}
+	while(j != i->end()) {
+		j = i->erase(j);
+		dirty_count--;
+	}
+	if (i->isEmpty()) dirty_blocks.erase(i);
+}
+
 quint64 S3FS::makeInode() {
 	quint64 new_inode = QDateTime::currentMSecsSinceEpoch()*1000 + cluster_node_id;
 
@@ -813,12 +1208,21 @@ quint64 S3FS::makeInode() {
 	return new_inode;
 }
 
+void S3FS::triggerCallbacks(QList<QtFuseCallback*> &list) {
+	// requests may queue themselves again while being triggered
+	QList<QtFuseCallback*> pending;
+	pending.swap(list);
+	foreach(auto cb, pending)
+		cb->trigger();
+}
+
 void S3FS::setOverload(bool status) {
 	if (is_overloaded == status) return;
 	is_overloaded = status;
 	if (!status) {
 		qDebug("S3FS: network load reduced, resuming operations");
 		loadReduced();
+		triggerCallbacks(load_callback);
 	} else {
 		qDebug("S3FS: network load too high, waiting for cool down");
 	}
@@ -16,6 +16,10 @@
  */
 
 #include <QObject>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+#include <QTimer>
 #include "S3FS_Store.hpp"
 #include "Keyval.hpp"
 #include "QtFuseRequest.hpp"
@@ -25,11 +29,38 @@
 class S3FS_Config;
 class S3FS_Control;
 
+// partial writes are kept in memory and only turned into blocks once complete, flushed or too old
+#define S3FS_WRITEBACK_MAX_AGE 5000 // msecs
+#define S3FS_WRITEBACK_MAX_BLOCKS 1024 // 64MB with 64k blocks
+#define S3FS_WRITEBACK_MAX_STORING 256 // blocks hashed and stored in background before writes have to wait
+
+// sequential reads ramp up a window of blocks fetched in background
+#define S3FS_READAHEAD_MIN 2 // blocks
+
+// per open file state, stored in fi->fh
+struct S3FS_Readahead {
+	quint64 next_offset; // where a sequential read would continue
+	quint64 prefetched; // prefetch already requested up to there
+	int window; // blocks
+};
+
+struct S3FS_DirtyBlock {
+	QByteArray data; // current content of block
+	qint64 since; // time of first write not yet stored, in msecs
+};
+
+// complete block handed to the store, readable here until its id is known
+struct S3FS_StoringBlock {
+	QByteArray data;
+	quint64 seq; // only the latest version of a block updates the inode
+};
+
 class S3FS: public QObject {
 	Q_OBJECT
 
 public:
 	S3FS(S3FS_Config *cfg);
+	~S3FS();
 	void format();
 	bool isReady() const;
 	S3FS_Store &getStore();
@@ -48,6 +79,7 @@ public:
 	void fuse_link(QtFuseRequest *req);
 	void fuse_flush(QtFuseRequest *req);
 	void fuse_release(QtFuseRequest *req);
+	void fuse_fsync(QtFuseRequest *req);
 	void fuse_open(QtFuseRequest *req);
 	void fuse_opendir(QtFuseRequest *req);
 	void fuse_readdir(QtFuseRequest *req);
@@ -65,14 +97,42 @@ public slots:
 	void storeIsReady();
 
 	void setOverload(bool);
+	void writebackTick();
+	void uploadFailed(quint64 ino);
 
 protected:
-	bool real_write(S3FS_Obj &ino, const QByteArray &buf, off_t offset, QtFuseRequest *, bool &wait);
+	bool real_write(S3FS_Obj &ino, const QByteArray &buf, int buf_pos, int len, off_t offset, QtFuseRequest *, bool &wait);
+	void triggerCallbacks(QList<QtFuseCallback*> &list);
+
+	const QByteArray *dirtyBlock(quint64 ino, qint64 offset_block) const;
+	bool sealDirtyBlock(quint64 ino, qint64 offset_block);
+	void dropDirtyBlock(quint64 ino, qint64 offset_block);
+	const QByteArray *storingBlock(quint64 ino, qint64 offset_block) const;
+	void storeBlock(quint64 ino, qint64 offset_block, const QByteArray &data);
+	void blockStored(quint64 ino, qint64 offset_block, quint64 seq, const QByteArray &block_id);
+	bool writebackInode(quint64 ino, QtFuseCallback *cb = 0); // false if cb has to wait for blocks being stored
+	void writebackAll();
+	void truncateDirtyBlocks(quint64 ino, quint64 size);
+
+	S3FS_Readahead *openReadahead(S3FS_Obj &ino, int flags);
+	void readahead(S3FS_Obj &ino, S3FS_Readahead *ra, quint64 offset, quint64 size);
+	void prefetch(quint64 ino, quint64 from, quint64 to);
 
 private:
 	S3FS_Store store;
 	bool is_ready;
 	bool is_overloaded;
+	QList<QtFuseCallback*> ready_callback; // requests waiting for store to be ready
+	QList<QtFuseCallback*> load_callback; // requests waiting for network load to go down
+	QHash<quint64, QMap<qint64, S3FS_DirtyBlock> > dirty_blocks; // inode => block offset => data
+	int dirty_count;
+	QHash<quint64, QMap<qint64, S3FS_StoringBlock> > storing_blocks; // inode => block offset => data
+	int storing_count; // store writes not completed yet, including superseded ones
+	quint64 storing_seq;
+	QHash<quint64, QList<QtFuseCallback*> > storing_callback; // requests waiting for blocks of an inode to be stored
+	QList<QtFuseCallback*> storing_slot_callback; // writes waiting for storing_count to go down
+	QSet<quint64> store_failed; // inodes with blocks that could not be stored or uploaded, reported on next flush
+	QTimer writeback_timer;
 	quint64 last_inode;
 	S3FS_Config *cfg;
 	int cluster_node_id;
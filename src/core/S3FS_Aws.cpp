@@ -16,22 +16,85 @@
  */
 #include "S3FS_Aws.hpp"
 #include "S3FS_Config.hpp"
+#include "S3FS_Store_Worker.hpp"
 #include <QStandardPaths>
 #include <QFile>
 #include <QSettings>
 #include <QMessageAuthenticationCode>
 #include <QNetworkReply>
-#include <QBuffer>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QDateTime>
+#include <QSharedPointer>
+#include <unistd.h>
+#if QT_VERSION >= 0x050a00
+#include <QRandomGenerator>
+#endif
 #if QT_VERSION < 0x050300
 #include <contrib/QByteArrayList.hpp>
 #endif
 
-S3FS_Aws::S3FS_Aws(S3FS_Config *_cfg, QObject *parent): QObject(parent) {
+// indexed by S3FS_Aws_Class
+static const struct {
+	const char *name;
+	int pool;
+	int weight; // share of the pool when busy, demand reads do not need one
+	qint64 deadline; // ms in queue before going ahead of everything, 0 for none
+} s3fs_aws_classes[S3FS_AWS_CLASS_COUNT] = {
+	{ "read", S3FS_AWS_POOL_GET, 0, 0 },
+	{ "meta", S3FS_AWS_POOL_GET, 8, 2000 },
+	{ "prefetch", S3FS_AWS_POOL_GET, 2, 30000 },
+	{ "upload", S3FS_AWS_POOL_PUT, 4, 60000 },
+	{ "delete", S3FS_AWS_POOL_PUT, 1, 120000 },
+	{ "list", S3FS_AWS_POOL_LIST, 1, 0 },
+	{ "queue", S3FS_AWS_POOL_QUEUE, 1, 0 },
+};
+
+// indexed by S3FS_Aws_Error, delays in ms
+static const struct {
+	qint64 base;
+	qint64 cap;
+	int cost; // retry budget tokens
+} s3fs_aws_retry[S3FS_AWS_ERROR_COUNT] = {
+	{ 0, 0, 0 }, // none
+	{ 0, 0, 0 }, // not found
+	{ 1000, 30000, 5 }, // throttle, give S3 time to scale
+	{ 200, 10000, 5 }, // server
+	{ 500, 20000, 10 }, // network
+	{ 5000, 300000, 10 }, // auth, until credentials are fixed or refreshed
+	{ 2000, 60000, 5 }, // client
+};
+
+static int s3fs_aws_transport_threads(S3FS_Config *cfg) {
+	if (cfg->httpThreads() > 0) return cfg->httpThreads();
+	// enough connections for the limiter to reach --max-requests
+	return qMax(1, (cfg->maxRequests() + S3FS_AWS_TRANSPORT_HOST_CONNECTIONS - 1) / S3FS_AWS_TRANSPORT_HOST_CONNECTIONS);
+}
+
+S3FS_Aws::S3FS_Aws(S3FS_Config *_cfg, QObject *parent): QObject(parent), transport(s3fs_aws_transport_threads(_cfg)) {
 	cfg = _cfg;
 	overload_status = false;
 	is_ready = false;
+	worker = 0;
+
+	clock.start();
+#if QT_VERSION < 0x050a00
+	qsrand((uint)(QDateTime::currentMSecsSinceEpoch() ^ getpid())); // retry jitter must differ between nodes
+#endif
+	retry_tokens = S3FS_AWS_RETRY_BUDGET;
+	body_memory = 0;
+	body_outstanding = 0;
+	breaker_state = S3FS_AWS_BREAKER_CLOSED;
+	breaker_failures = 0;
+	breaker_cooldown = S3FS_AWS_BREAKER_COOLDOWN_MIN;
+	breaker_timer.setSingleShot(true);
+	connect(&breaker_timer, &QTimer::timeout, this, &S3FS_Aws::breakerHalfOpen);
+	for(int c = 0; c < S3FS_AWS_CLASS_COUNT; c++)
+		http_wrr[c] = 0;
+	http_limit[S3FS_AWS_POOL_GET] = new S3FS_Aws_Limiter("GET", S3FS_AWS_GET_INITIAL, cfg->maxRequests());
+	http_limit[S3FS_AWS_POOL_PUT] = new S3FS_Aws_Limiter("PUT", S3FS_AWS_PUT_INITIAL, cfg->maxRequests());
+	http_limit[S3FS_AWS_POOL_LIST] = new S3FS_Aws_Limiter("LIST", S3FS_AWS_LIST_INITIAL, qMin(cfg->maxRequests(), S3FS_AWS_LIST_MAX));
+	http_limit[S3FS_AWS_POOL_QUEUE] = new S3FS_Aws_Limiter("SQS", S3FS_AWS_QUEUE_INITIAL, qMin(cfg->maxRequests(), S3FS_AWS_QUEUE_MAX));
 
 	connect(&status_timer, &QTimer::timeout, this, &S3FS_Aws::showStatus);
 	status_timer.setSingleShot(false);
@@ -61,6 +124,14 @@ S3FS_Aws::S3FS_Aws(S3FS_Config *_cfg, QObject *parent): QObject(parent) {
 	is_ready = true;
 }
 
+S3FS_Aws::~S3FS_Aws() {
+	// replies still running may outlive the limiters
+	foreach(QNetworkReply *reply, http_running.keys())
+		disconnect(reply, 0, this, 0);
+	for(int pool = 0; pool < S3FS_AWS_POOL_COUNT; pool++)
+		delete http_limit[pool];
+}
+
 void S3FS_Aws::retrieveAwsCredentials() {
 	// receive credentials from provided URL, that will return a JSON object containing at least:
 	// - AccessKeyId
@@ -207,131 +278,361 @@ QNetworkReply *S3FS_Aws::reqV4(const QByteArray &verb, const QByteArray &subpath
 
 //	qDebug("Authorization: %s", auth_header.data());
 
-	QBuffer *data_dev = 0;
-	if (!data.isEmpty()) {
-		data_dev = new QBuffer();
-		data_dev->setData(data);
-		data_dev->open(QIODevice::ReadOnly);
-	}
-	auto res = net.sendCustomRequest(req, verb, data_dev);
-
-	if (data_dev) data_dev->setParent(res); // ensures QBuffer() will die
-
-	return res;
+	return transport.send(req, verb, data);
 }
 
-void S3FS_Aws::httpV4(QObject *caller, const QByteArray &verb, const QByteArray &subpath, const QNetworkRequest &req, const QByteArray &data) {
+void S3FS_Aws::httpV4(QObject *caller, int request_class, const QByteArray &verb, const QByteArray &subpath, const QNetworkRequest &req, const S3FS_Aws_Body &body) {
 //	qDebug("AWS: Request(v4) %s %s", verb.data(), req.url().toString().toLatin1().data());
-	if ((is_ready) && (http_running.size() < S3FS_AWS_QUEUE_LENGTH)) {
-		auto reply = reqV4(verb, subpath, req, data);
-		http_running.insert(reply);
-		connect(reply, SIGNAL(destroyed(QObject*)), this, SLOT(replyDestroyed(QObject*)));
-//		qDebug("S3FS_Aws: queries status %d/8", http_running.size());
-		QMetaObject::invokeMethod(caller, "requestStarted", Q_ARG(QNetworkReply*, reply));
-		return;
-	}
-	if ((!overload_status) && ((http_queue.size()+http_slow_queue.size()) > 10000)) {
-		// signal overload
-		overload_status = true;
-		overloadStatus(overload_status);
-	}
-	// queue this
 	auto q = new S3FS_Aws_Queue_Entry;
 	q->req = req;
 	q->verb = verb;
+	q->data = 0;
 	q->subpath = subpath;
-	q->raw_data = data;
+	q->body = body;
 	q->sender = caller;
 	q->sign = 4;
-	http_queue.append(q);
+	q->request_class = request_class;
+	queue(q);
 }
 
-void S3FS_Aws::httpSlowV4(QObject *caller, const QByteArray &verb, const QByteArray &subpath, const QNetworkRequest &req, const QByteArray &data) {
-	if ((is_ready) && (http_running.size() < S3FS_AWS_QUEUE_LENGTH)) {
-		// system is not crowded, just proceed
-		httpV4(caller, verb, subpath, req, data);
-		return;
-	}
-	if ((!overload_status) && ((http_queue.size()+http_slow_queue.size()) > 10000)) {
-		// signal overload
-		overload_status = true;
-		overloadStatus(overload_status);
-	}
-	// queue this
+void S3FS_Aws::http(QObject *caller, const QByteArray &verb, const QNetworkRequest &req, QIODevice *data) {
+//	qDebug("AWS: Request %s %s", verb.data(), req.url().toString().toLatin1().data());
 	auto q = new S3FS_Aws_Queue_Entry;
 	q->req = req;
 	q->verb = verb;
-	q->subpath = subpath;
-	q->raw_data = data;
+	q->data = data;
 	q->sender = caller;
-	q->sign = 4;
-	http_slow_queue.append(q);
+	q->sign = 0;
+	q->request_class = S3FS_AWS_CLASS_META;
+	queue(q);
 }
 
-void S3FS_Aws::http(QObject *caller, const QByteArray &verb, const QNetworkRequest &req, QIODevice *data) {
-//	qDebug("AWS: Request %s %s", verb.data(), req.url().toString().toLatin1().data());
-	if ((is_ready) && (http_running.size() < S3FS_AWS_QUEUE_LENGTH)) {
-		auto reply = net.sendCustomRequest(req, verb, data);
-		http_running.insert(reply);
-		connect(reply, SIGNAL(destroyed(QObject*)), this, SLOT(replyDestroyed(QObject*)));
-//		qDebug("S3FS_Aws: queries status %d/8", http_running.size());
-		QMetaObject::invokeMethod(caller, "requestStarted", Q_ARG(QNetworkReply*, reply));
-		return;
+void S3FS_Aws::reclassify(QObject *caller, int request_class) {
+	for(int c = 0; c < S3FS_AWS_CLASS_COUNT; c++) {
+		if (c == request_class) continue;
+		for(int i = 0; i < http_queue[c].size(); i++) {
+			S3FS_Aws_Queue_Entry *q = http_queue[c].at(i);
+			if (q->sender != caller) continue;
+			http_queue[c].removeAt(i);
+			q->request_class = request_class;
+			http_queue[request_class].append(q);
+			runQueue();
+			return;
+		}
 	}
-	if ((!overload_status) && ((http_queue.size()+http_slow_queue.size()) > 10000)) {
-		// signal overload
-		overload_status = true;
-		overloadStatus(overload_status);
+	// already running or not queued, nothing to do
+}
+
+void S3FS_Aws::setSpillPath(const QString &path) {
+	if (cfg->uploadSpillSize() == 0) return; // everything stays in memory
+	spill.open(path, (qint64)cfg->uploadSpillSize());
+}
+
+void S3FS_Aws::setWorker(S3FS_Store_Worker *_worker) {
+	worker = _worker;
+}
+
+void S3FS_Aws::holdBody(S3FS_Aws_Body &body) {
+	body_outstanding += body.size;
+	if ((!body.loader) && (body.size > 0)) {
+		if ((body_memory + body.size > (qint64)cfg->uploadQueueMemory()) && (spill.isOpen())) {
+			body.spill_offset = spill.write(body.data);
+			if (body.spill_offset != -1) body.data = QByteArray();
+		}
+		if (body.spill_offset == -1) body_memory += body.size;
 	}
-	// queue this
-	auto q = new S3FS_Aws_Queue_Entry;
-	q->req = req;
-	q->verb = verb;
-	q->data = data;
-	q->sender = caller;
-	http_queue.append(q);
+	updateOverload();
 }
 
-void S3FS_Aws::replyDestroyed(QObject *obj) {
-	http_running.remove((QNetworkReply*)obj);
-	if ((overload_status) && ((http_queue.size()+http_slow_queue.size()) < 9000)) {
-		// signal overload
-		overload_status = false;
-		overloadStatus(overload_status);
+void S3FS_Aws::releaseBody(S3FS_Aws_Body &body) {
+	body_outstanding -= body.size;
+	if (body.spill_offset != -1) {
+		spill.release(body.spill_offset, body.size);
+	} else if (!body.loader) {
+		body_memory -= body.size;
 	}
-	runQueue();
+	body = S3FS_Aws_Body();
+	updateOverload();
 }
 
-void S3FS_Aws::runQueue() {
-	if (!is_ready) return;
-	if (http_running.size() >= S3FS_AWS_QUEUE_LENGTH) return; // busy
-	S3FS_Aws_Queue_Entry *q = 0;
-	if (http_queue.size()) {
-		q = http_queue.takeFirst();
-	} else if (http_slow_queue.size()) {
-		q = http_slow_queue.takeFirst();
+int S3FS_Aws::queuedCount() const {
+	int count = 0;
+	for(int c = 0; c < S3FS_AWS_CLASS_COUNT; c++)
+		count += http_queue[c].size();
+	return count;
+}
+
+bool S3FS_Aws::hasQueued(int pool) const {
+	for(int c = 0; c < S3FS_AWS_CLASS_COUNT; c++)
+		if ((s3fs_aws_classes[c].pool == pool) && (!http_queue[c].isEmpty())) return true;
+	return false;
+}
+
+int S3FS_Aws::pickClass(int pool) {
+	// overdue requests first, most overdue wins
+	qint64 now = clock.elapsed();
+	int best = -1;
+	qint64 best_late = 0;
+	for(int c = 0; c < S3FS_AWS_CLASS_COUNT; c++) {
+		if ((s3fs_aws_classes[c].pool != pool) || (http_queue[c].isEmpty()) || (!s3fs_aws_classes[c].deadline)) continue;
+		qint64 late = now - http_queue[c].first()->queued - s3fs_aws_classes[c].deadline;
+		if (late > best_late) {
+			best = c;
+			best_late = late;
+		}
 	}
-	if (!q) {
-		// System is idle
-		return;
+	if (best != -1) return best;
+
+	// demand reads preempt queued background work
+	if ((s3fs_aws_classes[S3FS_AWS_CLASS_READ].pool == pool) && (!http_queue[S3FS_AWS_CLASS_READ].isEmpty()))
+		return S3FS_AWS_CLASS_READ;
+
+	// smooth weighted round robin between the other classes
+	int total = 0;
+	for(int c = 0; c < S3FS_AWS_CLASS_COUNT; c++) {
+		if ((c == S3FS_AWS_CLASS_READ) || (s3fs_aws_classes[c].pool != pool) || (http_queue[c].isEmpty())) continue;
+		http_wrr[c] += s3fs_aws_classes[c].weight;
+		total += s3fs_aws_classes[c].weight;
+		if ((best == -1) || (http_wrr[c] > http_wrr[best])) best = c;
 	}
-	QNetworkReply *reply;
+	if (best != -1) http_wrr[best] -= total;
+	return best;
+}
+
+void S3FS_Aws::queue(S3FS_Aws_Queue_Entry *q) {
+	q->queued = clock.elapsed();
+	http_queue[q->request_class].append(q);
+	updateOverload();
+	runQueue();
+}
+
+void S3FS_Aws::startRequest(S3FS_Aws_Queue_Entry *q) {
+	// slot in the limiter of this class pool must have been taken already
 	switch(q->sign) {
 		case 4: // signV4
-			reply = reqV4(q->verb, q->subpath, q->req, q->raw_data);
-			break;
+			if ((q->body.spill_offset != -1) || (q->body.loader)) {
+				loadBody(q);
+				return;
+			}
+			sendRequest(q, reqV4(q->verb, q->subpath, q->req, q->body.data));
+			return;
 		default:
-			reply = net.sendCustomRequest(q->req, q->verb, q->data);
+			sendRequest(q, net.sendCustomRequest(q->req, q->verb, q->data));
+	}
+}
+
+void S3FS_Aws::loadBody(S3FS_Aws_Queue_Entry *q) {
+	// disk is read in the io thread, the request goes out once the body is back
+	S3FS_Aws_BodyReader reader;
+	if (q->body.spill_offset != -1) {
+		S3FS_Aws_SpillRecord rec;
+		if (spill.openRecord(q->body.spill_offset, q->body.size, rec))
+			reader = [rec]() { return S3FS_Aws_Spill::readRecord(rec); };
+	} else {
+		reader = q->body.loader();
+	}
+	if (!reader) {
+		bodyLoaded(q, QByteArray());
+		return;
 	}
-	http_running.insert(reply);
+	if (!worker) {
+		bodyLoaded(q, reader());
+		return;
+	}
+	auto data = QSharedPointer<QByteArray>::create();
+	worker->runIo([reader, data]() { *data = reader(); }, [this, q, data]() { bodyLoaded(q, *data); });
+}
+
+void S3FS_Aws::bodyLoaded(S3FS_Aws_Queue_Entry *q, const QByteArray &data) {
+	if (data.size() != q->body.size) {
+		// gone from disk, sending an empty object would be worse than not sending it
+		http_limit[s3fs_aws_classes[q->request_class].pool]->finished(-1, 0, false);
+		QMetaObject::invokeMethod(q->sender, "bodyLost");
+		delete q;
+		runQueue();
+		return;
+	}
+	sendRequest(q, reqV4(q->verb, q->subpath, q->req, data));
+}
+
+void S3FS_Aws::sendRequest(S3FS_Aws_Queue_Entry *q, QNetworkReply *reply) {
+	S3FS_Aws_Running &r = http_running[reply];
+	r.pool = s3fs_aws_classes[q->request_class].pool;
+	r.started.start();
+	r.ttfb = -1;
+	r.bytes = q->body.size;
+	r.congestion = false;
 	connect(reply, SIGNAL(destroyed(QObject*)), this, SLOT(replyDestroyed(QObject*)));
+	// connected before the caller gets the reply, so these run before its own finished handler
+	connect(reply, SIGNAL(metaDataChanged()), this, SLOT(replyMetaData()));
+	connect(reply, SIGNAL(finished()), this, SLOT(replyFinished()));
 	QMetaObject::invokeMethod(q->sender, "requestStarted", Q_ARG(QNetworkReply*, reply));
 	delete q;
 }
 
+void S3FS_Aws::replyMetaData() {
+	auto reply = qobject_cast<QNetworkReply*>(sender());
+	if ((reply == NULL) || (!http_running.contains(reply))) return;
+	S3FS_Aws_Running &r = http_running[reply];
+	// SQS may hold an answer until there is something to say, that is not latency
+	if (r.pool == S3FS_AWS_POOL_QUEUE) return;
+	if (r.ttfb == -1) r.ttfb = r.started.elapsed();
+}
+
+void S3FS_Aws::replyFinished() {
+	auto reply = qobject_cast<QNetworkReply*>(sender());
+	if ((reply == NULL) || (!http_running.contains(reply))) return;
+	S3FS_Aws_Running &r = http_running[reply];
+	r.bytes += reply->bytesAvailable();
+
+	switch(classifyError(reply)) {
+		case S3FS_AWS_ERROR_NONE:
+		case S3FS_AWS_ERROR_NOT_FOUND:
+			if (r.pool != S3FS_AWS_POOL_QUEUE) requestSucceeded();
+			break;
+		case S3FS_AWS_ERROR_THROTTLE:
+		case S3FS_AWS_ERROR_SERVER:
+		case S3FS_AWS_ERROR_NETWORK:
+			// SlowDown, server side trouble or no answer
+			r.congestion = true;
+			break;
+		default:
+			break;
+	}
+}
+
+int S3FS_Aws::classifyError(QNetworkReply *reply, const QByteArray &body) {
+	int http_code = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+	if (http_code == 0) {
+		// never got an answer
+		if (reply->error() == QNetworkReply::NoError) return S3FS_AWS_ERROR_NONE;
+		return S3FS_AWS_ERROR_NETWORK;
+	}
+	if (http_code < 400) return S3FS_AWS_ERROR_NONE;
+	if (http_code == 404) return S3FS_AWS_ERROR_NOT_FOUND;
+	if ((http_code == 429) || (http_code == 503) || (body.contains("<Code>SlowDown</Code>"))) return S3FS_AWS_ERROR_THROTTLE;
+	if (http_code >= 500) return S3FS_AWS_ERROR_SERVER;
+	if ((http_code == 401) || (http_code == 403) || (body.contains("<Code>ExpiredToken</Code>")) || (body.contains("<Code>TokenRefreshRequired</Code>"))) return S3FS_AWS_ERROR_AUTH;
+	if (body.contains("<Code>RequestTimeout</Code>")) return S3FS_AWS_ERROR_NETWORK; // S3 gave up waiting for our body
+	return S3FS_AWS_ERROR_CLIENT;
+}
+
+const char *S3FS_Aws::errorName(int error) {
+	switch(error) {
+		case S3FS_AWS_ERROR_NONE: return "none";
+		case S3FS_AWS_ERROR_NOT_FOUND: return "not found";
+		case S3FS_AWS_ERROR_THROTTLE: return "throttled";
+		case S3FS_AWS_ERROR_SERVER: return "server error";
+		case S3FS_AWS_ERROR_NETWORK: return "network error";
+		case S3FS_AWS_ERROR_AUTH: return "access denied";
+		case S3FS_AWS_ERROR_CLIENT: return "client error";
+		default: return "unknown";
+	}
+}
+
+qint64 S3FS_Aws::retryDelay(int error, qint64 previous) {
+	const auto &policy = s3fs_aws_retry[error];
+
+	breaker_failures++;
+	bool exhausted = (retry_tokens < policy.cost);
+	if (!exhausted) retry_tokens -= policy.cost;
+	if ((breaker_state == S3FS_AWS_BREAKER_HALF_OPEN) || ((breaker_state == S3FS_AWS_BREAKER_CLOSED) && ((exhausted) || (breaker_failures >= S3FS_AWS_BREAKER_FAILURES))))
+		breakerOpen();
+
+	if (exhausted) return policy.cap;
+
+	// decorrelated jitter: anywhere between base and 3 times the previous delay, so nodes
+	// failing together do not retry together
+	qint64 high = qMax(policy.base, previous) * 3;
+#if QT_VERSION >= 0x050a00
+	double r = QRandomGenerator::global()->generateDouble();
+#else
+	double r = (double)qrand() / RAND_MAX;
+#endif
+	qint64 delay = policy.base + (qint64)(r * (high - policy.base));
+	return qMin(policy.cap, delay);
+}
+
+void S3FS_Aws::breakerOpen() {
+	if (breaker_state == S3FS_AWS_BREAKER_HALF_OPEN) {
+		// probe failed
+		breaker_cooldown = qMin((qint64)S3FS_AWS_BREAKER_COOLDOWN_MAX, breaker_cooldown * 2);
+	} else {
+		breaker_cooldown = S3FS_AWS_BREAKER_COOLDOWN_MIN;
+	}
+	breaker_state = S3FS_AWS_BREAKER_OPEN;
+	qWarning("S3FS_Aws: %d consecutive failures, holding requests for %lld seconds", breaker_failures, breaker_cooldown / 1000);
+	breaker_timer.start(breaker_cooldown);
+	updateOverload();
+}
+
+void S3FS_Aws::breakerHalfOpen() {
+	breaker_state = S3FS_AWS_BREAKER_HALF_OPEN;
+	runQueue();
+}
+
+void S3FS_Aws::requestSucceeded() {
+	breaker_failures = 0;
+	if (retry_tokens < S3FS_AWS_RETRY_BUDGET) retry_tokens++;
+	if (breaker_state == S3FS_AWS_BREAKER_CLOSED) return;
+
+	qDebug("S3FS_Aws: requests are going through again");
+	breaker_state = S3FS_AWS_BREAKER_CLOSED;
+	breaker_timer.stop();
+	updateOverload();
+}
+
+void S3FS_Aws::updateOverload() {
+	// admission follows bytes waiting to be uploaded, with some hysteresis so we do not flip on
+	// every request. Queue length still counts for requests without a body.
+	qint64 max_bytes = (qint64)cfg->uploadQueueSize();
+	if (overload_status) max_bytes = max_bytes * 9 / 10;
+	bool status = (breaker_state != S3FS_AWS_BREAKER_CLOSED) || (body_outstanding > max_bytes) || (spill.isFull()) || (queuedCount() > (overload_status ? 9000 : 10000));
+	if (status == overload_status) return;
+	overload_status = status;
+	overloadStatus(overload_status);
+}
+
+void S3FS_Aws::replyDestroyed(QObject *obj) {
+	auto i = http_running.find((QNetworkReply*)obj);
+	if (i != http_running.end()) {
+		http_limit[i.value().pool]->finished(i.value().ttfb, i.value().bytes, i.value().congestion);
+		http_running.erase(i);
+	}
+	updateOverload();
+	runQueue();
+}
+
+int S3FS_Aws::runningS3() const {
+	int count = 0;
+	for(int pool = 0; pool < S3FS_AWS_POOL_COUNT; pool++)
+		if (pool != S3FS_AWS_POOL_QUEUE) count += http_limit[pool]->running();
+	return count;
+}
+
+void S3FS_Aws::runQueue() {
+	if (!is_ready) return;
+	for(int pool = 0; pool < S3FS_AWS_POOL_COUNT; pool++) {
+		bool s3 = (pool != S3FS_AWS_POOL_QUEUE);
+		if ((s3) && (breaker_state == S3FS_AWS_BREAKER_OPEN)) continue;
+		while (hasQueued(pool)) {
+			if ((s3) && (breaker_state == S3FS_AWS_BREAKER_HALF_OPEN) && (runningS3() > 0)) break; // one probe at a time
+			if (!http_limit[pool]->tryStart()) break; // busy
+			int c = pickClass(pool);
+			startRequest(http_queue[c].takeFirst());
+		}
+	}
+}
+
 void S3FS_Aws::showStatus() {
-	if ((http_running.size() == 0) && (http_queue.size() == 0)) return;
-	qDebug("S3FS_Aws: queries status %d/%d (%d in queue, %d in slow queue)", http_running.size(), S3FS_AWS_QUEUE_LENGTH, http_queue.size(), http_slow_queue.size());
+	if ((http_running.size() == 0) && (queuedCount() == 0)) return;
+	QByteArrayList pools;
+	for(int pool = 0; pool < S3FS_AWS_POOL_COUNT; pool++)
+		pools << http_limit[pool]->status();
+	QByteArrayList classes;
+	for(int c = 0; c < S3FS_AWS_CLASS_COUNT; c++)
+		classes << QByteArray(s3fs_aws_classes[c].name)+" "+QByteArray::number(http_queue[c].size());
+	qDebug("S3FS_Aws: queries status %s, queued %s, bodies %lldkB (%lldkB in memory, %lldkB spilled using %lldkB of disk), retry budget %d%s", pools.join(", ").constData(), classes.join(", ").constData(), body_outstanding / 1024, body_memory / 1024, spill.size() / 1024, spill.diskUsage() / 1024, retry_tokens, breaker_state == S3FS_AWS_BREAKER_CLOSED ? "" : ", circuit open");
 }
 
 QByteArray S3FS_Aws::getBucketRegion(const QByteArray&bucket) {
@@ -18,14 +18,92 @@
 #include <QNetworkAccessManager>
 #include <QNetworkRequest>
 #include <QTimer>
+#include <QHash>
+#include <QElapsedTimer>
+#include "S3FS_Aws_Limiter.hpp"
+#include "S3FS_Aws_Transport.hpp"
+#include "S3FS_Aws_Spill.hpp"
+#include <functional>
 
 #pragma once
 
-#define S3FS_AWS_QUEUE_LENGTH 8
+// initial concurrency of each kind of request, S3FS_Aws_Limiter adjusts these as it goes
+#define S3FS_AWS_GET_INITIAL 16
+#define S3FS_AWS_PUT_INITIAL 8
+#define S3FS_AWS_LIST_INITIAL 4
+#define S3FS_AWS_LIST_MAX 32
+#define S3FS_AWS_QUEUE_INITIAL 2
+#define S3FS_AWS_QUEUE_MAX 8
+
+enum S3FS_Aws_Pool {
+	S3FS_AWS_POOL_GET = 0, // object downloads
+	S3FS_AWS_POOL_PUT, // uploads and deletes
+	S3FS_AWS_POOL_LIST, // bucket listings
+	S3FS_AWS_POOL_QUEUE, // SQS calls, long polls would skew the latency of other pools
+	S3FS_AWS_POOL_COUNT
+};
+
+// kind of work a request is for, each class runs in one pool
+// demand reads go first in their pool, other classes share what is left by weight, and
+// a request waiting past its class deadline goes before anything else so none starves
+enum S3FS_Aws_Class {
+	S3FS_AWS_CLASS_READ = 0, // block a read() is waiting for
+	S3FS_AWS_CLASS_META, // inode or config fetch
+	S3FS_AWS_CLASS_PREFETCH, // block fetched ahead of reads
+	S3FS_AWS_CLASS_UPLOAD, // blocks and inodes
+	S3FS_AWS_CLASS_DELETE, // old inode revisions
+	S3FS_AWS_CLASS_LIST, // bucket listings
+	S3FS_AWS_CLASS_QUEUE, // SQS calls
+	S3FS_AWS_CLASS_COUNT
+};
+
+// what went wrong with a request, decides how it is retried
+enum S3FS_Aws_Error {
+	S3FS_AWS_ERROR_NONE = 0,
+	S3FS_AWS_ERROR_NOT_FOUND, // 404, an answer rather than a failure
+	S3FS_AWS_ERROR_THROTTLE, // 429, 503 SlowDown
+	S3FS_AWS_ERROR_SERVER, // other 5xx
+	S3FS_AWS_ERROR_NETWORK, // no answer: timeout, connection refused or reset, dns
+	S3FS_AWS_ERROR_AUTH, // 401, 403, expired token or clock skew
+	S3FS_AWS_ERROR_CLIENT, // other 4xx
+	S3FS_AWS_ERROR_COUNT
+};
+
+// retries take tokens from a shared budget, successful requests give one back
+#define S3FS_AWS_RETRY_BUDGET 500
+// consecutive failures before the circuit breaker opens, new requests then wait and the
+// filesystem is told we are overloaded. After a cooldown one request is let through to probe.
+// Only S3 requests count and are held, SQS has nothing to do with S3 being healthy.
+#define S3FS_AWS_BREAKER_FAILURES 20
+#define S3FS_AWS_BREAKER_COOLDOWN_MIN 5000
+#define S3FS_AWS_BREAKER_COOLDOWN_MAX 60000
+
+enum S3FS_Aws_Breaker {
+	S3FS_AWS_BREAKER_CLOSED = 0, // normal operation
+	S3FS_AWS_BREAKER_OPEN, // nothing is sent
+	S3FS_AWS_BREAKER_HALF_OPEN // one request at a time
+};
+
+// reads a body back from disk, runs in the io thread so it must not touch anything else
+typedef std::function<QByteArray()> S3FS_Aws_BodyReader;
+// called on the main thread when the request starts, returns a null reader if the body is gone
+typedef std::function<S3FS_Aws_BodyReader()> S3FS_Aws_BodyLoader;
+
+// request body kept for as long as the request may be retried
+// small bodies stay in memory up to a budget, others are read back from disk in the io thread
+// when the request starts, either by the caller's loader (block cache, journal) or from the spill file
+struct S3FS_Aws_Body {
+	S3FS_Aws_Body(): spill_offset(-1), size(0) {}
+	QByteArray data; // in memory
+	S3FS_Aws_BodyLoader loader; // provided by the caller
+	qint64 spill_offset; // in S3FS_Aws::spill, -1 if not there
+	qint64 size;
+};
 
 class S3FS_Config;
 class S3FS_Aws_S3;
 class S3FS_Aws_SQS;
+class S3FS_Store_Worker;
 class QNetworkReply;
 
 struct S3FS_Aws_Queue_Entry {
@@ -34,24 +112,42 @@ struct S3FS_Aws_Queue_Entry {
 	QIODevice *data;
 	QObject *sender; // sender slot requestStarted(QNetworkReply*) will be called once query starts
 	QByteArray subpath;
-	QByteArray raw_data;
+	S3FS_Aws_Body body;
 	int sign;
+	int request_class;
+	qint64 queued; // ms, S3FS_Aws::clock
+};
+
+struct S3FS_Aws_Running {
+	int pool;
+	QElapsedTimer started;
+	qint64 ttfb; // ms until headers were received, -1 before that
+	qint64 bytes; // request and response body
+	bool congestion; // throttled or failed in a way that suggests too many requests
 };
 
 class S3FS_Aws: public QObject {
 	Q_OBJECT
 public:
 	S3FS_Aws(S3FS_Config *cfg, QObject *parent = 0);
+	~S3FS_Aws();
 	bool isValid();
 	const QByteArray &getAwsId() const;
+	void setSpillPath(const QString &path);
+	void setWorker(S3FS_Store_Worker *worker); // bodies are read back in its io thread
+	static int classifyError(QNetworkReply *reply, const QByteArray &body = QByteArray());
+	static const char *errorName(int error);
 
 signals:
 	void overloadStatus(bool);
 
 public slots:
 	void replyDestroyed(QObject *obj);
+	void replyMetaData();
+	void replyFinished();
 	void retrieveAwsCredentials();
 	void receiveAwsCredentials();
+	void breakerHalfOpen();
 
 protected:
 	void showStatus();
@@ -59,8 +155,11 @@ protected:
 	QByteArray signV4(const QByteArray &string, const QByteArray &path, const QByteArray &timestamp, QByteArray &algo);
 	QNetworkReply *reqV4(const QByteArray &verb, const QByteArray &subpath, QNetworkRequest req, const QByteArray &data = QByteArray());
 	void http(QObject *caller, const QByteArray &verb, const QNetworkRequest &req, QIODevice *data = 0);
-	void httpV4(QObject *caller, const QByteArray &verb, const QByteArray &subpath, const QNetworkRequest &req, const QByteArray &data = QByteArray());
-	void httpSlowV4(QObject *caller, const QByteArray &verb, const QByteArray &subpath, const QNetworkRequest &req, const QByteArray &data = QByteArray());
+	void httpV4(QObject *caller, int request_class, const QByteArray &verb, const QByteArray &subpath, const QNetworkRequest &req, const S3FS_Aws_Body &body = S3FS_Aws_Body());
+	void holdBody(S3FS_Aws_Body &body); // account for a new body, spilling it out of memory if needed
+	void releaseBody(S3FS_Aws_Body &body); // request is over
+	void reclassify(QObject *caller, int request_class); // move a queued request to another class
+	qint64 retryDelay(int error, qint64 previous); // ms to wait before retrying after a failure, counts the failure
 	QByteArray getBucketRegion(const QByteArray&bucket);
 	void setBucketRegion(const QByteArray&bucket, const QByteArray&region);
 
@@ -71,17 +170,41 @@ private:
 	QByteArray id;
 	QByteArray key;
 	QByteArray token;
-	QNetworkAccessManager net;
+	QNetworkAccessManager net; // credentials and unsigned requests
+	S3FS_Aws_Transport transport; // S3 and SQS requests
 	bool overload_status;
 	bool is_ready;
 
-	QSet<QNetworkReply*> http_running;
-	QList<S3FS_Aws_Queue_Entry*> http_queue;
-	QList<S3FS_Aws_Queue_Entry*> http_slow_queue;
+	QHash<QNetworkReply*, S3FS_Aws_Running> http_running;
+	QList<S3FS_Aws_Queue_Entry*> http_queue[S3FS_AWS_CLASS_COUNT];
+	int http_wrr[S3FS_AWS_CLASS_COUNT]; // weighted round robin state
+	S3FS_Aws_Limiter *http_limit[S3FS_AWS_POOL_COUNT];
+	QElapsedTimer clock;
+	int retry_tokens;
+	int breaker_state;
+	int breaker_failures; // consecutive
+	qint64 breaker_cooldown;
+	QTimer breaker_timer;
+	S3FS_Aws_Spill spill;
+	S3FS_Store_Worker *worker;
+	qint64 body_memory; // bytes of bodies held in memory
+	qint64 body_outstanding; // bytes of bodies not uploaded yet, wherever they are
 	QMap<QByteArray,QByteArray> aws_bucket_region;
 	S3FS_Config *cfg;
 	QTimer status_timer;
 
+	int queuedCount() const;
+	int runningS3() const; // requests in flight that count for the circuit breaker
+	bool hasQueued(int pool) const;
+	int pickClass(int pool);
+	void queue(S3FS_Aws_Queue_Entry *q);
+	void updateOverload();
+	void breakerOpen();
+	void requestSucceeded();
+	void startRequest(S3FS_Aws_Queue_Entry *q);
+	void loadBody(S3FS_Aws_Queue_Entry *q);
+	void bodyLoaded(S3FS_Aws_Queue_Entry *q, const QByteArray &data);
+	void sendRequest(S3FS_Aws_Queue_Entry *q, QNetworkReply *reply);
 	void runQueue();
 };
 
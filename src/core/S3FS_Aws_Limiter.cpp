@@ -0,0 +1,124 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "S3FS_Aws_Limiter.hpp"
+
+S3FS_Aws_Limiter::S3FS_Aws_Limiter(const QByteArray &_name, int initial, int max) {
+	name = _name;
+	max_limit = qMax((int)S3FS_AWS_LIMITER_MIN, max);
+	limit_value = qBound((int)S3FS_AWS_LIMITER_MIN, initial, max_limit);
+	running_count = 0;
+	slow_start = true;
+	limited = false;
+	congested = false;
+	window_bytes = 0;
+	window_ttfb = 0;
+	window_ttfb_count = 0;
+	last_rate = 0;
+	ttfb_avg = 0;
+	ttfb_base = 0;
+	window.start();
+}
+
+void S3FS_Aws_Limiter::setMaximum(int max) {
+	max_limit = qMax((int)S3FS_AWS_LIMITER_MIN, max);
+	if (limit_value > max_limit) limit_value = max_limit;
+}
+
+int S3FS_Aws_Limiter::limit() const {
+	return (int)limit_value;
+}
+
+int S3FS_Aws_Limiter::running() const {
+	return running_count;
+}
+
+bool S3FS_Aws_Limiter::tryStart() {
+	if (running_count >= limit()) {
+		limited = true;
+		return false;
+	}
+	running_count++;
+	return true;
+}
+
+void S3FS_Aws_Limiter::finished(qint64 ttfb, qint64 bytes, bool congestion) {
+	running_count--;
+	window_bytes += bytes + S3FS_AWS_LIMITER_REQUEST_BYTES;
+	if (ttfb >= 0) {
+		window_ttfb += ttfb;
+		window_ttfb_count++;
+	}
+	if ((congestion) && (!congested)) {
+		// react at once, but only once per window since requests in flight were sent with the old limit
+		decrease(S3FS_AWS_LIMITER_BACKOFF);
+		qDebug("S3FS_Aws_Limiter: %s requests throttled or failing, limit lowered to %d", name.constData(), limit());
+	}
+
+	if (window.elapsed() >= S3FS_AWS_LIMITER_WINDOW) adjust();
+}
+
+void S3FS_Aws_Limiter::decrease(double factor) {
+	limit_value = qMax((double)S3FS_AWS_LIMITER_MIN, limit_value * factor);
+	slow_start = false;
+	congested = true;
+}
+
+void S3FS_Aws_Limiter::adjust() {
+	qint64 elapsed = window.restart();
+	qint64 rate = window_bytes * 1000 / qMax((qint64)1, elapsed);
+
+	if (window_ttfb_count) {
+		ttfb_avg = window_ttfb / window_ttfb_count;
+		if ((ttfb_base == 0) || (ttfb_avg < ttfb_base)) {
+			ttfb_base = qMax((qint64)1, ttfb_avg);
+		} else {
+			// let the baseline follow slowly, so a route change does not look like congestion forever
+			ttfb_base += (ttfb_avg - ttfb_base) / 64;
+		}
+	}
+
+	if (congested) {
+		// already decreased during this window
+	} else if ((window_ttfb_count) && (ttfb_avg * 100 > ttfb_base * S3FS_AWS_LIMITER_LATENCY_PERCENT)) {
+		decrease(S3FS_AWS_LIMITER_LATENCY_BACKOFF);
+	} else if (limited) {
+		if (rate >= last_rate * 9 / 10) {
+			// more concurrency still pays off
+			if (slow_start) {
+				limit_value *= 1.5;
+			} else {
+				limit_value += S3FS_AWS_LIMITER_STEP;
+			}
+			if (limit_value > max_limit) limit_value = max_limit;
+		} else if (slow_start) {
+			// throughput stopped following, keep probing slowly from here
+			slow_start = false;
+		}
+	}
+
+	last_rate = rate;
+	limited = false;
+	congested = false;
+	window_bytes = 0;
+	window_ttfb = 0;
+	window_ttfb_count = 0;
+}
+
+QByteArray S3FS_Aws_Limiter::status() const {
+	return name+" "+QByteArray::number(running_count)+"/"+QByteArray::number(limit())+" ttfb "+QByteArray::number(ttfb_avg)+"ms (base "+QByteArray::number(ttfb_base)+"ms)";
+}
@@ -0,0 +1,62 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QByteArray>
+#include <QElapsedTimer>
+
+#pragma once
+
+#define S3FS_AWS_LIMITER_WINDOW 1000 // ms of completions between two adjustments
+#define S3FS_AWS_LIMITER_MIN 2 // never go below this many requests in flight
+#define S3FS_AWS_LIMITER_BACKOFF 0.7 // limit multiplier when S3 throttles or requests fail
+#define S3FS_AWS_LIMITER_LATENCY_BACKOFF 0.9 // limit multiplier when ttfb rises
+#define S3FS_AWS_LIMITER_LATENCY_PERCENT 150 // ttfb this far above the baseline means requests are queuing somewhere
+#define S3FS_AWS_LIMITER_STEP 4 // additive increase per window once out of slow start
+#define S3FS_AWS_LIMITER_REQUEST_BYTES 4096 // each request counts as this many bytes, so pools moving little data still measure throughput
+
+// AIMD concurrency limit for one kind of S3 request
+// the limit grows while it is reached and throughput keeps up, and shrinks on
+// throttling (503 SlowDown), network errors or when time to first byte rises
+class S3FS_Aws_Limiter {
+public:
+	S3FS_Aws_Limiter(const QByteArray &name, int initial, int max);
+
+	void setMaximum(int);
+	bool tryStart(); // false if the limit is reached
+	void finished(qint64 ttfb, qint64 bytes, bool congestion); // ttfb in ms, -1 if unknown
+	int limit() const;
+	int running() const;
+	QByteArray status() const;
+
+private:
+	void decrease(double factor);
+	void adjust();
+
+	QByteArray name;
+	double limit_value;
+	int max_limit;
+	int running_count;
+	bool slow_start; // multiplicative increase until the first sign of congestion
+	bool limited; // a request had to wait for the limit during this window
+	bool congested; // limit already decreased during this window
+	QElapsedTimer window;
+	qint64 window_bytes;
+	qint64 window_ttfb;
+	int window_ttfb_count;
+	qint64 last_rate; // bytes/s during previous window
+	qint64 ttfb_avg; // ms, previous window
+	qint64 ttfb_base; // ms, lowest window average seen, slowly forgotten
+};
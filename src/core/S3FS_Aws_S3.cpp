@@ -27,6 +27,9 @@ S3FS_Aws_S3::S3FS_Aws_S3(const QByteArray &_bucket, S3FS_Aws *parent): QObject(p
 	aws = parent;
 	reply = 0;
 	request_body_buffer = 0;
+	request_class = S3FS_AWS_CLASS_META;
+	attempts = 0;
+	retry_delay = 0;
 	verb = QByteArrayLiteral("GET"); // default
 	subpath = aws->getBucketRegion(bucket)+"/s3";
 }
@@ -35,10 +38,10 @@ S3FS_Aws_S3::~S3FS_Aws_S3() {
 	if (reply) delete reply;
 }
 
-S3FS_Aws_S3 *S3FS_Aws_S3::getFile(const QByteArray &bucket, const QByteArray &path, S3FS_Aws *aws) {
+S3FS_Aws_S3 *S3FS_Aws_S3::getFile(const QByteArray &bucket, const QByteArray &path, S3FS_Aws *aws, int request_class) {
 	if (!aws->isValid()) return NULL;
 	auto i = new S3FS_Aws_S3(bucket, aws);
-	if (!i->getFile(path)) {
+	if (!i->getFile(path, request_class)) {
 		delete i;
 		return NULL;
 	}
@@ -50,13 +53,14 @@ void S3FS_Aws_S3::requestStarted(QNetworkReply *r) {
 	connectReply();
 }
 
-bool S3FS_Aws_S3::getFile(const QByteArray &path) {
+bool S3FS_Aws_S3::getFile(const QByteArray &path, int _request_class) {
 	// NOTE: if user is on aws, ssl might not be required?
 	QUrl url("https://"+bucket+".s3.amazonaws.com/"+path); // using bucketname.s3.amazonaws.com will ensure query is routed to appropriate region
 	request = QNetworkRequest(url);
 	request.setRawHeader("X-Amz-Content-SHA256", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"); // sha256("")
 
-	aws->httpV4(this, verb, subpath, request);
+	request_class = _request_class;
+	aws->httpV4(this, request_class, verb, subpath, request);
 	return true;
 }
 
@@ -89,32 +93,40 @@ bool S3FS_Aws_S3::listFiles(const QByteArray &path, const QByteArray &resume) {
 	request = QNetworkRequest(url);
 	request.setRawHeader("X-Amz-Content-SHA256", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"); // sha256("")
 
-	aws->httpV4(this, verb, subpath, request);
+	request_class = S3FS_AWS_CLASS_LIST;
+	aws->httpV4(this, request_class, verb, subpath, request);
 	return true;
 }
 
-S3FS_Aws_S3 *S3FS_Aws_S3::putFile(const QByteArray &bucket, const QByteArray &path, const QByteArray &data, S3FS_Aws *aws) {
+S3FS_Aws_S3 *S3FS_Aws_S3::putFile(const QByteArray &bucket, const QByteArray &path, const QByteArray &data, S3FS_Aws *aws, const S3FS_Aws_BodyLoader &loader) {
 	if (!aws->isValid()) return NULL;
 	auto i = new S3FS_Aws_S3(bucket, aws);
-	if (!i->putFile(path, data)) {
+	if (!i->putFile(path, data, loader)) {
 		delete i;
 		return NULL;
 	}
 	return i;
 }
 
-bool S3FS_Aws_S3::putFile(const QByteArray &path, const QByteArray &data) {
+bool S3FS_Aws_S3::putFile(const QByteArray &path, const QByteArray &data, const S3FS_Aws_BodyLoader &loader) {
 	QUrl url("https://"+bucket+".s3.amazonaws.com/"+path);
 	request = QNetworkRequest(url);
 	request.setHeader(QNetworkRequest::ContentTypeHeader, "application/octet-stream"); // RFC 2046
 	request.setRawHeader("Content-MD5", QCryptographicHash::hash(data, QCryptographicHash::Md5).toBase64());
 
 	// keep request body around in case we need to retry
-	request_body = data;
+	if (loader) {
+		request_body.loader = loader;
+	} else {
+		request_body.data = data;
+	}
+	request_body.size = data.size();
+	aws->holdBody(request_body);
 
 	verb = "PUT";
+	request_class = S3FS_AWS_CLASS_UPLOAD;
 
-	aws->httpSlowV4(this, verb, subpath, request, request_body);
+	aws->httpV4(this, request_class, verb, subpath, request, request_body);
 	return true;
 }
 
@@ -142,8 +154,9 @@ bool S3FS_Aws_S3::deleteFile(const QByteArray &path) {
 	QUrl url("https://"+bucket+".s3.amazonaws.com/"+path);
 	request = QNetworkRequest(url);
 	verb = "DELETE";
+	request_class = S3FS_AWS_CLASS_DELETE;
 
-	aws->httpV4(this, verb, subpath, request);
+	aws->httpV4(this, request_class, verb, subpath, request);
 	return true;
 }
 
@@ -154,6 +167,7 @@ void S3FS_Aws_S3::connectReply() {
 void S3FS_Aws_S3::requestFinished() {
 	if (reply->error() == QNetworkReply::ContentNotFoundError) {
 		// file was not found
+		aws->releaseBody(request_body);
 		reply_body = QByteArray();
 		finished(this);
 		deleteLater();
@@ -161,41 +175,79 @@ void S3FS_Aws_S3::requestFinished() {
 	}
 	if (reply->error() != QNetworkReply::NoError) {
 		QByteArray response = reply->readAll();
-		if (response.indexOf("AuthorizationHeaderMalformed")) {
+		if (response.indexOf("AuthorizationHeaderMalformed") != -1) {
 			// likely wrong region, good one is in the msg
 			QRegExp rx("<Region>([a-z0-9-]+)</Region>");
 			if (rx.indexIn(response) != -1) {
 				qDebug("Detected correct region %s for bucket, retrying...", qPrintable(rx.cap(1)));
 				aws->setBucketRegion(bucket, rx.cap(1).toLatin1());
 				subpath = rx.cap(1).toLatin1()+"/s3";
+				releaseReply();
 				QTimer::singleShot(1000, this, SLOT(retry()));
 				return;
 			}
 		}
-		qDebug("ERROR HTTP %s", reply->readAll().data());
-		qDebug("%s, re-queuing", qPrintable(reply->errorString()));
-		QTimer::singleShot(1000, this, SLOT(retry()));
+		int error = S3FS_Aws::classifyError(reply, response);
+		QRegExp code_rx("<Code>([A-Za-z]+)</Code>");
+		QString code = code_rx.indexIn(response) != -1 ? code_rx.cap(1) : reply->errorString();
+		attempts++;
+
+		if ((request_class == S3FS_AWS_CLASS_DELETE) && ((error == S3FS_AWS_ERROR_CLIENT) || (attempts >= S3FS_AWS_S3_DELETE_ATTEMPTS))) {
+			// only old revisions get deleted, leaving one behind is better than retrying forever
+			qWarning("S3FS_Aws_S3: giving up on %s %s after %d attempts: %s", verb.constData(), qPrintable(request.url().path()), attempts, qPrintable(code));
+			aws->releaseBody(request_body);
+			reply_body = QByteArray();
+			finished(this);
+			deleteLater();
+			return;
+		}
+
+		retry_delay = aws->retryDelay(error, retry_delay);
+		if (error == S3FS_AWS_ERROR_AUTH)
+			qWarning("S3FS_Aws_S3: access denied by S3 (%s), check credentials, bucket policy and system clock", qPrintable(code));
+		qDebug("S3FS_Aws_S3: %s %s failed (%s: %s), attempt %d, retrying in %lldms", verb.constData(), qPrintable(request.url().path()), S3FS_Aws::errorName(error), qPrintable(code), attempts, retry_delay);
+		releaseReply(); // do not hold a slot of the pool while waiting
+		QTimer::singleShot(retry_delay, this, SLOT(retry()));
 		return;
 	}
 //	int http_code = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
 	if (reply->hasRawHeader("location")) {
 //		qDebug("**** REDIRECT TO %s", reply->rawHeader("location").data());
 		request.setUrl(QUrl(reply->rawHeader("location")));
+		releaseReply();
 		QTimer::singleShot(1000, this, SLOT(retry()));
 		return;
 	}
+	aws->releaseBody(request_body);
 	reply_body = reply->readAll();
 //	qDebug("HTTP REPLY %d %s", http_code, reply_body.data());
 	finished(this); // because we're in the same thread, signal will be called immediately
 	deleteLater(); // so when this object will be erased will be later
 }
 
+void S3FS_Aws_S3::releaseReply() {
+	// destroying the reply gives its slot back to the limiter, along with any congestion it saw
+	reply->disconnect(this);
+	reply->deleteLater();
+	reply = 0;
+}
+
 void S3FS_Aws_S3::retry() {
-	if (reply) {
-		reply->deleteLater();
-		reply = 0;
-	}
-	aws->httpV4(this, verb, subpath, request, request_body);
+	aws->httpV4(this, request_class, verb, subpath, request, request_body);
+}
+
+void S3FS_Aws_S3::bodyLost() {
+	// not finished, the caller decides whether to send it again
+	qCritical("S3FS_Aws_S3: could not read body of %s %s anymore", verb.constData(), qPrintable(request.url().path()));
+	aws->releaseBody(request_body);
+	lost(this);
+	deleteLater();
+}
+
+void S3FS_Aws_S3::setRequestClass(int c) {
+	if (request_class == c) return;
+	request_class = c;
+	if (!reply) aws->reclassify(this, c); // still queued
 }
 
 const QByteArray &S3FS_Aws_S3::body() const {
@@ -19,6 +19,8 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define S3FS_AWS_S3_DELETE_ATTEMPTS 5
+
 class QNetworkReply;
 class QBuffer;
 
@@ -27,13 +29,14 @@ class S3FS_Aws_S3: public QObject {
 public:
 	~S3FS_Aws_S3();
 
-	static S3FS_Aws_S3 *getFile(const QByteArray &bucket, const QByteArray &path, S3FS_Aws *aws);
+	static S3FS_Aws_S3 *getFile(const QByteArray &bucket, const QByteArray &path, S3FS_Aws *aws, int request_class = S3FS_AWS_CLASS_META);
 	static S3FS_Aws_S3 *listFiles(const QByteArray &bucket, const QByteArray &path, S3FS_Aws *aws);
-	static S3FS_Aws_S3 *putFile(const QByteArray &bucket, const QByteArray &path, const QByteArray &data, S3FS_Aws *aws);
+	static S3FS_Aws_S3 *putFile(const QByteArray &bucket, const QByteArray &path, const QByteArray &data, S3FS_Aws *aws, const S3FS_Aws_BodyLoader &loader = S3FS_Aws_BodyLoader()); // with a loader, data is not kept and is read again when needed
 	static S3FS_Aws_S3 *deleteFile(const QByteArray &bucket, const QByteArray &path, S3FS_Aws *aws);
 	static S3FS_Aws_S3 *deleteFile(S3FS_Aws_S3 *req); // delete a previously requested file
 
 	const QByteArray &body() const;
+	void setRequestClass(int); // for example when a prefetched block is now needed by a read
 
 	QStringList parseListFiles(bool &need_more) const;
 	S3FS_Aws_S3 *listMoreFiles(const QByteArray &path, const QStringList &); // continue listing if parseListFiles said need_more=true
@@ -42,27 +45,33 @@ public slots:
 	void requestFinished();
 	void requestStarted(QNetworkReply*);
 	void retry();
+	void bodyLost();
 
 signals:
 	void finished(S3FS_Aws_S3*);
+	void lost(S3FS_Aws_S3*); // body could not be read back, nothing was sent
 
 private:
 	S3FS_Aws_S3(const QByteArray &bucket, S3FS_Aws*);
-	bool getFile(const QByteArray &path);
+	bool getFile(const QByteArray &path, int request_class);
 	bool listFiles(const QByteArray &path, const QByteArray &resume);
-	bool putFile(const QByteArray &path, const QByteArray &data);
+	bool putFile(const QByteArray &path, const QByteArray &data, const S3FS_Aws_BodyLoader &loader);
 	bool deleteFile(const QByteArray &path);
 
 	void connectReply();
+	void releaseReply();
 
 	QByteArray bucket;
 	QByteArray subpath; // region/s3
 	QByteArray reply_body;
-	QByteArray request_body;
+	S3FS_Aws_Body request_body;
 	QByteArray verb;
 	S3FS_Aws *aws;
 	QNetworkRequest request;
 	QNetworkReply *reply;
 	QBuffer *request_body_buffer;
+	int request_class; // S3FS_Aws_Class
+	int attempts; // failed so far
+	qint64 retry_delay; // ms, previous one
 };
 
@@ -71,7 +71,7 @@ void S3FS_Aws_SQS::readReply() {
 			QUrl call = queue;
 			call.setQuery(url_q);
 			QNetworkRequest req(call);
-			aws->httpV4(this, "GET", region+"/sqs", req);
+			aws->httpV4(this, S3FS_AWS_CLASS_QUEUE, "GET", region+"/sqs", req);
 //			qDebug() << "\n\n TODO DELETE MSG \n\n" << msg.value("ReceiptHandle").trimmed();
 			// TODO http://docs.aws.amazon.com/AWSSimpleQueueService/latest/APIReference/API_DeleteMessage.html
 		}
@@ -0,0 +1,152 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "S3FS_Aws_Spill.hpp"
+#include <QFile>
+#include <fcntl.h>
+#include <unistd.h>
+
+S3FS_Aws_Spill::S3FS_Aws_Spill() {
+	max_size = 0;
+	disk = 0;
+	live = 0;
+	full = false;
+}
+
+S3FS_Aws_Spill::~S3FS_Aws_Spill() {
+	foreach(const S3FS_Aws_SpillFile &f, files)
+		::close(f.fd);
+}
+
+bool S3FS_Aws_Spill::open(const QString &_path, qint64 _max_size) {
+	foreach(const S3FS_Aws_SpillFile &f, files)
+		::close(f.fd);
+	files.clear();
+	path = _path;
+	max_size = _max_size;
+	disk = 0;
+	live = 0;
+	full = false;
+	if (!startFile(0)) {
+		qWarning("S3FS_Aws_Spill: request bodies will stay in memory");
+		return false;
+	}
+	return true;
+}
+
+bool S3FS_Aws_Spill::startFile(qint64 base) {
+	QByteArray name = QFile::encodeName(path);
+	int fd = ::open(name.constData(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		qWarning("S3FS_Aws_Spill: failed to open %s", qPrintable(path));
+		return false;
+	}
+	::unlink(name.constData()); // nothing is left behind after a crash
+	S3FS_Aws_SpillFile f;
+	f.fd = fd;
+	f.end = 0;
+	f.live = 0;
+	files.insert(base, f);
+	return true;
+}
+
+QMap<qint64, S3FS_Aws_SpillFile>::iterator S3FS_Aws_Spill::fileAt(qint64 offset) {
+	auto i = files.upperBound(offset);
+	if (i == files.begin()) return files.end();
+	return --i;
+}
+
+bool S3FS_Aws_Spill::isOpen() const {
+	return !files.isEmpty();
+}
+
+bool S3FS_Aws_Spill::isFull() const {
+	return full;
+}
+
+qint64 S3FS_Aws_Spill::write(const QByteArray &data) {
+	if (files.isEmpty()) return -1;
+	if (disk + data.size() > max_size) {
+		full = true;
+		return -1;
+	}
+	auto i = --files.end();
+	if (i->end >= S3FS_AWS_SPILL_FILE_SIZE) {
+		// bodies still needed keep this one open, the new file gets the next ones
+		if (!startFile(i.key() + i->end)) return -1;
+		i = --files.end();
+	}
+	if (pwrite(i->fd, data.constData(), data.size(), i->end) != data.size()) {
+		qWarning("S3FS_Aws_Spill: failed to write %d bytes", data.size());
+		return -1;
+	}
+	qint64 offset = i.key() + i->end;
+	i->end += data.size();
+	i->live += data.size();
+	disk += data.size();
+	live += data.size();
+	return offset;
+}
+
+bool S3FS_Aws_Spill::openRecord(qint64 offset, qint64 len, S3FS_Aws_SpillRecord &rec) {
+	auto i = fileAt(offset);
+	if (i == files.end()) return false;
+	rec.fd = dup(i->fd);
+	rec.offset = offset - i.key();
+	rec.length = len;
+	return rec.fd != -1;
+}
+
+QByteArray S3FS_Aws_Spill::readRecord(const S3FS_Aws_SpillRecord &rec) {
+	QByteArray buf(rec.length, Qt::Uninitialized);
+	bool ok = (pread(rec.fd, buf.data(), rec.length, rec.offset) == rec.length);
+	::close(rec.fd);
+	if (!ok) {
+		qWarning("S3FS_Aws_Spill: failed to read %lld bytes at %lld", rec.length, rec.offset);
+		return QByteArray();
+	}
+	return buf;
+}
+
+void S3FS_Aws_Spill::release(qint64 offset, qint64 len) {
+	auto i = fileAt(offset);
+	if (i == files.end()) return;
+	i->live -= len;
+	live -= len;
+	if (i->live == 0) {
+		if (i.key() == files.lastKey()) {
+			// everything in the current file was sent, start over
+			if (ftruncate(i->fd, 0) == 0) {
+				disk -= i->end;
+				i->end = 0;
+			}
+		} else {
+			::close(i->fd);
+			disk -= i->end;
+			files.erase(i);
+		}
+	}
+	if ((full) && (disk < max_size / 10 * 9)) full = false;
+}
+
+qint64 S3FS_Aws_Spill::size() const {
+	return live;
+}
+
+qint64 S3FS_Aws_Spill::diskUsage() const {
+	return disk;
+}
@@ -0,0 +1,68 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QByteArray>
+#include <QString>
+#include <QMap>
+
+#pragma once
+
+// a new file is started past this size, older ones are closed once none of their bodies is needed
+#define S3FS_AWS_SPILL_FILE_SIZE (64LL * 1024 * 1024)
+
+struct S3FS_Aws_SpillRecord {
+	int fd; // own descriptor, closed by readRecord()
+	qint64 offset;
+	qint64 length;
+};
+
+struct S3FS_Aws_SpillFile {
+	int fd;
+	qint64 end; // bytes written
+	qint64 live; // bytes of bodies still needed
+};
+
+// request bodies pushed out of memory while they wait in the queue
+// bodies do not survive a restart, anything that must be uploaded is in the journal anyway,
+// so files are unlinked as soon as they are created and their space goes back once closed.
+// Offsets are unique across files, each file starts where the previous one ended.
+class S3FS_Aws_Spill {
+	Q_DISABLE_COPY(S3FS_Aws_Spill)
+public:
+	S3FS_Aws_Spill();
+	~S3FS_Aws_Spill();
+
+	bool open(const QString &path, qint64 max_size);
+	bool isOpen() const;
+	bool isFull() const; // a body was refused for lack of room, until usage is back under 90%
+	qint64 write(const QByteArray &data); // offset, -1 on failure or if full
+	bool openRecord(qint64 offset, qint64 len, S3FS_Aws_SpillRecord &rec); // main thread
+	static QByteArray readRecord(const S3FS_Aws_SpillRecord &rec); // any thread
+	void release(qint64 offset, qint64 len); // a body is not needed anymore
+	qint64 size() const; // bytes of bodies still needed
+	qint64 diskUsage() const; // bytes in files, including bodies already sent
+
+private:
+	bool startFile(qint64 base);
+	QMap<qint64, S3FS_Aws_SpillFile>::iterator fileAt(qint64 offset);
+
+	QString path;
+	QMap<qint64, S3FS_Aws_SpillFile> files; // offset of their first byte => file, last one is written to
+	qint64 max_size;
+	qint64 disk;
+	qint64 live;
+	bool full;
+};
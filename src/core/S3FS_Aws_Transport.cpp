@@ -0,0 +1,249 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "S3FS_Aws_Transport.hpp"
+#include <QCoreApplication>
+#include <QThread>
+#include <QBuffer>
+#include <QPointer>
+#include <QNetworkAccessManager>
+
+class S3FS_Aws_TransportWorker: public QObject {
+public:
+	S3FS_Aws_TransportWorker(S3FS_Aws_Transport *_transport, int _index): transport(_transport), index(_index) {
+		net = new QNetworkAccessManager(this); // follows us to the worker thread
+	}
+
+protected:
+	void customEvent(QEvent *e) {
+		if (e->type() != S3FS_AWS_TRANSPORT_EVENT) {
+			QObject::customEvent(e);
+			return;
+		}
+		auto t = static_cast<S3FS_Aws_TransportEvent*>(e);
+		switch(t->kind) {
+			case S3FS_Aws_TransportEvent::Start:
+				start(t);
+				break;
+			case S3FS_Aws_TransportEvent::Abort:
+				if (replies.contains(t->id)) replies.value(t->id)->abort();
+				break;
+			default:
+				break;
+		}
+	}
+
+private:
+	void post(S3FS_Aws_TransportEvent *e) {
+		QCoreApplication::postEvent(transport, e);
+	}
+
+	void start(S3FS_Aws_TransportEvent *t) {
+		QBuffer *body = 0;
+		if (!t->data.isEmpty()) {
+			body = new QBuffer();
+			body->setData(t->data);
+			body->open(QIODevice::ReadOnly);
+		}
+		QNetworkReply *r = net->sendCustomRequest(t->req, t->verb, body);
+		if (body) body->setParent(r); // ensures QBuffer() will die
+
+		quint64 id = t->id;
+		replies.insert(id, r);
+
+		connect(r, &QNetworkReply::metaDataChanged, this, [this, id, r]() {
+			auto e = new S3FS_Aws_TransportEvent(S3FS_Aws_TransportEvent::MetaData, id, index);
+			e->status = r->attribute(QNetworkRequest::HttpStatusCodeAttribute);
+			e->reason = r->attribute(QNetworkRequest::HttpReasonPhraseAttribute);
+			e->redirect = r->attribute(QNetworkRequest::RedirectionTargetAttribute);
+			e->headers = r->rawHeaderPairs();
+			post(e);
+		});
+		connect(r, &QNetworkReply::readyRead, this, [this, id, r]() {
+			auto e = new S3FS_Aws_TransportEvent(S3FS_Aws_TransportEvent::Data, id, index);
+			e->data = r->readAll();
+			post(e);
+		});
+		connect(r, &QNetworkReply::finished, this, [this, id, r]() {
+			if (r->bytesAvailable()) {
+				auto e = new S3FS_Aws_TransportEvent(S3FS_Aws_TransportEvent::Data, id, index);
+				e->data = r->readAll();
+				post(e);
+			}
+			auto e = new S3FS_Aws_TransportEvent(S3FS_Aws_TransportEvent::Finished, id, index);
+			e->error = r->error();
+			e->error_string = r->errorString();
+			post(e);
+			replies.remove(id);
+			r->deleteLater();
+		});
+	}
+
+	S3FS_Aws_Transport *transport;
+	int index;
+	QNetworkAccessManager *net;
+	QHash<quint64, QNetworkReply*> replies;
+};
+
+// main thread side of a request running in a worker
+class S3FS_Aws_Reply: public QNetworkReply {
+public:
+	S3FS_Aws_Reply(S3FS_Aws_Transport *_transport, quint64 _id, const QNetworkRequest &req, const QByteArray &verb): transport(_transport), id(_id) {
+		setRequest(req);
+		setUrl(req.url());
+		setOperation(QNetworkAccessManager::CustomOperation);
+		setAttribute(QNetworkRequest::CustomVerbAttribute, verb);
+		open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+	}
+	~S3FS_Aws_Reply() {
+		if (transport) transport->forget(id, isFinished());
+	}
+
+	void abort() {
+		if ((!isFinished()) && (transport)) transport->abort(id); // finished will follow
+	}
+	qint64 bytesAvailable() const {
+		return buffer.size() + QIODevice::bytesAvailable();
+	}
+	bool isSequential() const {
+		return true;
+	}
+
+	void receivedMetaData(S3FS_Aws_TransportEvent *e) {
+		if (e->status.isValid()) setAttribute(QNetworkRequest::HttpStatusCodeAttribute, e->status);
+		if (e->reason.isValid()) setAttribute(QNetworkRequest::HttpReasonPhraseAttribute, e->reason);
+		if (e->redirect.isValid()) setAttribute(QNetworkRequest::RedirectionTargetAttribute, e->redirect);
+		foreach(const RawHeaderPair &h, e->headers)
+			setRawHeader(h.first, h.second);
+		emit metaDataChanged();
+	}
+	void receivedData(const QByteArray &data) {
+		buffer += data;
+		emit readyRead();
+	}
+	void receivedFinished(S3FS_Aws_TransportEvent *e) {
+		if (e->error != QNetworkReply::NoError) {
+			setError(e->error, e->error_string);
+#if QT_VERSION >= 0x050f00
+			emit errorOccurred(e->error);
+#else
+			emit error(e->error);
+#endif
+		}
+		setFinished(true);
+		emit finished();
+	}
+
+protected:
+	qint64 readData(char *data, qint64 maxlen) {
+		qint64 len = qMin(maxlen, (qint64)buffer.size());
+		if (len == 0) return isFinished() ? -1 : 0;
+		memcpy(data, buffer.constData(), len);
+		buffer.remove(0, len);
+		return len;
+	}
+
+private:
+	QPointer<S3FS_Aws_Transport> transport;
+	quint64 id;
+	QByteArray buffer; // received, not read yet
+};
+
+S3FS_Aws_Transport::S3FS_Aws_Transport(int count, QObject *parent): QObject(parent) {
+	next_id = 1;
+	if (count < 1) count = 1;
+	for(int i = 0; i < count; i++) {
+		auto thread = new QThread();
+		auto worker = new S3FS_Aws_TransportWorker(this, i);
+		worker->moveToThread(thread);
+		// its network manager, replies and timers must go away in the thread they live in
+		connect(thread, &QThread::finished, worker, &QObject::deleteLater);
+		thread->start();
+		threads.append(thread);
+		workers.append(worker);
+		load.append(0);
+	}
+}
+
+S3FS_Aws_Transport::~S3FS_Aws_Transport() {
+	foreach(QThread *thread, threads) {
+		thread->quit();
+		thread->wait(); // worker was deleted on its way out
+	}
+	workers.clear();
+	qDeleteAll(threads);
+}
+
+QNetworkReply *S3FS_Aws_Transport::send(const QNetworkRequest &req, const QByteArray &verb, const QByteArray &data) {
+	// least busy worker gets it
+	int worker = 0;
+	for(int i = 1; i < load.size(); i++)
+		if (load.at(i) < load.at(worker)) worker = i;
+
+	quint64 id = next_id++;
+	auto reply = new S3FS_Aws_Reply(this, id, req, verb);
+	replies.insert(id, reply);
+	reply_worker.insert(id, worker);
+	load[worker]++;
+
+	auto e = new S3FS_Aws_TransportEvent(S3FS_Aws_TransportEvent::Start, id, worker);
+	e->req = req;
+	e->verb = verb;
+	e->data = data;
+	QCoreApplication::postEvent(workers.at(worker), e);
+	return reply;
+}
+
+void S3FS_Aws_Transport::abort(quint64 id) {
+	if (!reply_worker.contains(id)) return;
+	QCoreApplication::postEvent(workers.at(reply_worker.value(id)), new S3FS_Aws_TransportEvent(S3FS_Aws_TransportEvent::Abort, id, reply_worker.value(id)));
+}
+
+void S3FS_Aws_Transport::forget(quint64 id, bool finished) {
+	if (!finished) abort(id); // no one is waiting for it anymore
+	replies.remove(id);
+}
+
+void S3FS_Aws_Transport::customEvent(QEvent *e) {
+	if (e->type() != S3FS_AWS_TRANSPORT_EVENT) {
+		QObject::customEvent(e);
+		return;
+	}
+	auto t = static_cast<S3FS_Aws_TransportEvent*>(e);
+	if (t->kind == S3FS_Aws_TransportEvent::Finished) {
+		load[t->worker]--;
+		reply_worker.remove(t->id);
+	}
+
+	S3FS_Aws_Reply *reply = replies.value(t->id);
+	if (!reply) return; // already destroyed
+
+	switch(t->kind) {
+		case S3FS_Aws_TransportEvent::MetaData:
+			reply->receivedMetaData(t);
+			break;
+		case S3FS_Aws_TransportEvent::Data:
+			reply->receivedData(t->data);
+			break;
+		case S3FS_Aws_TransportEvent::Finished:
+			replies.remove(t->id);
+			reply->receivedFinished(t);
+			break;
+		default:
+			break;
+	}
+}
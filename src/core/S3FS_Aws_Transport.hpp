@@ -0,0 +1,85 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QObject>
+#include <QEvent>
+#include <QHash>
+#include <QList>
+#include <QNetworkRequest>
+#include <QNetworkReply>
+
+#pragma once
+
+#define S3FS_AWS_TRANSPORT_EVENT (QEvent::User+3)
+// QNetworkAccessManager never opens more connections than this to one host, requests past
+// that wait inside Qt where the limiter cannot see them
+#define S3FS_AWS_TRANSPORT_HOST_CONNECTIONS 6
+
+class QThread;
+class S3FS_Aws_TransportWorker;
+class S3FS_Aws_Reply;
+
+// messages between the main thread and transport threads
+struct S3FS_Aws_TransportEvent: public QEvent {
+	enum Kind {
+		Start, // to worker: send req
+		Abort, // to worker
+		MetaData, // to main thread: status and headers received
+		Data, // to main thread: part of the response body
+		Finished // to main thread
+	};
+	S3FS_Aws_TransportEvent(Kind _kind, quint64 _id, int _worker): QEvent((QEvent::Type)S3FS_AWS_TRANSPORT_EVENT), kind(_kind), id(_id), worker(_worker) {}
+
+	Kind kind;
+	quint64 id;
+	int worker;
+	QNetworkRequest req;
+	QByteArray verb;
+	QByteArray data; // request body for Start, response chunk for Data
+	QVariant status;
+	QVariant reason;
+	QVariant redirect;
+	QList<QNetworkReply::RawHeaderPair> headers;
+	QNetworkReply::NetworkError error;
+	QString error_string;
+};
+
+// runs HTTP requests in a set of threads, each with its own QNetworkAccessManager and
+// keep-alive connections, so we are not limited to the 6 connections per host of a single
+// manager and TLS does not run on the main thread.
+// send() returns a QNetworkReply living in the calling thread, that behaves like the one
+// QNetworkAccessManager would return: metaDataChanged, readyRead as the body arrives, then finished
+class S3FS_Aws_Transport: public QObject {
+	Q_OBJECT
+public:
+	S3FS_Aws_Transport(int threads, QObject *parent = 0);
+	~S3FS_Aws_Transport();
+
+	QNetworkReply *send(const QNetworkRequest &req, const QByteArray &verb, const QByteArray &data = QByteArray());
+	void abort(quint64 id);
+	void forget(quint64 id, bool finished); // reply is being destroyed
+
+protected:
+	void customEvent(QEvent *e);
+
+private:
+	QList<QThread*> threads;
+	QList<S3FS_Aws_TransportWorker*> workers;
+	QList<int> load; // requests running in each worker
+	QHash<quint64, S3FS_Aws_Reply*> replies;
+	QHash<quint64, int> reply_worker;
+	quint64 next_id;
+};
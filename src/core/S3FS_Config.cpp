@@ -6,6 +6,20 @@ S3FS_Config::S3FS_Config() {
 	list_fetch_interval = 3600*48;
 	cache_data = true;
 	database_max_size = 2;
+	fuse_threads = 4;
+	splice_read = false;
+	readahead_max = 64;
+	prefetch_size = 1048576;
+	block_cache_size = 256*1048576;
+	data_cache_size = 0;
+	data_cache_min_free = 1024*1048576;
+	worker_threads = 0;
+	hash_algo = QByteArrayLiteral("SHA3_256");
+	max_requests = 512;
+	http_threads = 0; // from max_requests
+	upload_queue_memory = 64*1048576;
+	upload_queue_size = 1024*1048576;
+	upload_spill_size = 2048LL*1048576;
 }
 
 int S3FS_Config::clusterId() const {
@@ -112,3 +126,114 @@ void S3FS_Config::setDatabaseMaxSize(int s) {
 	database_max_size = s;
 }
 
+int S3FS_Config::fuseThreads() const {
+	return fuse_threads;
+}
+
+void S3FS_Config::setFuseThreads(int t) {
+	fuse_threads = t;
+}
+
+bool S3FS_Config::spliceRead() const {
+	return splice_read;
+}
+
+void S3FS_Config::setSpliceRead(bool b) {
+	splice_read = b;
+}
+
+int S3FS_Config::readaheadMax() const {
+	return readahead_max;
+}
+
+void S3FS_Config::setReadaheadMax(int r) {
+	readahead_max = r;
+}
+
+quint64 S3FS_Config::prefetchSize() const {
+	return prefetch_size;
+}
+
+void S3FS_Config::setPrefetchSize(quint64 s) {
+	prefetch_size = s;
+}
+
+quint64 S3FS_Config::blockCacheSize() const {
+	return block_cache_size;
+}
+
+void S3FS_Config::setBlockCacheSize(quint64 s) {
+	block_cache_size = s;
+}
+
+quint64 S3FS_Config::dataCacheSize() const {
+	return data_cache_size;
+}
+
+void S3FS_Config::setDataCacheSize(quint64 s) {
+	data_cache_size = s;
+}
+
+quint64 S3FS_Config::dataCacheMinFree() const {
+	return data_cache_min_free;
+}
+
+void S3FS_Config::setDataCacheMinFree(quint64 s) {
+	data_cache_min_free = s;
+}
+
+int S3FS_Config::workerThreads() const {
+	return worker_threads;
+}
+
+void S3FS_Config::setWorkerThreads(int t) {
+	worker_threads = t;
+}
+
+const QByteArray &S3FS_Config::hashAlgo() const {
+	return hash_algo;
+}
+
+void S3FS_Config::setHashAlgo(const QByteArray &a) {
+	hash_algo = a;
+}
+
+int S3FS_Config::maxRequests() const {
+	return max_requests;
+}
+
+void S3FS_Config::setMaxRequests(int m) {
+	max_requests = m;
+}
+
+int S3FS_Config::httpThreads() const {
+	return http_threads;
+}
+
+void S3FS_Config::setHttpThreads(int t) {
+	http_threads = t;
+}
+
+quint64 S3FS_Config::uploadQueueMemory() const {
+	return upload_queue_memory;
+}
+
+void S3FS_Config::setUploadQueueMemory(quint64 s) {
+	upload_queue_memory = s;
+}
+
+quint64 S3FS_Config::uploadQueueSize() const {
+	return upload_queue_size;
+}
+
+void S3FS_Config::setUploadQueueSize(quint64 s) {
+	upload_queue_size = s;
+}
+
+quint64 S3FS_Config::uploadSpillSize() const {
+	return upload_spill_size;
+}
+
+void S3FS_Config::setUploadSpillSize(quint64 s) {
+	upload_spill_size = s;
+}
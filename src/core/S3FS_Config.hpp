@@ -43,6 +43,48 @@ public:
 	int databaseMaxSize() const;
 	void setDatabaseMaxSize(int);
 
+	int fuseThreads() const;
+	void setFuseThreads(int);
+
+	bool spliceRead() const;
+	void setSpliceRead(bool);
+
+	int readaheadMax() const;
+	void setReadaheadMax(int);
+
+	quint64 prefetchSize() const;
+	void setPrefetchSize(quint64);
+
+	quint64 blockCacheSize() const;
+	void setBlockCacheSize(quint64);
+
+	quint64 dataCacheSize() const;
+	void setDataCacheSize(quint64);
+
+	quint64 dataCacheMinFree() const;
+	void setDataCacheMinFree(quint64);
+
+	int workerThreads() const;
+	void setWorkerThreads(int);
+
+	const QByteArray &hashAlgo() const;
+	void setHashAlgo(const QByteArray &);
+
+	int maxRequests() const;
+	void setMaxRequests(int);
+
+	int httpThreads() const;
+	void setHttpThreads(int);
+
+	quint64 uploadQueueMemory() const;
+	void setUploadQueueMemory(quint64);
+
+	quint64 uploadQueueSize() const;
+	void setUploadQueueSize(quint64);
+
+	quint64 uploadSpillSize() const;
+	void setUploadSpillSize(quint64);
+
 private:
 	int cluster_id; // node id within cluster
 	QByteArray mount_options; // mount options (allow_other, etc)
@@ -57,6 +99,20 @@ private:
 	QString aws_credentials_url; // for example http://169.254.169.254/latest/meta-data/iam/security-credentials/policy-name
 	QString control_socket;
 	int database_max_size;
+	int fuse_threads; // number of threads reading requests from /dev/fuse
+	bool splice_read; // reply to reads directly from cached block files
+	int readahead_max; // max number of blocks fetched ahead of sequential reads
+	quint64 prefetch_size; // files up to this size are fetched whole on open, in bytes
+	quint64 block_cache_size; // memory used to keep blocks, in bytes
+	quint64 data_cache_size; // disk space used to keep blocks, in bytes, 0 = no limit
+	quint64 data_cache_min_free; // free space to leave on the data path filesystem, in bytes
+	int worker_threads; // threads hashing and reading blocks, 0 = one per cpu
+	QByteArray hash_algo; // block hash algorithm used when formatting a new filesystem
+	int max_requests; // upper bound for concurrent S3 requests of each kind
+	int http_threads; // threads running S3 requests, each with its own connections
+	quint64 upload_queue_memory; // request bodies kept in memory, in bytes, more go to a spill file
+	quint64 upload_queue_size; // bytes waiting to be uploaded before writes are held back
+	quint64 upload_spill_size; // disk space of the spill file, in bytes
 
 };
 
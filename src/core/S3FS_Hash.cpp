@@ -0,0 +1,93 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "S3FS_Hash.hpp"
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <openssl/evp.h>
+#include <stdio.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_BLAKE2)
+#define S3FS_HASH_HAS_BLAKE2
+#endif
+
+#define S3FS_HASH_BENCHMARK_BLOCK 65536
+#define S3FS_HASH_BENCHMARK_TOTAL (1024*1024*1024)
+
+static QByteArray s3fs_hash_evp(const QByteArray &data, const EVP_MD *md) {
+	unsigned char res[EVP_MAX_MD_SIZE];
+	unsigned int res_len = 0;
+	if (!EVP_Digest(data.constData(), data.size(), res, &res_len, md, NULL))
+		return QByteArray();
+	return QByteArray((const char*)res, res_len);
+}
+
+S3FS_Hash::Algorithm S3FS_Hash::fromName(const QByteArray &name) {
+	if (name == "SHA3_256") return Sha3_256;
+	if (name == "SHA256") return Sha256;
+#ifdef S3FS_HASH_HAS_BLAKE2
+	if (name == "BLAKE2S_256") return Blake2s_256;
+#endif
+	return Invalid;
+}
+
+QByteArray S3FS_Hash::name(Algorithm a) {
+	switch(a) {
+		case Sha3_256: return QByteArrayLiteral("SHA3_256");
+		case Sha256: return QByteArrayLiteral("SHA256");
+		case Blake2s_256: return QByteArrayLiteral("BLAKE2S_256");
+		default: return QByteArray();
+	}
+}
+
+QList<S3FS_Hash::Algorithm> S3FS_Hash::available() {
+	QList<Algorithm> res;
+	res << Sha3_256 << Sha256;
+#ifdef S3FS_HASH_HAS_BLAKE2
+	res << Blake2s_256;
+#endif
+	return res;
+}
+
+QByteArray S3FS_Hash::hash(const QByteArray &data, Algorithm a) {
+	switch(a) {
+		case Sha3_256: return QCryptographicHash::hash(data, QCryptographicHash::Sha3_256);
+		case Sha256: return s3fs_hash_evp(data, EVP_sha256());
+#ifdef S3FS_HASH_HAS_BLAKE2
+		case Blake2s_256: return s3fs_hash_evp(data, EVP_blake2s256());
+#endif
+		default: return QByteArray();
+	}
+}
+
+void S3FS_Hash::benchmark() {
+	QByteArray buf(S3FS_HASH_BENCHMARK_BLOCK, '\0');
+	for(int i = 0; i < buf.size(); i++)
+		buf[i] = (char)(i * 2654435761u >> 24);
+
+	foreach(Algorithm a, available()) {
+		QElapsedTimer t;
+		t.start();
+		qint64 done = 0;
+		while(done < S3FS_HASH_BENCHMARK_TOTAL) {
+			buf[0] = hash(buf, a).at(0); // chain to keep the compiler honest
+			done += buf.size();
+		}
+		qint64 ms = qMax((qint64)1, t.elapsed());
+		printf("%-12s %8.3f GB/s\n", name(a).constData(), (double)done / ms / 1000000.0);
+	}
+}
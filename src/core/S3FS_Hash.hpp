@@ -0,0 +1,38 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QByteArray>
+#include <QList>
+
+#pragma once
+
+// block ids are the hash of the block data, the algorithm is chosen when the filesystem
+// is formatted and recorded as hash_algo in format.dat. All algorithms give 32 bytes ids.
+class S3FS_Hash {
+public:
+	enum Algorithm {
+		Invalid = 0,
+		Sha3_256, // default, Qt implementation
+		Sha256, // OpenSSL, uses SHA-NI/AVX2 when the CPU has them
+		Blake2s_256, // OpenSSL, fast in software on CPUs without SHA extensions
+	};
+
+	static Algorithm fromName(const QByteArray &name); // Invalid if unknown or not available
+	static QByteArray name(Algorithm);
+	static QList<Algorithm> available();
+	static QByteArray hash(const QByteArray &data, Algorithm); // thread safe
+	static void benchmark(); // prints throughput of each algorithm on one core
+};
@@ -22,23 +22,51 @@
 #include "S3FS_Store_MetaIterator.hpp"
 #include "S3FS_Store_InodeDoctor.hpp"
 #include "QtFuseCallback.hpp"
+#include "QtFuseCallbackGroup.hpp"
 #include <QDir>
 #include <QUuid>
 #include <QDataStream>
-
-#define INT_TO_BYTES(_x) QByteArray _x ## _b; { QDataStream s_tmp(&_x ## _b, QIODevice::WriteOnly); s_tmp << _x; }
-
-S3FS_Store::S3FS_Store(S3FS_Config *_cfg, QObject *parent): QObject(parent) {
+#include <QtEndian>
+#include <QStorageInfo>
+#include <QSharedPointer>
+#include <algorithm>
+#include <unistd.h>
+
+// big endian bytes of a quint64 (same as QDataStream), kept on the stack
+#define INT_TO_BYTES(_x) quint64 _x ## _be = qToBigEndian<quint64>(_x); QByteArray _x ## _b = QByteArray::fromRawData((const char*)&_x ## _be, sizeof(_x ## _be))
+// native quint64 key, for MDB_INTEGERKEY tables
+#define INT_TO_KEY(_x) quint64 _x ## _n = _x; QByteArray _x ## _k = QByteArray::fromRawData((const char*)&_x ## _n, sizeof(_x ## _n))
+
+// keys in misc table
+#define S3FS_STORE_KEY_CONFIG QByteArrayLiteral("config")
+#define S3FS_STORE_KEY_LISTED QByteArrayLiteral("listed")
+
+// once the cache cannot grow anymore, drop the metadata of the least recently used inodes
+#define S3FS_STORE_EVICT_PERCENT 10
+#define S3FS_STORE_EVICT_MIN_AGE 60000 // ms, inodes used recently may have pending writes
+
+// data cache is checked against its size and free space limits this often, once over them
+// segments are evicted one per event loop iteration until usage is this much below the limits
+#define S3FS_STORE_DISK_CHECK_INTERVAL 10000 // ms
+#define S3FS_STORE_DISK_HYSTERESIS 10 // percent
+
+// block uploads whose data could not be read when they started are queued again after this
+#define S3FS_STORE_UPLOAD_RETRY_DELAY 5000 // ms
+
+S3FS_Store::S3FS_Store(S3FS_Config *_cfg, QObject *parent): QObject(parent), journal(&kv), data_cache(&kv) {
 	cfg = _cfg;
 	bucket = cfg->bucket();
 	aws_list_ready = false;
 	aws_format_ready = false;
 	last_inode_rev = 0;
 	file_match = QRegExp("metadata/[0-9a-f]/[0-9a-f]{2}/([0-9a-f]{16})/([0-9a-f]{16})\\.dat");
-	algo = QCryptographicHash::Sha3_256; // default value
+	algo = S3FS_Hash::Sha3_256; // default value
 	cluster_node_id = cfg->clusterId();
 	expire_blocks = cfg->expireBlocks();
+	evicting_blocks = false;
 	inodes_cache.setMaxCost(1000000); // sizeof(S3FS_Obj) = 144, cache = 144MB
+	blocks_cache.setCapacity(cfg->blockCacheSize());
+	worker.setThreadCount(cfg->workerThreads());
 
 	// location of leveldb store
 	QString cache_path = cfg->cachePath();
@@ -60,6 +88,21 @@ S3FS_Store::S3FS_Store(S3FS_Config *_cfg, QObject *parent): QObject(parent) {
 	if (!kv.open(kv_location, (quint64)cfg->databaseMaxSize() * 1024 * 1024 * 1024)) {
 		qFatal("S3FS_Store: Failed to open cache");
 	}
+	if (!openTables()) {
+		qFatal("S3FS_Store: Failed to open cache tables");
+	}
+	migrateCache();
+	if (!data_cache.open(data_path)) {
+		qFatal("S3FS_Store: Failed to open data cache");
+	}
+	if (!journal.open(QDir(kv_location).filePath("journal"))) {
+		qFatal("S3FS_Store: Failed to open upload journal");
+	}
+	connect(&kv, SIGNAL(mapFull()), this, SLOT(evictMetadata()), Qt::QueuedConnection);
+
+	connect(&sync_timer, SIGNAL(timeout()), this, SLOT(periodicSync()));
+	sync_timer.setSingleShot(false);
+	sync_timer.start(S3FS_JOURNAL_SYNC_INTERVAL);
 
 	// protect directories (actually Qt doesn't seem to have an api to set permissions on directories, so...)
 	chmod(kv_location.toLocal8Bit().data(), 0700);
@@ -67,6 +110,8 @@ S3FS_Store::S3FS_Store(S3FS_Config *_cfg, QObject *parent): QObject(parent) {
 
 	// initialize AWS
 	aws = new S3FS_Aws(cfg, this);
+	aws->setSpillPath(data_path.filePath("upload.spill"));
+	aws->setWorker(&worker);
 
 	if (!aws->isValid()) {
 		QTimer::singleShot(1000, this, SLOT(readyStateWithoutAws()));
@@ -74,6 +119,7 @@ S3FS_Store::S3FS_Store(S3FS_Config *_cfg, QObject *parent): QObject(parent) {
 	}
 
 	connect(aws, SIGNAL(overloadStatus(bool)), this, SLOT(setOverloadStatus(bool)));
+	replayJournal();
 
 	QByteArray queue = cfg->queue();
 	if (!queue.isEmpty()) {
@@ -96,13 +142,17 @@ S3FS_Store::S3FS_Store(S3FS_Config *_cfg, QObject *parent): QObject(parent) {
 	lastaccess_cleaner.setSingleShot(false);
 	lastaccess_cleaner.start(1800000); // 30min
 
+	connect(&disk_usage_checker, SIGNAL(timeout()), this, SLOT(checkDiskUsage()));
+	disk_usage_checker.setSingleShot(false);
+	disk_usage_checker.start(S3FS_STORE_DISK_CHECK_INTERVAL);
+
 	connect(&delete_ok_stamp_update, SIGNAL(timeout()), this, SLOT(updateDeleteOkStamp()));
 	delete_ok_stamp_update.setSingleShot(false);
 	delete_ok_stamp_update.start(60000); // 1 min
 	updateDeleteOkStamp();
 
 	// quick initialize
-	if (kv.contains(QByteArrayLiteral("\xff")))
+	if (kv.contains(S3FS_STORE_KEY_LISTED, misc_table))
 		aws_list_ready = true;
 
 	// fetchers
@@ -110,6 +160,69 @@ S3FS_Store::S3FS_Store(S3FS_Config *_cfg, QObject *parent): QObject(parent) {
 	connect(S3FS_Aws_S3::getFile(bucket, "metadata/format.dat", aws), SIGNAL(finished(S3FS_Aws_S3*)), this, SLOT(receivedFormatFile(S3FS_Aws_S3*)));
 }
 
+bool S3FS_Store::openTables() {
+	if (!kv.openTable("meta", meta_table)) return false;
+	if (!kv.openTable("revision", revision_table, true)) return false;
+	if (!kv.openTable("block_access", block_access_table)) return false;
+	if (!kv.openTable("inode_access", inode_access_table, true)) return false;
+	if (!kv.openTable("misc", misc_table)) return false;
+	return true;
+}
+
+void S3FS_Store::migrateCache() {
+	// older caches stored everything in the main table, with a one byte prefix on each key
+	// 0x01 = meta (0x01 alone = config), 0x03 = revisions, 0x12 = block access, 0xff = list fetched
+	// the main table now only holds the names of other tables, which never start with these
+	auto i = new KeyvalIterator(&kv);
+	bool valid = i->first();
+	int count = 0;
+
+	kv.beginBatch();
+	while(valid) {
+		QByteArray key = i->key();
+		char type = key.at(0);
+		bool known = true;
+		switch(type) {
+			case '\x01':
+				if (key.length() == 1) {
+					kv.insert(S3FS_STORE_KEY_CONFIG, i->value(), misc_table);
+				} else {
+					kv.insert(key.mid(1), i->value(), meta_table);
+				}
+				break;
+			case '\x03':
+				if (key.length() == 9) {
+					quint64 ino = qFromBigEndian<quint64>((const uchar*)key.constData()+1);
+					INT_TO_KEY(ino);
+					kv.insert(ino_k, i->value(), revision_table);
+				}
+				break;
+			case '\x12':
+				kv.insert(key.mid(1), i->value(), block_access_table);
+				break;
+			case '\xff':
+				kv.insert(S3FS_STORE_KEY_LISTED, QByteArray(), misc_table);
+				break;
+			default:
+				known = false;
+		}
+		if (known) {
+			kv.remove(key);
+			if ((++count % 10000) == 0) {
+				// keep transactions at a reasonable size
+				kv.endBatch();
+				kv.beginBatch();
+			}
+		}
+		valid = i->next();
+	}
+	kv.endBatch();
+	delete i;
+
+	if (count > 0)
+		qDebug("S3FS_Store: migrated %d cache entries to separate tables", count);
+}
+
 void S3FS_Store::gotNewFile(const QString &_bucket, const QString &file) {
 	if (bucket != _bucket) return;
 //	qDebug("GOT NEW FILES %s", qPrintable(file));
@@ -124,8 +237,11 @@ void S3FS_Store::receivedInodeList(S3FS_Aws_S3 *r) {
 	bool need_more;
 	QStringList list = r->parseListFiles(need_more);
 //	qDebug("S3FS_Store: scanning inodes, got %d entries", list.size());
-	foreach(auto name, list) {
-		learnFile(name, true);
+	{
+		KeyvalBatch batch(&kv);
+		foreach(auto name, list) {
+			learnFile(name, true);
+		}
 	}
 	if (need_more) {
 		connect(r->listMoreFiles("metadata/", list), SIGNAL(finished(S3FS_Aws_S3*)), this, SLOT(receivedInodeList(S3FS_Aws_S3*)));
@@ -135,8 +251,8 @@ void S3FS_Store::receivedInodeList(S3FS_Aws_S3 *r) {
 	if (cfg->listFetchInterval())
 		cache_updater.start(cfg->listFetchInterval() * 1000);
 
-	if (!kv.insert(QByteArrayLiteral("\xff"), QByteArray())) { // mark list as fetched
-		qFatal("Database corruption possible, insert failed");
+	if (!kv.insert(S3FS_STORE_KEY_LISTED, QByteArray(), misc_table)) { // mark list as fetched
+		qCritical("S3FS_Store: failed to mark inodes list as fetched");
 	}
 	if (aws_list_ready) return;
 	aws_list_ready = true;
@@ -155,21 +271,21 @@ void S3FS_Store::learnFile(const QString &name, bool in_list) {
 	}
 	QByteArray fn = QByteArray::fromHex(file_match.cap(1).toLatin1());
 	QByteArray newrev = QByteArray::fromHex(file_match.cap(2).toLatin1());
+	quint64 fn_ino = qFromBigEndian<quint64>((const uchar*)fn.constData());
+	INT_TO_KEY(fn_ino);
 
-	if (kv.contains(QByteArrayLiteral("\x03")+fn)) {
+	if (kv.contains(fn_ino_k, revision_table)) {
 		// remove old file
-		quint64 fn_ino;
-		QDataStream(fn) >> fn_ino;
 		if (inodes_to_update.contains(fn_ino)) return; // this is pending transmission
-		QByteArray rev = kv.value(QByteArrayLiteral("\x03")+fn);
+		QByteArray rev = kv.value(fn_ino_k, revision_table);
 		if (rev == newrev) return; // no change
 		if (rev < newrev) {
 			// our version is older, update our value and do not delete from S3
 			qDebug("S3FS_Store: inode %s update - our version %s, s3 has %s", fn.toHex().data(), rev.toHex().data(), newrev.toHex().data());
-			if (!kv.insert(QByteArrayLiteral("\x03")+fn, newrev)) {
-				qFatal("Database insertion failed, corruption likely");
+			if (!kv.insert(fn_ino_k, newrev, revision_table)) {
+				qCritical("S3FS_Store: failed to store revision of inode %s", fn.toHex().data());
 			}
-			if (kv.contains(QByteArrayLiteral("\x01")+fn)) {
+			if (kv.contains(fn, meta_table)) {
 				// clear this inode from cache
 				qDebug("S3FS_Store: Inode %s has changed, invalidating cache", fn.toHex().data());
 				removeInodeFromCache(fn_ino);
@@ -188,21 +304,62 @@ void S3FS_Store::learnFile(const QString &name, bool in_list) {
 		}
 		return;
 	}
-	if (!kv.insert(QByteArrayLiteral("\x03")+fn, newrev)) {
-		qFatal("Database insertion failed, corruption likely");
+	if (!kv.insert(fn_ino_k, newrev, revision_table)) {
+		qCritical("S3FS_Store: failed to store revision of inode %s", fn.toHex().data()); // will retry on next list
 	}
 }
 
 void S3FS_Store::removeInodeFromCache(quint64 ino) {
-	INT_TO_BYTES(ino);
+	// collect keys first, an open iterator keeps the map from growing if the removals need room
+	QList<QByteArray> keys;
 	auto i = getInodeMetaIterator(ino);
+	if (i->isValid()) {
+		do {
+			keys.append(i->fullKey());
+		} while(i->next());
+	}
+	delete i;
+
 	inodes_cache.remove(ino);
+	INT_TO_KEY(ino);
 
-	if (!i->isValid()) return;
-	do {
-		kv.remove(i->fullKey());
-	} while(i->next());
+	KeyvalBatch batch(&kv);
+	kv.remove(ino_k, inode_access_table);
+	foreach(const QByteArray &key, keys)
+		kv.remove(key, meta_table);
+}
+
+void S3FS_Store::evictMetadata() {
+	// map is full and cannot grow, drop metadata of cold inodes. It can be fetched again from S3 when needed
+	quint64 now = QDateTime::currentMSecsSinceEpoch();
+	quint64 recent = now - S3FS_STORE_EVICT_MIN_AGE;
+	INT_TO_BYTES(recent);
+
+	QList<QPair<QByteArray, quint64> > candidates;
+	int total = 0;
+	auto i = new KeyvalIterator(&kv, inode_access_table);
+	bool valid = i->first();
+	while(valid) {
+		QByteArray key = i->key();
+		QByteArray t = i->value();
+		valid = i->next();
+		if (key.length() != sizeof(quint64)) continue;
+		total++;
+		quint64 ino;
+		memcpy(&ino, key.constData(), sizeof(ino));
+		if (!(t < recent_b)) continue;
+		if ((lastaccess_inodes.contains(ino)) || (inodes_to_update.contains(ino)) || (inode_uploads.contains(ino)) || (inode_download_callback.contains(ino))) continue;
+		candidates.append(qMakePair(t, ino));
+	}
 	delete i;
+
+	std::sort(candidates.begin(), candidates.end());
+	int count = qMin(candidates.size(), qMax(1, total * S3FS_STORE_EVICT_PERCENT / 100));
+	qWarning("S3FS_Store: cache is full, evicting metadata of %d inodes out of %d", count, total);
+
+	KeyvalBatch batch(&kv);
+	for(int n = 0; n < count; n++)
+		removeInodeFromCache(candidates.at(n).second);
 }
 
 void S3FS_Store::receivedFormatFile(S3FS_Aws_S3 *r) {
@@ -214,6 +371,7 @@ void S3FS_Store::receivedFormatFile(S3FS_Aws_S3 *r) {
 		return;
 	}
 	config = c.toMap();
+	applyConfig();
 
 	qDebug("S3FS_Store: got config from AWS");
 	aws_format_ready = true;
@@ -226,45 +384,57 @@ const QVariantMap &S3FS_Store::getConfig() {
 
 bool S3FS_Store::readConfig() {
 	QVariant c;
-	QDataStream kv_val(kv.value(QByteArrayLiteral("\x01"))); kv_val >> c;
+	QDataStream kv_val(kv.valueView(S3FS_STORE_KEY_CONFIG, misc_table)); kv_val >> c;
 	if (!c.isValid()) return false;
 	if (c.type() != QVariant::Map) return false;
 	config = c.toMap();
+	applyConfig();
 	return true;
 }
 
 bool S3FS_Store::setConfig(const QVariantMap&c) {
 	QByteArray buf;
 	QDataStream buf_stream(&buf, QIODevice::WriteOnly); buf_stream << (QVariant)c;
-	if (!kv.insert(QByteArrayLiteral("\x01"), buf)) {
+	if (!kv.insert(S3FS_STORE_KEY_CONFIG, buf, misc_table)) {
 		return false;
 	}
 	S3FS_Aws_S3::putFile(bucket, "metadata/format.dat", buf, aws);
 	config = c;
+	applyConfig();
 	return true;
 }
 
+void S3FS_Store::applyConfig() {
+	if (!config.contains("hash_algo")) return;
+
+	QByteArray name = config.value("hash_algo").toByteArray();
+	S3FS_Hash::Algorithm a = S3FS_Hash::fromName(name);
+	if (a == S3FS_Hash::Invalid) {
+		// writing blocks under another hash would corrupt the filesystem for every other node
+		qFatal("S3FS_Store: filesystem uses hash algorithm %s which this build does not support, refusing to mount", name.constData());
+	}
+	algo = a;
+}
+
 void S3FS_Store::readyStateWithoutAws() {
 	qDebug("S3FS_Store: Going ready without any actual backend storage!");
 	ready();
 }
 
 bool S3FS_Store::hasInode(quint64 ino) {
-	// transform quint64 to qbytearray (big endian)
-	INT_TO_BYTES(ino);
 	if (inodes_cache.contains(ino)) return true;
 
-	QByteArray key = QByteArrayLiteral("\x03") + ino_b; // where we should be storing cache info about this inode
-	return kv.contains(key);
+	INT_TO_KEY(ino);
+	return kv.contains(ino_k, revision_table); // where we should be storing cache info about this inode
 }
 
 bool S3FS_Store::storeInode(const S3FS_Obj&o) {
 	quint64 ino = o.getInode();
 	INT_TO_BYTES(ino);
 
-	QByteArray key = QByteArrayLiteral("\x01") + ino_b;
-	if (!kv.insert(key, o.encode())) return false;
-	kv.insert(QByteArrayLiteral("\x03") + ino_b, QByteArray(8, '\0')); // default to zero
+	INT_TO_KEY(ino);
+	if (!kv.insert(ino_b, o.encode(), meta_table)) return false;
+	kv.insert(ino_k, QByteArray(8, '\0'), revision_table); // default to zero
 	if (inodes_cache.contains(ino)) {
 		inodes_cache[ino]->setAttr(o.constAttr());
 	} else {
@@ -278,8 +448,129 @@ bool S3FS_Store::storeInode(const S3FS_Obj&o) {
 }
 
 void S3FS_Store::inodeUpdated(quint64 ino) {
-	if (!inodes_to_update.contains(ino))
-		inodes_to_update.insert(ino);
+	if (inodes_to_update.contains(ino)) return;
+	inodes_to_update.insert(ino);
+	inode_journal.insert(ino, journal.addInode(ino));
+}
+
+void S3FS_Store::replayJournal() {
+	// send again anything that was not confirmed by S3 before we stopped
+	auto list = journal.pending();
+	for(auto i = list.begin(); i != list.end(); ++i) {
+		if (i->type == 'I') {
+			quint64 ino = qFromBigEndian<quint64>((const uchar*)i->key.constData());
+			inodes_to_update.insert(ino);
+			inode_journal.insert(ino, i.key());
+			continue;
+		}
+		if (i->type != 'B') continue;
+		QByteArray buf = journal.data(i.key());
+		if (buf.isEmpty()) buf = readBlock(i->key); // data was in local cache
+		if (buf.isEmpty()) {
+			qWarning("S3FS_Store: block %s from journal is not available anymore, cannot upload it", i->key.toHex().data());
+			journal.done(i.key());
+			continue;
+		}
+		putBlock(i->key, buf, i.key());
+	}
+}
+
+void S3FS_Store::putBlock(const QByteArray &hash, const QByteArray &buf, quint64 journal_id) {
+	auto lost = unrecoverable_blocks.find(hash);
+	if (lost != unrecoverable_blocks.end()) {
+		// written again, this upload replaces the one that could not be done
+		if (lost.value() != journal_id) journal.done(lost.value());
+		unrecoverable_blocks.erase(lost);
+	}
+	QByteArray hash_hex = hash.toHex();
+	QByteArray path = QByteArrayLiteral("data/")+hash_hex.right(1)+"/"+hash_hex.right(2)+"/"+hash_hex+".dat";
+
+	// the block is in the journal or, pinned by it, in the local cache: read it again in the io
+	// thread when the upload starts rather than keeping it in memory while it waits
+	S3FS_Aws_BodyLoader loader = [this, hash, journal_id]() -> S3FS_Aws_BodyReader {
+		S3FS_Store_JournalRecord jrec;
+		if (journal.openRecord(journal_id, jrec)) return [jrec]() { return S3FS_Store_Journal::readRecord(jrec); };
+		S3FS_Store_DataCacheRecord rec;
+		if (data_cache.openRecord(hash, rec)) return [rec, hash]() { return S3FS_Store_DataCache::readRecord(rec, hash); };
+		// not migrated yet
+		qint64 pos, size;
+		int fd = data_cache.openFile(hash, pos, size);
+		if (fd == -1) return S3FS_Aws_BodyReader();
+		return [fd, pos, size]() {
+			QByteArray data(size, Qt::Uninitialized);
+			bool ok = (pread(fd, data.data(), size, pos) == size);
+			::close(fd);
+			return ok ? data : QByteArray();
+		};
+	};
+	S3FS_Aws_S3 *req = S3FS_Aws_S3::putFile(bucket, path, buf, aws, loader); // slow put
+	if (!req) return;
+	upload_inodes[hash]; // writes of this block from now on wait for it
+	req->setProperty("_journal_id", journal_id);
+	req->setProperty("_hash", hash);
+	connect(req, SIGNAL(finished(S3FS_Aws_S3*)), this, SLOT(uploadFinished(S3FS_Aws_S3*)));
+	connect(req, SIGNAL(lost(S3FS_Aws_S3*)), this, SLOT(uploadLost(S3FS_Aws_S3*)));
+}
+
+void S3FS_Store::uploadFinished(S3FS_Aws_S3 *r) {
+	journal.done(r->property("_journal_id").toULongLong());
+	if (r->property("_hash").isValid()) upload_inodes.remove(r->property("_hash").toByteArray());
+	if (r->property("_inode").isValid()) inodeUploadDone(r->property("_inode").toULongLong());
+}
+
+void S3FS_Store::inodeUploadDone(quint64 ino) {
+	auto i = inode_uploads.find(ino);
+	if ((i != inode_uploads.end()) && (--i.value() <= 0)) inode_uploads.erase(i);
+}
+
+void S3FS_Store::uploadLost(S3FS_Aws_S3 *r) {
+	// the journal record stays until the upload really happens
+	quint64 journal_id = r->property("_journal_id").toULongLong();
+	if (r->property("_inode").isValid()) {
+		// metadata is built again from kv by the next update
+		quint64 ino = r->property("_inode").toULongLong();
+		inodeUploadDone(ino);
+		if (inodes_to_update.contains(ino)) {
+			journal.done(journal_id); // newer record already pending
+		} else {
+			inodes_to_update.insert(ino);
+			inode_journal.insert(ino, journal_id);
+		}
+		return;
+	}
+	if (lost_blocks.isEmpty()) QTimer::singleShot(S3FS_STORE_UPLOAD_RETRY_DELAY, this, SLOT(retryLostUploads()));
+	lost_blocks.insert(journal_id, r->property("_hash").toByteArray());
+}
+
+void S3FS_Store::retryLostUploads() {
+	QMap<quint64, QByteArray> lost;
+	lost.swap(lost_blocks);
+	for(auto i = lost.constBegin(); i != lost.constEnd(); ++i) {
+		QByteArray data = journal.data(i.key());
+		if (data.isEmpty()) data = data_cache.read(i.value());
+		if (data.isEmpty()) data = blocks_cache.value(i.value());
+		if (data.isEmpty()) {
+			// the journal keeps the record until the block is written again, inodes written
+			// with it report the error on their next flush or fsync
+			qCritical("S3FS_Store: data of block %s is gone before it could be uploaded", i.value().toHex().constData());
+			unrecoverable_blocks.insert(i.value(), i.key());
+			foreach(quint64 ino, upload_inodes.take(i.value()))
+				uploadFailed(ino);
+			continue;
+		}
+		putBlock(i.value(), data, i.key());
+	}
+}
+
+bool S3FS_Store::sync() {
+	// blocks referenced by the journal must be on disk before it
+	if (!data_cache.sync()) return false;
+	return journal.sync();
+}
+
+void S3FS_Store::periodicSync() {
+	// goes through sync() so blocks are on disk before the journal records pointing at them
+	if (journal.isDirty()) sync();
 }
 
 void S3FS_Store::updateDeleteOkStamp() {
@@ -298,10 +589,12 @@ void S3FS_Store::updateInodes() {
 void S3FS_Store::sendInodeToAws(quint64 ino) {
 	INT_TO_BYTES(ino);
 	// metadata/z/yz/xyz.dat
-	//
-	// TODO store log of inode, recover log if needed
-	
-	if (!hasInodeLocally(ino)) return; // :(
+	quint64 journal_id = inode_journal.take(ino); // until S3 confirms, the journal remembers this inode needs sending
+
+	if (!hasInodeLocally(ino)) { // :(
+		journal.done(journal_id);
+		return;
+	}
 
 	QByteArray data;
 	QDataStream data_stream(&data, QIODevice::WriteOnly);
@@ -319,35 +612,43 @@ void S3FS_Store::sendInodeToAws(quint64 ino) {
 	INT_TO_BYTES(ino_rev);
 
 	QByteArray ino_hex = ino_b.toHex();
-	S3FS_Aws_S3::putFile(bucket, "metadata/"+ino_hex.right(1)+"/"+ino_hex.right(2)+"/"+ino_hex+"/"+ino_rev_b.toHex()+".dat", data, aws);
-	if (!kv.insert(QByteArrayLiteral("\x03")+ino_b, ino_rev_b)) {
-		qFatal("Database insertion failed, corruption likely");
+	S3FS_Aws_S3 *req = S3FS_Aws_S3::putFile(bucket, "metadata/"+ino_hex.right(1)+"/"+ino_hex.right(2)+"/"+ino_hex+"/"+ino_rev_b.toHex()+".dat", data, aws);
+	if (req) {
+		inode_uploads[ino]++; // S3 may still have the previous revision until this one is done
+		req->setProperty("_journal_id", journal_id);
+		req->setProperty("_inode", ino);
+		connect(req, SIGNAL(finished(S3FS_Aws_S3*)), this, SLOT(uploadFinished(S3FS_Aws_S3*)));
+		connect(req, SIGNAL(lost(S3FS_Aws_S3*)), this, SLOT(uploadLost(S3FS_Aws_S3*)));
+	}
+	INT_TO_KEY(ino);
+	if (!kv.insert(ino_k, ino_rev_b, revision_table)) {
+		qCritical("S3FS_Store: failed to store new revision of inode %llu", ino);
 	}
 }
 
 S3FS_Obj *S3FS_Store::getInode(quint64 ino) {
-	INT_TO_BYTES(ino);
+	lastaccess_inodes.insert(ino);
 	if (inodes_cache.contains(ino)) return inodes_cache.object(ino);
-	QByteArray key = QByteArrayLiteral("\x01") + ino_b;
+	INT_TO_BYTES(ino);
 
-	auto res = new S3FS_Obj(kv.value(key));
+	auto res = new S3FS_Obj(kv.valueView(ino_b, meta_table)); // decode copies what it needs
 	inodes_cache.insert(ino, res);
 	return res;
 }
 
 bool S3FS_Store::hasInodeLocally(quint64 ino) {
-	INT_TO_BYTES(ino);
 	if (inodes_cache.contains(ino)) return true;
-	QByteArray key = QByteArrayLiteral("\x01") + ino_b;
-	return kv.contains(key);
+	INT_TO_BYTES(ino);
+	return kv.contains(ino_b, meta_table);
 //	return (kv.value(key).length() > 0); // if length == 0, means we don't have this locally
 }
 void S3FS_Store::destroyInode(quint64 ino) {
 	INT_TO_BYTES(ino);
+	INT_TO_KEY(ino);
 
 	inodes_cache.remove(ino);
 
-	QByteArray ino_rev = kv.value(QByteArrayLiteral("\x03")+ino_b);
+	QByteArray ino_rev = kv.value(ino_k, revision_table);
 	if (ino_rev.isEmpty()) {
 		qCritical("S3FS_Store::destroyInode: Could not fetch inode revision!");
 		return;
@@ -358,7 +659,7 @@ void S3FS_Store::destroyInode(quint64 ino) {
 	QByteArray path = QByteArrayLiteral("metadata/")+ino_hex.right(1)+QByteArrayLiteral("/")+ino_hex.right(2)+QByteArrayLiteral("/")+ino_hex+QByteArrayLiteral("/")+ino_rev_hex+QByteArrayLiteral(".dat");
 	S3FS_Aws_S3::deleteFile(bucket, path, aws);
 
-	kv.remove(QByteArrayLiteral("\x03")+ino_b);
+	kv.remove(ino_k, revision_table);
 }
 
 void S3FS_Store::callbackOnInodeCached(quint64 ino, QtFuseCallback *cb) {
@@ -374,8 +675,9 @@ void S3FS_Store::callbackOnInodeCached(quint64 ino, QtFuseCallback *cb) {
 		inode_download_callback.insert(ino, QList<QtFuseCallback*>({cb}));
 
 	INT_TO_BYTES(ino);
+	INT_TO_KEY(ino);
 
-	QByteArray ino_rev = kv.value(QByteArrayLiteral("\x03")+ino_b);
+	QByteArray ino_rev = kv.value(ino_k, revision_table);
 	if (ino_rev.isEmpty()) {
 		qFatal("Could not fetch inode!");
 	}
@@ -392,6 +694,20 @@ void S3FS_Store::callbackOnInodeCached(quint64 ino, QtFuseCallback *cb) {
 	connect(req, SIGNAL(finished(S3FS_Aws_S3*)), this, SLOT(receivedInode(S3FS_Aws_S3*)));
 }
 
+void S3FS_Store::callbackOnInodesCached(const QList<quint64> &inodes, QtFuseCallback *cb) {
+	if (inodes.size() == 1) {
+		callbackOnInodeCached(inodes.first(), cb);
+		return;
+	}
+
+	auto group = new QtFuseCallbackGroup(cb);
+	foreach(quint64 ino, inodes) {
+		group->addPending();
+		callbackOnInodeCached(ino, group);
+	}
+	group->start();
+}
+
 void S3FS_Store::receivedInode(S3FS_Aws_S3*r) {
 	quint64 ino = r->property("_inode_num").toULongLong();
 	INT_TO_BYTES(ino);
@@ -403,14 +719,20 @@ void S3FS_Store::receivedInode(S3FS_Aws_S3*r) {
 	QDataStream s(data);
 //	qDebug("Received inode %llu", ino);
 
+	KeyvalBatch batch(&kv);
 	while(!s.atEnd()) {
 		QByteArray key, val;
 		s >> key >> val;
-		if (!kv.insert(QByteArrayLiteral("\x01")+ino_b+key, val)) {
-			qFatal("Database insertion failed, corruption likely");
+		if (!kv.insert(ino_b+key, val, meta_table)) {
+			qCritical("S3FS_Store: failed to store inode %llu", ino);
+			removeInodeFromCache(ino); // do not leave partial data
+			QList<QtFuseCallback*> list = inode_download_callback.take(ino);
+			foreach(auto cb, list)
+				cb->error(EIO);
+			return;
 		}
 	}
-	if (!kv.contains(QByteArrayLiteral("\x01")+ino_b)) {
+	if (!kv.contains(ino_b, meta_table)) {
 		new S3FS_Store_InodeDoctor(this, ino);
 		return;
 	}
@@ -418,7 +740,7 @@ void S3FS_Store::receivedInode(S3FS_Aws_S3*r) {
 	if ((!ino_o->isValid()) || (ino_o->getInode() != ino)) {
 		// not right
 		inodes_cache.remove(ino);
-		kv.remove(QByteArrayLiteral("\x01")+ino_b);
+		kv.remove(ino_b, meta_table);
 		new S3FS_Store_InodeDoctor(this, ino);
 		return;
 	}
@@ -429,61 +751,195 @@ void S3FS_Store::receivedInode(S3FS_Aws_S3*r) {
 		cb->trigger();
 }
 
-QByteArray S3FS_Store::writeBlock(const QByteArray &buf) {
-	if (buf.isEmpty()) return QByteArray();
+void S3FS_Store::writeBlock(const QByteArray &buf, quint64 order_key, const S3FS_Store_WriteCallback &cb) {
+	auto w = new S3FS_Store_BlockWrite;
+	w->data = buf;
+	w->order_key = order_key;
+	w->ordered = true;
+	w->done = false;
+	w->ok = false;
+	w->cb = cb;
+	write_order[order_key].append(w);
+
+	if (buf.isEmpty()) {
+		finishWrite(w, false);
+		return;
+	}
 
 	// compute hash
-	QByteArray hash = QCryptographicHash::hash(buf, algo);
+	S3FS_Hash::Algorithm a = algo;
+	worker.run([w, a]() { w->hash = S3FS_Hash::hash(w->data, a); }, [this, w]() { blockHashed(w); });
+}
+
+void S3FS_Store::blockHashed(S3FS_Store_BlockWrite *w) {
+	const QByteArray &hash = w->hash;
 
-	if (hasBlockLocally(hash)) {
+	S3FS_Store_BlockWrite *writing = writing_blocks.value(hash);
+	if (writing) {
+		// same data on its way to local cache already
+		writing->followers.append(w);
+		return;
+	}
+	if ((hasBlockLocally(hash)) && (!unrecoverable_blocks.contains(hash))) {
 		lastaccess_data.insert(hash);
-		blocks_cache.insert(hash, new QByteArray(buf));
-		return hash;
+		blocks_cache.insert(hash, w->data);
+		finishWrite(w, true);
+		return;
 	}
-	blocks_cache.insert(hash, new QByteArray(buf));
 
-	if (cfg->cacheData()) {
-		lastaccess_data.insert(hash);
-		// make block path
-		QByteArray hash_hex = hash.toHex();
-		QDir block_dir = QDir(data_path.filePath(hash_hex.left(2)+"/"+hash_hex.left(4)));
-		block_dir.mkpath(".");
-		QFile f(block_dir.filePath(hash_hex+".dat"));
-		if (!f.open(QIODevice::WriteOnly)) return QByteArray();
-		if (f.write(buf) != buf.size()) {
-			f.close();
-			f.remove();
-			return QByteArray();
-		}
-		f.close();
+	if (!cfg->cacheData()) {
+		// storage, journal keeps the data as we do not
+		blocks_cache.insert(hash, w->data);
+		quint64 journal_id = journal.addBlock(hash, w->data);
+		putBlock(hash, w->data, journal_id);
+		finishWrite(w, true);
+		return;
 	}
 
-	// storage
-	QByteArray hash_hex = hash.toHex();
-	QByteArray path = QByteArrayLiteral("data/")+hash_hex.right(1)+"/"+hash_hex.right(2)+"/"+hash_hex+".dat";
+	if (!data_cache.reserve(hash, w->data.size(), w->res)) {
+		finishWrite(w, false);
+		return;
+	}
+	writing_blocks.insert(hash, w);
+	worker.runIo([w]() { w->ok = S3FS_Store_DataCache::writeRecord(w->res, w->hash, w->data); }, [this, w]() { blockWritten(w); });
+}
+
+void S3FS_Store::blockWritten(S3FS_Store_BlockWrite *w) {
+	writing_blocks.remove(w->hash);
+	bool ok = data_cache.commit(w->hash, w->res, w->ok);
+	if (ok) lastaccess_data.insert(w->hash);
 
-	S3FS_Aws_S3::putFile(bucket, path, buf, aws); // slow put
+	if (!w->ordered) {
+		// downloaded block, it is on S3 whether we kept a copy or not
+		finishWrite(w, true);
+		return;
+	}
+	if (!ok) {
+		finishWrite(w, false);
+		return;
+	}
+	blocks_cache.insert(w->hash, w->data);
 
-	return hash;
+	// storage, data is in local cache
+	quint64 journal_id = journal.addBlock(w->hash, QByteArray());
+	putBlock(w->hash, w->data, journal_id);
+	finishWrite(w, true);
+}
+
+void S3FS_Store::finishWrite(S3FS_Store_BlockWrite *w, bool ok) {
+	w->done = true;
+	w->ok = ok;
+	if ((ok) && (w->ordered)) {
+		// until S3 has the block, losing it is an error for this inode too
+		auto u = upload_inodes.find(w->hash);
+		if (u != upload_inodes.end()) u->insert(w->order_key);
+	}
+	// w may be reported and gone once followers are done
+	QList<S3FS_Store_BlockWrite*> followers;
+	followers.swap(w->followers);
+	bool ordered = w->ordered;
+	quint64 key = w->order_key;
+	if (!ordered) delete w;
+
+	foreach(S3FS_Store_BlockWrite *f, followers)
+		finishWrite(f, ok);
+	if (!ordered) return;
+
+	// report writes of this key in the order they were made
+	while(true) {
+		auto i = write_order.find(key);
+		if ((i == write_order.end()) || (i->isEmpty()) || (!i->first()->done)) break;
+		S3FS_Store_BlockWrite *first = i->takeFirst();
+		if (i->isEmpty()) write_order.erase(i);
+		first->cb(first->ok ? first->hash : QByteArray());
+		delete first;
+	}
+}
+
+void S3FS_Store::cacheBlock(const QByteArray &hash, const QByteArray &data) {
+	if (!cfg->cacheData()) return;
+	if ((writing_blocks.contains(hash)) || (data_cache.contains(hash))) return;
+
+	auto w = new S3FS_Store_BlockWrite;
+	w->data = data;
+	w->hash = hash;
+	w->order_key = 0;
+	w->ordered = false;
+	w->done = false;
+	w->ok = false;
+	if (!data_cache.reserve(hash, data.size(), w->res)) {
+		delete w;
+		return;
+	}
+	writing_blocks.insert(hash, w);
+	worker.runIo([w]() { w->ok = S3FS_Store_DataCache::writeRecord(w->res, w->hash, w->data); }, [this, w]() { blockWritten(w); });
+}
+
+void S3FS_Store::waitForWorkers() {
+	worker.waitForDone();
 }
 
 QByteArray S3FS_Store::readBlock(const QByteArray &hash) {
 	lastaccess_data.insert(hash);
-	if (blocks_cache.contains(hash)) return *blocks_cache.object(hash);
-	// make block path
-	QByteArray hash_hex = hash.toHex();
-	QString block_path = data_path.filePath(hash_hex.left(2)+"/"+hash_hex.left(4)+"/"+hash_hex+".dat");
-	QFile f(block_path);
-	if (!f.open(QIODevice::ReadOnly)) return QByteArray();
-	return f.readAll();
+	QByteArray buf = blocks_cache.value(hash);
+	if (!buf.isNull()) return buf;
+	return data_cache.read(hash);
 }
 
 bool S3FS_Store::hasBlockLocally(const QByteArray &hash) {
 	if (blocks_cache.contains(hash)) return true;
-	// make block path
-	QByteArray hash_hex = hash.toHex();
-	QString block_path = data_path.filePath(hash_hex.left(2)+"/"+hash_hex.left(4)+"/"+hash_hex+".dat");
-	return QFile::exists(block_path);
+	return data_cache.contains(hash);
+}
+
+bool S3FS_Store::hasBlockInMemory(const QByteArray &hash) {
+	return blocks_cache.contains(hash);
+}
+
+void S3FS_Store::loadBlocks(const QList<QByteArray> &blocks, QtFuseCallback *cb) {
+	if (blocks.size() == 1) {
+		loadBlock(blocks.first(), cb);
+		return;
+	}
+
+	auto group = new QtFuseCallbackGroup(cb);
+	foreach(const QByteArray &block, blocks) {
+		group->addPending();
+		loadBlock(block, group);
+	}
+	group->start();
+}
+
+void S3FS_Store::loadBlock(const QByteArray &hash, QtFuseCallback *cb) {
+	lastaccess_data.insert(hash);
+	if (block_load_callback.contains(hash)) {
+		block_load_callback[hash].append(cb);
+		return;
+	}
+
+	S3FS_Store_DataCacheRecord rec;
+	if ((blocks_cache.contains(hash)) || (!data_cache.openRecord(hash, rec))) {
+		// nothing to wait for, caller will find out
+		cb->trigger();
+		return;
+	}
+	block_load_callback.insert(hash, QList<QtFuseCallback*>() << cb);
+
+	auto result = QSharedPointer<QByteArray>::create();
+	worker.run([rec, hash, result]() { *result = S3FS_Store_DataCache::readRecord(rec, hash); }, [this, hash, result]() { blockLoaded(hash, *result); });
+}
+
+void S3FS_Store::blockLoaded(const QByteArray &hash, const QByteArray &data) {
+	// damaged records are left for readBlock() to find and drop
+	if (!data.isNull()) blocks_cache.insert(hash, data);
+
+	QList<QtFuseCallback*> list = block_load_callback.take(hash);
+	foreach(auto cb, list)
+		cb->trigger();
+}
+
+int S3FS_Store::openBlockFile(const QByteArray &hash, qint64 &pos, qint64 &size) {
+	lastaccess_data.insert(hash);
+	return data_cache.openFile(hash, pos, size);
 }
 
 void S3FS_Store::callbackOnBlockCached(const QByteArray &block, QtFuseCallback *cb) {
@@ -491,49 +947,70 @@ void S3FS_Store::callbackOnBlockCached(const QByteArray &block, QtFuseCallback *
 	// we need to try to get that block
 	if (block_download_callback.contains(block)) {
 		block_download_callback[block].append(cb);
+		// a prefetch still queued must not hold the read back
+		S3FS_Aws_S3 *req = block_download_request.value(block);
+		if (req) req->setRequestClass(S3FS_AWS_CLASS_READ);
 		return;
 	}
 
 	// create wait queue
 	block_download_callback.insert(block, QList<QtFuseCallback*>() << cb);
 
+	fetchBlock(block, S3FS_AWS_CLASS_READ);
+}
+
+void S3FS_Store::prefetchBlock(const QByteArray &block) {
+	if (block_download_callback.contains(block)) return; // already on its way
+	if (hasBlockLocally(block)) return;
+	lastaccess_data.insert(block);
+
+	// nobody waiting for now
+	block_download_callback.insert(block, QList<QtFuseCallback*>());
+
+	fetchBlock(block, S3FS_AWS_CLASS_PREFETCH);
+}
+
+void S3FS_Store::fetchBlock(const QByteArray &block, int request_class) {
 	// send request
 	QByteArray block_hex = block.toHex();
 	QByteArray path = QByteArrayLiteral("data/")+block_hex.right(1)+QByteArrayLiteral("/")+block_hex.right(2)+QByteArrayLiteral("/")+block_hex+QByteArrayLiteral(".dat");
-	S3FS_Aws_S3 *req = S3FS_Aws_S3::getFile(bucket, path, aws);
+	S3FS_Aws_S3 *req = S3FS_Aws_S3::getFile(bucket, path, aws, request_class);
 	if (!req) {
 		qFatal("Could not make request to fetch block");
 	}
 	req->setProperty("_block_id", block);
+	block_download_request.insert(block, req);
 	connect(req, SIGNAL(finished(S3FS_Aws_S3*)), this, SLOT(receivedBlock(S3FS_Aws_S3*)));
 }
 
+void S3FS_Store::callbackOnBlocksCached(const QList<QByteArray> &blocks, QtFuseCallback *cb) {
+	if (blocks.size() == 1) {
+		callbackOnBlockCached(blocks.first(), cb);
+		return;
+	}
+
+	// all requests are sent now, cb is called once the last one arrives
+	auto group = new QtFuseCallbackGroup(cb);
+	foreach(const QByteArray &block, blocks) {
+		group->addPending();
+		callbackOnBlockCached(block, group);
+	}
+	group->start();
+}
+
 void S3FS_Store::receivedBlock(S3FS_Aws_S3*r) {
 	QByteArray block = r->property("_block_id").toByteArray();
 	QByteArray data = r->body();
+	block_download_request.remove(block);
 	if (data.isEmpty()) {
 		QList<QtFuseCallback*> list = block_download_callback.take(block);
 		foreach(auto cb, list)
 			cb->error(EIO);
 		return;
 	}
-	if (cfg->cacheData()) {
-		// make block path
-		QByteArray hash_hex = block.toHex();
-		QDir block_dir = QDir(data_path.filePath(hash_hex.left(2)+"/"+hash_hex.left(4)));
-		block_dir.mkpath(".");
-		QFile f(block_dir.filePath(hash_hex+".dat"));
-		if (f.open(QIODevice::WriteOnly)) {
-			if (f.write(data) != data.size()) {
-				f.close();
-				f.remove();
-			} else {
-				f.close();
-				lastaccess_data.insert(block);
-			}
-		}
-	}
-	blocks_cache.insert(block, new QByteArray(data));
+	cacheBlock(block, data);
+	// nobody waiting means this was fetched ahead of reads, see S3FS_Store_BlockCache
+	blocks_cache.insert(block, data, block_download_callback.value(block).isEmpty());
 
 	// call callbacks
 	QList<QtFuseCallback*> list = block_download_callback.take(block);
@@ -544,56 +1021,60 @@ void S3FS_Store::receivedBlock(S3FS_Aws_S3*r) {
 
 bool S3FS_Store::hasInodeMeta(quint64 ino, const QByteArray &key_sub) {
 	INT_TO_BYTES(ino);
-	QByteArray key = QByteArrayLiteral("\x01") + ino_b;
-	return kv.contains(key+key_sub);
+	return kv.contains(ino_b+key_sub, meta_table);
 }
 
 QByteArray S3FS_Store::getInodeMeta(quint64 ino, const QByteArray &key_sub) {
 	INT_TO_BYTES(ino);
-	QByteArray key = QByteArrayLiteral("\x01") + ino_b;
-	return kv.value(key+key_sub);
+	return kv.value(ino_b+key_sub, meta_table);
+}
+
+QByteArray S3FS_Store::getInodeMetaView(quint64 ino, const QByteArray &key_sub) {
+	INT_TO_BYTES(ino);
+	return kv.valueView(ino_b+key_sub, meta_table);
 }
 
 bool S3FS_Store::setInodeMeta(quint64 ino, const QByteArray &key_sub, const QByteArray &value) {
 	INT_TO_BYTES(ino);
-	QByteArray key = QByteArrayLiteral("\x01") + ino_b;
-	if (!kv.insert(key+key_sub, value)) return false;
+	if (!kv.insert(ino_b+key_sub, value, meta_table)) return false;
 	inodeUpdated(ino);
 	return true;
 }
 
 S3FS_Store_MetaIterator *S3FS_Store::getInodeListIterator() {
-	return new S3FS_Store_MetaIterator(&kv, QByteArrayLiteral("\x03"));
+	return new S3FS_Store_MetaIterator(&kv, QByteArray(), revision_table);
 }
 
 S3FS_Store_MetaIterator *S3FS_Store::getInodeMetaIterator(quint64 ino) {
 	INT_TO_BYTES(ino);
-	QByteArray key = QByteArrayLiteral("\x01") + ino_b;
-	return new S3FS_Store_MetaIterator(&kv, key);
+	return new S3FS_Store_MetaIterator(&kv, ino_b, meta_table); // iterator keeps its own copy of the prefix
 }
 
 bool S3FS_Store::removeInodeMeta(quint64 ino, const QByteArray &key_sub) {
 	INT_TO_BYTES(ino);
-	QByteArray key = QByteArrayLiteral("\x01") + ino_b;
-	if (!kv.remove(key+key_sub)) return false;
+	if (!kv.remove(ino_b+key_sub, meta_table)) return false;
 	inodeUpdated(ino);
 	return true;
 }
 
 bool S3FS_Store::clearInodeMeta(quint64 ino) {
+	// collect keys first, an open iterator keeps the map from growing if the removals need room
 	auto i = getInodeMetaIterator(ino);
 	if (!i->isValid()) {
 		delete i;
 		return false;
 	}
+	QList<QByteArray> keys;
 	do {
 		if (i->key() == "") continue;
-		if (!removeInodeMeta(ino, i->key())) {
-			delete i;
-			return false;
-		}
+		keys.append(i->key());
 	} while(i->next());
 	delete i;
+
+	KeyvalBatch batch(&kv);
+	foreach(const QByteArray &key, keys) {
+		if (!removeInodeMeta(ino, key)) return false;
+	}
 	inodeUpdated(ino);
 	return true;
 }
@@ -611,32 +1092,109 @@ quint64 S3FS_Store::makeInodeRev() {
 void S3FS_Store::lastaccess_update() {
 	quint64 t = QDateTime::currentMSecsSinceEpoch();
 	INT_TO_BYTES(t);
+	KeyvalBatch batch(&kv);
 	foreach(auto block, lastaccess_data) {
-		kv.insert(QByteArrayLiteral("\x12")+block, t_b);
+		kv.insert(block, t_b, block_access_table);
 	}
 	lastaccess_data.clear();
+	foreach(quint64 ino, lastaccess_inodes) {
+		INT_TO_KEY(ino);
+		kv.insert(ino_k, t_b, inode_access_table);
+	}
+	lastaccess_inodes.clear();
 }
 
 void S3FS_Store::lastaccess_clean() {
 	lastaccess_update(); // start by making sure we have latest data
 	// We want to remove any block of data that hasn't been used for 1 hour, or any inode unused for 24 hours
-	auto i = new KeyvalIterator(&kv);
+	auto i = new KeyvalIterator(&kv, block_access_table);
 
 	quint64 timeout_blocks = QDateTime::currentMSecsSinceEpoch() - expire_blocks*1000; // default 1 day
 	INT_TO_BYTES(timeout_blocks);
 
-	while((i->isValid()) && (i->key().at(0) == '\x12')) {
-		if (i->value() < timeout_blocks_b) {
-			qDebug("S3FS_Store: block %s not accessed for too long, removing from cache", i->key().mid(1).toHex().data());
-			// make block path
-			QByteArray hash_hex = i->key().mid(1).toHex();
-			QString block_path = data_path.filePath(hash_hex.left(2)+"/"+hash_hex.left(4)+"/"+hash_hex+".dat");
-			QFile::remove(block_path);
-			kv.remove(i->key());
-		}
-		if (!i->next()) break;
+	QSet<QByteArray> pinned = journal.cachedBlocks(); // not on S3 yet, local copy is the only one
+
+	// collect first, removing with the iterator open would keep the map from growing
+	QList<QByteArray> expired;
+	bool valid = i->first();
+	while(valid) {
+		if ((i->value() < timeout_blocks_b) && (!pinned.contains(i->key())))
+			expired.append(i->key());
+		valid = i->next();
 	}
 	delete i;
+
+	KeyvalBatch batch(&kv);
+	foreach(const QByteArray &hash, expired) {
+		qDebug("S3FS_Store: block %s not accessed for too long, removing from cache", hash.toHex().data());
+		data_cache.remove(hash);
+		kv.remove(hash, block_access_table);
+	}
+}
+
+bool S3FS_Store::diskOverLimit(bool evicting) {
+	int margin = evicting ? S3FS_STORE_DISK_HYSTERESIS : 0;
+
+	quint64 max_size = cfg->dataCacheSize();
+	if ((max_size > 0) && ((quint64)data_cache.diskUsage() > max_size * (100 - margin) / 100))
+		return true;
+
+	quint64 min_free = cfg->dataCacheMinFree();
+	if (min_free > 0) {
+		QStorageInfo storage(data_path.path());
+		if ((storage.isValid()) && ((quint64)storage.bytesAvailable() < min_free * (100 + margin) / 100))
+			return true;
+	}
+	return false;
+}
+
+void S3FS_Store::checkDiskUsage() {
+	if (evicting_blocks) return;
+	if (!cfg->cacheData()) return;
+	if (!diskOverLimit(false)) return;
+
+	qDebug("S3FS_Store: data cache uses %lld MB, over its limits, evicting least recently used blocks", data_cache.diskUsage() / 1048576);
+	evicting_blocks = true;
+	QTimer::singleShot(0, this, SLOT(evictBlocks()));
+}
+
+void S3FS_Store::evictBlocks() {
+	if (!diskOverLimit(true)) {
+		qDebug("S3FS_Store: data cache back to %lld MB", data_cache.diskUsage() / 1048576);
+		evicting_blocks = false;
+		return;
+	}
+	lastaccess_update(); // access times must be in kv
+
+	// oldest segment goes away, blocks read since it was written get a second chance unless
+	// that would carry over more than half of it, blocks still to be uploaded are always kept
+	QSet<QByteArray> pinned_blocks = journal.cachedBlocks();
+	auto pinned = [&](const QByteArray &hash) -> bool {
+		return pinned_blocks.contains(hash);
+	};
+	qint64 carried = 0;
+	auto keep = [&](const QByteArray &hash, quint32 length, qint64 sealed) -> bool {
+		if (carried + length > S3FS_DATACACHE_SEGMENT_SIZE / 2) return false;
+		QByteArray t = kv.valueView(hash, block_access_table);
+		if (t.size() != sizeof(quint64)) return false;
+		if ((qint64)qFromBigEndian<quint64>((const uchar*)t.constData()) <= sealed) return false;
+		carried += length;
+		return true;
+	};
+
+	QList<QByteArray> evicted;
+	qint64 freed = data_cache.evictOldest(pinned, keep, evicted);
+	{
+		KeyvalBatch batch(&kv);
+		foreach(const QByteArray &hash, evicted)
+			kv.remove(hash, block_access_table);
+	}
+	if (freed <= 0) {
+		qWarning("S3FS_Store: data cache is over its limits but nothing more can be evicted");
+		evicting_blocks = false;
+		return;
+	}
+	QTimer::singleShot(0, this, SLOT(evictBlocks()));
 }
 
 void S3FS_Store::setOverloadStatus(bool status) {
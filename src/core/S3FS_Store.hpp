@@ -15,14 +15,19 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <QObject>
-#include <QCryptographicHash>
 #include "Keyval.hpp"
 #include <QVariant>
 #include <QSet>
+#include <QHash>
 #include <QTimer>
 #include <QCache>
 #include <QDir>
 #include "S3FS_Obj.hpp"
+#include "S3FS_Store_Journal.hpp"
+#include "S3FS_Store_DataCache.hpp"
+#include "S3FS_Store_BlockCache.hpp"
+#include "S3FS_Store_Worker.hpp"
+#include "S3FS_Hash.hpp"
 
 #pragma once
 
@@ -34,6 +39,21 @@ class S3FS_Store_MetaIterator;
 class S3FS_Store_InodeDoctor;
 class QtFuseCallback;
 
+typedef std::function<void(const QByteArray &hash)> S3FS_Store_WriteCallback; // hash is empty if the block could not be stored
+
+// block being hashed and written to local cache by S3FS_Store_Worker
+struct S3FS_Store_BlockWrite {
+	QByteArray data;
+	QByteArray hash; // set by worker
+	quint64 order_key; // callbacks of writes with the same key are called in order
+	bool ordered; // false for downloaded blocks only written to local cache
+	bool done;
+	bool ok;
+	S3FS_Store_DataCacheReservation res;
+	S3FS_Store_WriteCallback cb;
+	QList<S3FS_Store_BlockWrite*> followers; // writes of the same block meanwhile, completed with this one
+};
+
 class S3FS_Store: public QObject {
 	Q_OBJECT
 
@@ -56,22 +76,33 @@ public:
 	void destroyInode(quint64);
 
 	// blocks
-	QByteArray writeBlock(const QByteArray &buf);
+	void writeBlock(const QByteArray &buf, quint64 order_key, const S3FS_Store_WriteCallback &cb); // hashed and stored in background, buf must not be a view
 	QByteArray readBlock(const QByteArray &buf);
+	void loadBlocks(const QList<QByteArray>&, QtFuseCallback*); // read blocks from local cache into memory in background
+	void waitForWorkers(); // complete all background writes now
 	bool hasBlockLocally(const QByteArray&);
+	bool hasBlockInMemory(const QByteArray&);
+	int openBlockFile(const QByteArray&, qint64 &pos, qint64 &size); // returns a file descriptor to be closed by caller, or -1; block is at pos in it
 	void callbackOnBlockCached(const QByteArray&, QtFuseCallback*);
+	void callbackOnBlocksCached(const QList<QByteArray>&, QtFuseCallback*); // fetch all blocks at once
+	void callbackOnInodesCached(const QList<quint64>&, QtFuseCallback*); // fetch all inodes at once
+	void prefetchBlock(const QByteArray&); // fetch block in background, with low priority
 
 	// inode meta
 	bool hasInodeMeta(quint64 ino, const QByteArray &key);
 	QByteArray getInodeMeta(quint64 ino, const QByteArray &key);
+	QByteArray getInodeMetaView(quint64 ino, const QByteArray &key); // not to be kept, see Keyval::valueView()
 	bool setInodeMeta(quint64 ino, const QByteArray &key, const QByteArray &value);
 	S3FS_Store_MetaIterator *getInodeMetaIterator(quint64 ino);
 	bool removeInodeMeta(quint64 ino, const QByteArray &key);
 	bool clearInodeMeta(quint64 ino);
 
+	bool sync(); // make sure everything acknowledged so far survives a crash
+
 signals:
 	void ready();
 	void overloadStatus(bool);
+	void uploadFailed(quint64 ino); // data written to this inode was lost before it reached S3
 
 public slots:
 	void readyStateWithoutAws();
@@ -87,27 +118,61 @@ public slots:
 
 	void lastaccess_update();
 	void lastaccess_clean();
+	void evictMetadata();
+	void checkDiskUsage();
+	void evictBlocks();
+	void uploadFinished(S3FS_Aws_S3*);
+	void uploadLost(S3FS_Aws_S3*);
+	void retryLostUploads();
+	void periodicSync();
 
 private:
 	void sendInodeToAws(quint64);
+	void inodeUploadDone(quint64);
 	void inodeUpdated(quint64);
+	void replayJournal();
+	void putBlock(const QByteArray &hash, const QByteArray &buf, quint64 journal_id);
+	void blockHashed(S3FS_Store_BlockWrite *w);
+	void blockWritten(S3FS_Store_BlockWrite *w);
+	void finishWrite(S3FS_Store_BlockWrite *w, bool ok);
+	void cacheBlock(const QByteArray &hash, const QByteArray &data);
+	void loadBlock(const QByteArray &hash, QtFuseCallback *cb);
+	void blockLoaded(const QByteArray &hash, const QByteArray &data);
 	void learnFile(const QString&, bool);
+	void fetchBlock(const QByteArray&, int request_class);
+	bool openTables();
+	bool diskOverLimit(bool evicting);
+	void migrateCache();
+	void applyConfig();
 
 	quint64 makeInodeRev();
 
 	QSet<quint64> inodes_to_update;
+	QMap<quint64, quint64> inode_journal; // inode => journal record, for inodes_to_update
+	QHash<quint64, int> inode_uploads; // inode => metadata PUTs sent and not confirmed yet, their journal record is still open
 	QTimer inodes_updater;
 	QTimer cache_updater;
 	QMap<quint64, QList<QtFuseCallback*> > inode_download_callback;
 	QMap<QByteArray, QList<QtFuseCallback*> > block_download_callback;
-	QCache<QByteArray, QByteArray> blocks_cache;
+	QHash<QByteArray, S3FS_Aws_S3*> block_download_request; // to promote prefetches once a read waits for them
+	QMap<QByteArray, QList<QtFuseCallback*> > block_load_callback; // blocks being read from local cache
+	QHash<quint64, QList<S3FS_Store_BlockWrite*> > write_order; // order key => writes not reported yet
+	QHash<QByteArray, S3FS_Store_BlockWrite*> writing_blocks; // hash => write storing it in local cache
+	S3FS_Store_BlockCache blocks_cache; // blocks in memory
 	QCache<quint64, S3FS_Obj> inodes_cache;
 
 	// lastaccess pruning system
 	QTimer lastaccess_updater;
 	QTimer lastaccess_cleaner;
 	QSet<QByteArray> lastaccess_data;
+	QSet<quint64> lastaccess_inodes;
 	quint64 expire_blocks; // expiration of cached blocks, in seconds
+	QTimer disk_usage_checker;
+	bool evicting_blocks; // data cache is over its limits, evictBlocks() is running
+	QTimer sync_timer; // journal records are made durable within S3FS_JOURNAL_SYNC_INTERVAL
+	QMap<quint64, QByteArray> lost_blocks; // journal record => hash, uploads to send again
+	QHash<QByteArray, QSet<quint64> > upload_inodes; // block hash => inodes written with it, while its upload is pending
+	QHash<QByteArray, quint64> unrecoverable_blocks; // hash => journal record, not uploaded and nowhere to be read from until written again
 
 	bool aws_list_ready;
 	bool aws_format_ready;
@@ -115,8 +180,15 @@ private:
 	int cluster_node_id;
 	QString kv_location;
 	Keyval kv; // local cache
+	KeyvalTable meta_table; // big endian inode + meta key => value, inode alone => encoded S3FS_Obj
+	KeyvalTable revision_table; // native inode => big endian revision
+	KeyvalTable block_access_table; // block hash => big endian last access time
+	KeyvalTable inode_access_table; // native inode => big endian last access time
+	KeyvalTable misc_table; // config, list fetched marker
+	S3FS_Store_Journal journal; // uploads not confirmed by S3 yet
+	S3FS_Store_DataCache data_cache; // blocks on local disk
 	QByteArray bucket;
-	QCryptographicHash::Algorithm algo;
+	S3FS_Hash::Algorithm algo;
 	QVariantMap config;
 	S3FS_Aws *aws;
 	S3FS_Aws_SQS *aws_sqs;
@@ -128,6 +200,8 @@ private:
 	QTimer delete_ok_stamp_update;
 	QByteArray delete_ok_stamp;
 
+	S3FS_Store_Worker worker; // last, so it is gone before what its tasks use
+
 	friend class S3FS_Store_InodeDoctor;
 };
 
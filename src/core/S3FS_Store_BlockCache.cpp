@@ -0,0 +1,205 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "S3FS_Store_BlockCache.hpp"
+
+S3FS_Store_BlockCache::S3FS_Store_BlockCache(QObject *parent): QObject(parent) {
+	fifo.head = fifo.tail = NULL;
+	fifo.bytes = 0;
+	lru.head = lru.tail = NULL;
+	lru.bytes = 0;
+	ghost_seq = 0;
+	stat_hits = 0;
+	stat_misses = 0;
+	stat_prefetch_hits = 0;
+	stat_prefetch_wasted = 0;
+	stat_ghost_hits = 0;
+	stat_evictions = 0;
+	stat_last_total = 0;
+	setCapacity(256LL * 1024 * 1024);
+
+	connect(&stats_timer, SIGNAL(timeout()), this, SLOT(showStats()));
+	stats_timer.setSingleShot(false);
+	stats_timer.start(S3FS_BLOCKCACHE_STATS_INTERVAL);
+}
+
+S3FS_Store_BlockCache::~S3FS_Store_BlockCache() {
+	clear();
+}
+
+void S3FS_Store_BlockCache::setCapacity(qint64 bytes) {
+	capacity = bytes;
+	ghost_max = qMax((qint64)1, capacity / (S3FS_BLOCKCACHE_TYPICAL_BLOCK + S3FS_BLOCKCACHE_ENTRY_OVERHEAD) * S3FS_BLOCKCACHE_GHOST_PERCENT / 100);
+	reclaim();
+}
+
+bool S3FS_Store_BlockCache::contains(const QByteArray &hash) const {
+	return entries.contains(hash);
+}
+
+QByteArray S3FS_Store_BlockCache::value(const QByteArray &hash) {
+	S3FS_Store_BlockCacheEntry *e = entries.value(hash);
+	if (!e) {
+		stat_misses++;
+		return QByteArray();
+	}
+	stat_hits++;
+
+	if (e->prefetch) {
+		// first real reference of a prefetched block, admit it as if it was just read
+		stat_prefetch_hits++;
+		e->prefetch = false;
+		if (ghost.remove(hash)) {
+			stat_ghost_hits++;
+			unlink(fifo, e);
+			e->frequent = true;
+			link(lru, e);
+		}
+	} else if (e->frequent) {
+		unlink(lru, e);
+		link(lru, e);
+	}
+	// references while in the FIFO are correlated, they do not move the block
+	return e->data;
+}
+
+void S3FS_Store_BlockCache::insert(const QByteArray &hash, const QByteArray &data, bool prefetch) {
+	if (data.isEmpty()) return;
+	if (data.size() + hash.size() + S3FS_BLOCKCACHE_ENTRY_OVERHEAD > capacity) return;
+
+	S3FS_Store_BlockCacheEntry *e = entries.value(hash);
+	if (e) {
+		S3FS_Store_BlockCacheList &list = e->frequent ? lru : fifo;
+		list.bytes -= cost(e);
+		e->data = data;
+		list.bytes += cost(e);
+		if (!prefetch) {
+			e->prefetch = false;
+			if (e->frequent) {
+				unlink(lru, e);
+				link(lru, e);
+			}
+		}
+		reclaim();
+		return;
+	}
+
+	e = new S3FS_Store_BlockCacheEntry;
+	e->hash = hash;
+	e->data = data;
+	e->prefetch = prefetch;
+	e->frequent = false;
+	e->prev = e->next = NULL;
+
+	// a block read again shortly after leaving the FIFO goes to the LRU list directly,
+	// prefetching alone does not count as a reference
+	if ((!prefetch) && ghost.remove(hash)) {
+		stat_ghost_hits++;
+		e->frequent = true;
+	}
+
+	entries.insert(hash, e);
+	link(e->frequent ? lru : fifo, e);
+	reclaim();
+}
+
+void S3FS_Store_BlockCache::clear() {
+	while(fifo.tail) evict(fifo);
+	while(lru.tail) evict(lru);
+	ghost.clear();
+	ghost_order.clear();
+}
+
+quint64 S3FS_Store_BlockCache::hits() const {
+	return stat_hits;
+}
+
+quint64 S3FS_Store_BlockCache::misses() const {
+	return stat_misses;
+}
+
+qint64 S3FS_Store_BlockCache::size() const {
+	return fifo.bytes + lru.bytes;
+}
+
+void S3FS_Store_BlockCache::showStats() {
+	quint64 total = stat_hits + stat_misses;
+	if (total == stat_last_total) return; // nothing happened
+	stat_last_total = total;
+	qDebug("S3FS_Store_BlockCache: %d blocks, %lld/%lld MB (%lld MB referenced again), %llu hits, %llu misses (%.1f%% hit ratio), %llu prefetch hits, %llu prefetched unread, %llu ghost hits, %llu evictions",
+		entries.size(), size() / 1048576, capacity / 1048576, lru.bytes / 1048576,
+		stat_hits, stat_misses, total ? (double)stat_hits * 100 / total : 0.0,
+		stat_prefetch_hits, stat_prefetch_wasted, stat_ghost_hits, stat_evictions);
+}
+
+void S3FS_Store_BlockCache::link(S3FS_Store_BlockCacheList &list, S3FS_Store_BlockCacheEntry *e) {
+	e->prev = NULL;
+	e->next = list.head;
+	if (list.head) list.head->prev = e;
+	list.head = e;
+	if (!list.tail) list.tail = e;
+	list.bytes += cost(e);
+}
+
+void S3FS_Store_BlockCache::unlink(S3FS_Store_BlockCacheList &list, S3FS_Store_BlockCacheEntry *e) {
+	if (e->prev) e->prev->next = e->next; else list.head = e->next;
+	if (e->next) e->next->prev = e->prev; else list.tail = e->prev;
+	e->prev = e->next = NULL;
+	list.bytes -= cost(e);
+}
+
+void S3FS_Store_BlockCache::reclaim() {
+	qint64 fifo_max = capacity * S3FS_BLOCKCACHE_IN_PERCENT / 100;
+	while(fifo.bytes + lru.bytes > capacity) {
+		// FIFO gives up space first unless it is within its share
+		if ((fifo.tail) && ((fifo.bytes > fifo_max) || (!lru.tail))) {
+			evict(fifo);
+		} else {
+			evict(lru);
+		}
+	}
+}
+
+void S3FS_Store_BlockCache::evict(S3FS_Store_BlockCacheList &list) {
+	S3FS_Store_BlockCacheEntry *e = list.tail;
+	unlink(list, e);
+	entries.remove(e->hash);
+	stat_evictions++;
+	if (&list == &fifo) {
+		if (e->prefetch) {
+			stat_prefetch_wasted++;
+		} else {
+			remember(e->hash);
+		}
+	}
+	delete e;
+}
+
+void S3FS_Store_BlockCache::remember(const QByteArray &hash) {
+	ghost.insert(hash, ++ghost_seq);
+	ghost_order.enqueue(qMakePair(ghost_seq, hash));
+
+	// keys removed from ghost on a hit are left in the queue, skip them when they come out
+	while((ghost.size() > ghost_max) || (ghost_order.size() > ghost_max * 2)) {
+		QPair<quint64, QByteArray> old = ghost_order.dequeue();
+		if (ghost.value(old.second) == old.first) ghost.remove(old.second);
+	}
+}
+
+qint64 S3FS_Store_BlockCache::cost(const S3FS_Store_BlockCacheEntry *e) {
+	return e->data.size() + e->hash.size() + S3FS_BLOCKCACHE_ENTRY_OVERHEAD;
+}
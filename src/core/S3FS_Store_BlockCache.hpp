@@ -0,0 +1,95 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QObject>
+#include <QHash>
+#include <QQueue>
+#include <QPair>
+#include <QTimer>
+
+#pragma once
+
+#define S3FS_BLOCKCACHE_IN_PERCENT 25 // share of the budget for blocks seen only once
+#define S3FS_BLOCKCACHE_GHOST_PERCENT 50 // remembered evicted keys, relative to the number of blocks fitting in the budget
+#define S3FS_BLOCKCACHE_ENTRY_OVERHEAD 96 // approximate bookkeeping cost of one block, in bytes
+#define S3FS_BLOCKCACHE_TYPICAL_BLOCK 65536 // S3FUSE_BLOCK_SIZE, used to size the ghost list
+#define S3FS_BLOCKCACHE_STATS_INTERVAL 60000 // ms
+
+struct S3FS_Store_BlockCacheEntry {
+	QByteArray hash;
+	QByteArray data;
+	bool frequent; // in the LRU list rather than the FIFO
+	bool prefetch; // fetched ahead and not read yet
+	S3FS_Store_BlockCacheEntry *prev;
+	S3FS_Store_BlockCacheEntry *next;
+};
+
+struct S3FS_Store_BlockCacheList {
+	S3FS_Store_BlockCacheEntry *head; // most recent
+	S3FS_Store_BlockCacheEntry *tail; // next to go
+	qint64 bytes;
+};
+
+// in memory block cache, byte budgeted and scan resistant (2Q)
+// blocks enter a FIFO and only move to the LRU list when referenced again after leaving it,
+// so a long sequential read only cycles through the FIFO. Prefetched blocks nobody read are not
+// remembered once evicted, they never make it to the LRU list on their own.
+class S3FS_Store_BlockCache: public QObject {
+	Q_OBJECT
+public:
+	S3FS_Store_BlockCache(QObject *parent = 0);
+	~S3FS_Store_BlockCache();
+
+	void setCapacity(qint64 bytes);
+	bool contains(const QByteArray &hash) const;
+	QByteArray value(const QByteArray &hash); // null if not cached, counts as hit/miss
+	void insert(const QByteArray &hash, const QByteArray &data, bool prefetch = false);
+	void clear();
+
+	quint64 hits() const;
+	quint64 misses() const;
+	qint64 size() const; // bytes used
+
+public slots:
+	void showStats();
+
+private:
+	void link(S3FS_Store_BlockCacheList &list, S3FS_Store_BlockCacheEntry *e);
+	void unlink(S3FS_Store_BlockCacheList &list, S3FS_Store_BlockCacheEntry *e);
+	void reclaim();
+	void evict(S3FS_Store_BlockCacheList &list);
+	void remember(const QByteArray &hash);
+	static qint64 cost(const S3FS_Store_BlockCacheEntry *e);
+
+	QHash<QByteArray, S3FS_Store_BlockCacheEntry*> entries;
+	S3FS_Store_BlockCacheList fifo; // FIFO, blocks referenced once
+	S3FS_Store_BlockCacheList lru; // LRU, blocks referenced again
+	QHash<QByteArray, quint64> ghost; // recently evicted from FIFO => sequence
+	QQueue<QPair<quint64, QByteArray> > ghost_order;
+	quint64 ghost_seq;
+	int ghost_max;
+	qint64 capacity;
+
+	// statistics
+	quint64 stat_hits;
+	quint64 stat_misses;
+	quint64 stat_prefetch_hits; // first read of a prefetched block
+	quint64 stat_prefetch_wasted; // prefetched blocks evicted unread
+	quint64 stat_ghost_hits; // blocks coming back soon after eviction
+	quint64 stat_evictions;
+	quint64 stat_last_total;
+	QTimer stats_timer;
+};
@@ -0,0 +1,130 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "S3FS_Store_BlockIndex.hpp"
+#include <string.h>
+
+S3FS_Store_BlockIndex::S3FS_Store_BlockIndex() {
+	slots = NULL;
+	capacity = 0;
+	count = 0;
+	resize(S3FS_BLOCKINDEX_MIN_SLOTS);
+}
+
+S3FS_Store_BlockIndex::~S3FS_Store_BlockIndex() {
+	delete[] slots;
+}
+
+bool S3FS_Store_BlockIndex::accepts(const QByteArray &hash) {
+	return hash.size() == S3FS_BLOCKINDEX_ID_SIZE;
+}
+
+quint32 S3FS_Store_BlockIndex::slotFor(const uchar *id) const {
+	quint32 h;
+	memcpy(&h, id, sizeof(h));
+	return h & (capacity - 1);
+}
+
+qint64 S3FS_Store_BlockIndex::lookup(const QByteArray &hash) const {
+	if (!accepts(hash)) return -1;
+	const uchar *id = (const uchar*)hash.constData();
+	quint32 i = slotFor(id);
+	while(slots[i].loc.length != 0) {
+		if (memcmp(slots[i].id, id, S3FS_BLOCKINDEX_ID_SIZE) == 0) return i;
+		i = (i + 1) & (capacity - 1);
+	}
+	return -1;
+}
+
+bool S3FS_Store_BlockIndex::find(const QByteArray &hash, S3FS_Store_DataCacheLocation &loc) const {
+	qint64 i = lookup(hash);
+	if (i == -1) return false;
+	loc = slots[i].loc;
+	return true;
+}
+
+void S3FS_Store_BlockIndex::insert(const QByteArray &hash, const S3FS_Store_DataCacheLocation &loc) {
+	if ((!accepts(hash)) || (loc.length == 0)) return;
+	qint64 existing = lookup(hash);
+	if (existing != -1) {
+		slots[existing].loc = loc;
+		return;
+	}
+	if ((quint64)(count + 1) * 100 > (quint64)capacity * S3FS_BLOCKINDEX_MAX_LOAD) resize(capacity * 2);
+
+	const uchar *id = (const uchar*)hash.constData();
+	quint32 i = slotFor(id);
+	while(slots[i].loc.length != 0) i = (i + 1) & (capacity - 1);
+	memcpy(slots[i].id, id, S3FS_BLOCKINDEX_ID_SIZE);
+	slots[i].loc = loc;
+	count++;
+}
+
+void S3FS_Store_BlockIndex::remove(const QByteArray &hash) {
+	qint64 found = lookup(hash);
+	if (found == -1) return;
+	quint32 hole = found;
+	slots[hole].loc.length = 0;
+	count--;
+
+	// shift back following entries of the run that would not be found past the hole anymore
+	quint32 i = (hole + 1) & (capacity - 1);
+	while(slots[i].loc.length != 0) {
+		quint32 home = slotFor(slots[i].id);
+		// entry may move if its home is not within (hole, i], cyclically
+		if (((i - home) & (capacity - 1)) >= ((i - hole) & (capacity - 1))) {
+			slots[hole] = slots[i];
+			slots[i].loc.length = 0;
+			hole = i;
+		}
+		i = (i + 1) & (capacity - 1);
+	}
+}
+
+void S3FS_Store_BlockIndex::clear() {
+	resize(S3FS_BLOCKINDEX_MIN_SLOTS);
+}
+
+int S3FS_Store_BlockIndex::size() const {
+	return count;
+}
+
+qint64 S3FS_Store_BlockIndex::memoryUsage() const {
+	return (qint64)capacity * sizeof(S3FS_Store_BlockIndexSlot);
+}
+
+void S3FS_Store_BlockIndex::resize(quint32 new_capacity) {
+	S3FS_Store_BlockIndexSlot *old_slots = slots;
+	quint32 old_capacity = capacity;
+	bool rehash = (old_slots != NULL) && (new_capacity > old_capacity);
+
+	slots = new S3FS_Store_BlockIndexSlot[new_capacity];
+	memset(slots, 0, sizeof(S3FS_Store_BlockIndexSlot) * new_capacity);
+	capacity = new_capacity;
+	count = 0;
+
+	if (rehash) {
+		for(quint32 j = 0; j < old_capacity; j++) {
+			if (old_slots[j].loc.length == 0) continue;
+			quint32 i = slotFor(old_slots[j].id);
+			while(slots[i].loc.length != 0) i = (i + 1) & (capacity - 1);
+			slots[i] = old_slots[j];
+			count++;
+		}
+	}
+	delete[] old_slots;
+}
@@ -0,0 +1,62 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QByteArray>
+#include <QtGlobal>
+
+#pragma once
+
+#define S3FS_BLOCKINDEX_ID_SIZE 32 // block hashes are 256 bits
+#define S3FS_BLOCKINDEX_MIN_SLOTS 1024
+#define S3FS_BLOCKINDEX_MAX_LOAD 75 // percent, table doubles past this
+
+// where a block is, stored as is in the on disk index
+struct S3FS_Store_DataCacheLocation {
+	quint32 segment;
+	quint32 offset; // start of record
+	quint32 length; // block size
+};
+
+struct S3FS_Store_BlockIndexSlot {
+	uchar id[S3FS_BLOCKINDEX_ID_SIZE];
+	S3FS_Store_DataCacheLocation loc; // length 0 means free slot
+};
+
+// in memory copy of the data cache index, so looking up a block does not need a Keyval transaction
+// open addressing with linear probing, ids are hashes already so their first bytes pick the slot
+class S3FS_Store_BlockIndex {
+	Q_DISABLE_COPY(S3FS_Store_BlockIndex)
+public:
+	S3FS_Store_BlockIndex();
+	~S3FS_Store_BlockIndex();
+
+	static bool accepts(const QByteArray &hash); // ids of another size are not indexed here
+	bool find(const QByteArray &hash, S3FS_Store_DataCacheLocation &loc) const;
+	void insert(const QByteArray &hash, const S3FS_Store_DataCacheLocation &loc);
+	void remove(const QByteArray &hash);
+	void clear();
+	int size() const;
+	qint64 memoryUsage() const;
+
+private:
+	quint32 slotFor(const uchar *id) const;
+	qint64 lookup(const QByteArray &hash) const; // slot holding hash, or -1
+	void resize(quint32 new_capacity);
+
+	S3FS_Store_BlockIndexSlot *slots;
+	quint32 capacity; // power of two
+	quint32 count;
+};
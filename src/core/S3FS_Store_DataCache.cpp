@@ -0,0 +1,631 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "S3FS_Store_DataCache.hpp"
+#include "KeyvalIterator.hpp"
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QVarLengthArray>
+#include <QtEndian>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define S3FS_DATACACHE_HEADER_SIZE 5 // hash_len + data_len, hash follows
+
+S3FS_Store_DataCache::S3FS_Store_DataCache(Keyval *_kv, QObject *parent): QObject(parent) {
+	kv = _kv;
+	active = 0;
+	active_fd = -1;
+	legacy = false;
+	legacy_it = NULL;
+
+	connect(&compact_timer, SIGNAL(timeout()), this, SLOT(compact()));
+	compact_timer.setSingleShot(false);
+}
+
+S3FS_Store_DataCache::~S3FS_Store_DataCache() {
+	// the journal is synced when it goes away right after us, blocks it points to go first
+	if (active_fd != -1) sync();
+	if (active_fd != -1) ::close(active_fd);
+	for(auto i = segments.begin(); i != segments.end(); ++i) {
+		if (i->map) munmap(i->map, i->size);
+	}
+	if (legacy_it) delete legacy_it;
+}
+
+bool S3FS_Store_DataCache::open(const QDir &_path) {
+	path = _path;
+	segment_dir = QDir(path.filePath("segments"));
+	segment_dir.mkpath(".");
+
+	if (!kv->openTable("block_location", index_table)) return false;
+	if (!kv->openTable("block_segment", segment_table, true)) return false;
+	loadIndex();
+
+	// live bytes of each segment
+	QMap<quint32, qint64> live;
+	{
+		KeyvalIterator i(kv, segment_table);
+		bool valid = i.first();
+		while(valid) {
+			QByteArray key = i.key();
+			QByteArray value = i.value();
+			if ((key.size() == sizeof(quint64)) && (value.size() == sizeof(qint64))) {
+				quint64 segment;
+				qint64 bytes;
+				memcpy(&segment, key.constData(), sizeof(segment));
+				memcpy(&bytes, value.constData(), sizeof(bytes));
+				live.insert(segment, bytes);
+			}
+			valid = i.next();
+		}
+	}
+
+	foreach(const QString &name, segment_dir.entryList(QStringList("*.seg"), QDir::Files, QDir::Name)) {
+		bool ok;
+		quint32 segment = name.left(8).toUInt(&ok, 16);
+		if (!ok) continue;
+		S3FS_Store_DataCacheSegment s;
+		s.size = QFileInfo(segment_dir.filePath(name)).size();
+		s.live = live.value(segment, 0);
+		s.map = NULL;
+		s.pending = 0;
+		segments.insert(segment, s);
+	}
+
+	// keep appending to the last segment if it has room left
+	quint32 last = segments.isEmpty() ? 1 : segments.lastKey();
+	if ((segments.contains(last)) && (segments.value(last).size >= S3FS_DATACACHE_SEGMENT_SIZE)) last++;
+	if (!openActive(last)) return false;
+
+	// blocks cached by older versions, one file per block in xx/xxxx/
+	foreach(const QString &name, path.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+		if (name.length() == 2) legacy = true;
+	}
+	if (legacy) {
+		qDebug("S3FS_Store_DataCache: moving blocks from previous cache layout to segments");
+		QTimer::singleShot(0, this, SLOT(migrateLegacy()));
+	}
+
+	compact_timer.start(S3FS_DATACACHE_COMPACT_INTERVAL);
+	return true;
+}
+
+QString S3FS_Store_DataCache::segmentPath(quint32 segment) const {
+	return segment_dir.filePath(QString("%1.seg").arg(segment, 8, 16, QChar('0')));
+}
+
+QString S3FS_Store_DataCache::legacyPath(const QByteArray &hash) const {
+	QByteArray hash_hex = hash.toHex();
+	return path.filePath(hash_hex.left(2)+"/"+hash_hex.left(4)+"/"+hash_hex+".dat");
+}
+
+bool S3FS_Store_DataCache::openActive(quint32 segment) {
+	if (active_fd != -1) {
+		// sealed, but what was written there still needs to reach the disk on next sync()
+		unsynced.insert(active);
+		::close(active_fd);
+	}
+	active_fd = ::open(QFile::encodeName(segmentPath(segment)).constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (active_fd == -1) {
+		qCritical("S3FS_Store_DataCache: failed to open segment %s", qPrintable(segmentPath(segment)));
+		return false;
+	}
+	active = segment;
+	if (!segments.contains(segment)) {
+		S3FS_Store_DataCacheSegment s;
+		s.size = lseek(active_fd, 0, SEEK_END);
+		s.live = 0;
+		s.map = NULL;
+		s.pending = 0;
+		segments.insert(segment, s);
+	}
+	return true;
+}
+
+const uchar *S3FS_Store_DataCache::mapSegment(quint32 segment) {
+	auto i = segments.find(segment);
+	if (i == segments.end()) return NULL;
+	if (i->map) return i->map;
+	if (i->size == 0) return NULL;
+
+	int fd = ::open(QFile::encodeName(segmentPath(segment)).constData(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return NULL;
+	void *map = mmap(NULL, i->size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		qCritical("S3FS_Store_DataCache: failed to map segment %s", qPrintable(segmentPath(segment)));
+		return NULL;
+	}
+	i->map = (uchar*)map;
+	return i->map;
+}
+
+void S3FS_Store_DataCache::updateSegment(quint32 segment) {
+	quint64 key_n = segment;
+	qint64 live = segments.value(segment).live;
+	kv->insert(QByteArray::fromRawData((const char*)&key_n, sizeof(key_n)), QByteArray::fromRawData((const char*)&live, sizeof(live)), segment_table);
+}
+
+void S3FS_Store_DataCache::loadIndex() {
+	index.clear();
+	KeyvalIterator i(kv, index_table);
+	bool valid = i.first();
+	while(valid) {
+		QByteArray value = i.value();
+		if (value.size() == sizeof(S3FS_Store_DataCacheLocation)) {
+			S3FS_Store_DataCacheLocation loc;
+			memcpy(&loc, value.constData(), sizeof(loc));
+			index.insert(i.key(), loc);
+		}
+		valid = i.next();
+	}
+	qDebug("S3FS_Store_DataCache: %d blocks in cache, index uses %lld kB of memory", index.size(), index.memoryUsage() / 1024);
+}
+
+bool S3FS_Store_DataCache::location(const QByteArray &hash, S3FS_Store_DataCacheLocation &loc) {
+	if (S3FS_Store_BlockIndex::accepts(hash)) return index.find(hash, loc);
+
+	QByteArray v = kv->valueView(hash, index_table);
+	if (v.size() != sizeof(loc)) return false;
+	memcpy(&loc, v.constData(), sizeof(loc));
+	return true;
+}
+
+bool S3FS_Store_DataCache::setLocation(const QByteArray &hash, const S3FS_Store_DataCacheLocation &loc) {
+	if (!kv->insert(hash, QByteArray::fromRawData((const char*)&loc, sizeof(loc)), index_table)) return false;
+	index.insert(hash, loc);
+	return true;
+}
+
+bool S3FS_Store_DataCache::checkHeader(const uchar *header, const QByteArray &hash, const S3FS_Store_DataCacheLocation &loc) {
+	if (header[0] != hash.size()) return false;
+	if (qFromBigEndian<quint32>(header+1) != loc.length) return false;
+	return memcmp(header+S3FS_DATACACHE_HEADER_SIZE, hash.constData(), hash.size()) == 0;
+}
+
+bool S3FS_Store_DataCache::contains(const QByteArray &hash) {
+	S3FS_Store_DataCacheLocation loc;
+	if (location(hash, loc)) return true;
+	if (legacy) return QFile::exists(legacyPath(hash));
+	return false;
+}
+
+bool S3FS_Store_DataCache::append(const QByteArray &hash, const char *data, quint32 len, S3FS_Store_DataCacheLocation &loc) {
+	qint64 rec_size = S3FS_DATACACHE_HEADER_SIZE + hash.size() + len;
+	if ((segments.value(active).size > 0) && (segments.value(active).size + rec_size > S3FS_DATACACHE_SEGMENT_SIZE)) {
+		// segment is full, next one
+		if (!openActive(active+1)) return false;
+	}
+
+	QVarLengthArray<uchar, 64> header(S3FS_DATACACHE_HEADER_SIZE + hash.size());
+	header[0] = hash.size();
+	qToBigEndian<quint32>(len, header.data()+1);
+	memcpy(header.data()+S3FS_DATACACHE_HEADER_SIZE, hash.constData(), hash.size());
+
+	struct iovec iov[2];
+	iov[0].iov_base = header.data();
+	iov[0].iov_len = header.size();
+	iov[1].iov_base = const_cast<char*>(data);
+	iov[1].iov_len = len;
+
+	S3FS_Store_DataCacheSegment &s = segments[active];
+	if (pwritev(active_fd, iov, 2, s.size) != rec_size) {
+		qCritical("S3FS_Store_DataCache: failed to write to segment %s", qPrintable(segmentPath(active)));
+		return false;
+	}
+	loc.segment = active;
+	loc.offset = s.size;
+	loc.length = len;
+	s.size += rec_size;
+	s.live += rec_size;
+	updateSegment(active);
+	return true;
+}
+
+bool S3FS_Store_DataCache::insert(const QByteArray &hash, const QByteArray &data) {
+	S3FS_Store_DataCacheLocation loc;
+	if (location(hash, loc)) return true; // already there
+
+	if (!append(hash, data.constData(), data.size(), loc)) return false;
+	return setLocation(hash, loc);
+}
+
+QByteArray S3FS_Store_DataCache::read(const QByteArray &hash) {
+	S3FS_Store_DataCacheLocation loc;
+	if (!location(hash, loc)) {
+		if (!legacy) return QByteArray();
+		QFile f(legacyPath(hash));
+		if (!f.open(QIODevice::ReadOnly)) return QByteArray();
+		return f.readAll();
+	}
+
+	int header_size = S3FS_DATACACHE_HEADER_SIZE + hash.size();
+	if (loc.segment == active) {
+		// still being written, not mapped
+		QVarLengthArray<uchar, 64> header(header_size);
+		QByteArray data(loc.length, Qt::Uninitialized);
+		struct iovec iov[2];
+		iov[0].iov_base = header.data();
+		iov[0].iov_len = header_size;
+		iov[1].iov_base = data.data();
+		iov[1].iov_len = loc.length;
+		if ((preadv(active_fd, iov, 2, loc.offset) == (ssize_t)(header_size + loc.length)) && (checkHeader(header.constData(), hash, loc)))
+			return data;
+	} else {
+		const uchar *map = mapSegment(loc.segment);
+		if ((map) && (loc.offset + header_size + loc.length <= segments.value(loc.segment).size) && (checkHeader(map + loc.offset, hash, loc)))
+			return QByteArray((const char*)map + loc.offset + header_size, loc.length);
+	}
+
+	qWarning("S3FS_Store_DataCache: block %s is damaged in cache, dropping it", hash.toHex().data());
+	remove(hash);
+	return QByteArray();
+}
+
+int S3FS_Store_DataCache::openFile(const QByteArray &hash, qint64 &pos, qint64 &size) {
+	S3FS_Store_DataCacheLocation loc;
+	if (!location(hash, loc)) {
+		if (!legacy) return -1;
+		int fd = ::open(QFile::encodeName(legacyPath(hash)).constData(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1) return -1;
+		struct stat st;
+		if (fstat(fd, &st) == -1) {
+			::close(fd);
+			return -1;
+		}
+		pos = 0;
+		size = st.st_size;
+		return fd;
+	}
+	if (!segments.contains(loc.segment)) {
+		remove(hash);
+		return -1;
+	}
+
+	int fd = ::open(QFile::encodeName(segmentPath(loc.segment)).constData(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return -1;
+	int header_size = S3FS_DATACACHE_HEADER_SIZE + hash.size();
+	QVarLengthArray<uchar, 64> header(header_size);
+	if ((pread(fd, header.data(), header_size, loc.offset) != header_size) || (!checkHeader(header.constData(), hash, loc))) {
+		::close(fd);
+		qWarning("S3FS_Store_DataCache: block %s is damaged in cache, dropping it", hash.toHex().data());
+		remove(hash);
+		return -1;
+	}
+	pos = loc.offset + header_size;
+	size = loc.length;
+	return fd;
+}
+
+void S3FS_Store_DataCache::remove(const QByteArray &hash) {
+	S3FS_Store_DataCacheLocation loc;
+	if (location(hash, loc)) {
+		kv->remove(hash, index_table);
+		index.remove(hash);
+		auto i = segments.find(loc.segment);
+		if (i != segments.end()) {
+			i->live -= S3FS_DATACACHE_HEADER_SIZE + hash.size() + loc.length;
+			updateSegment(loc.segment);
+		}
+	}
+	if (legacy) QFile::remove(legacyPath(hash));
+}
+
+bool S3FS_Store_DataCache::sync() {
+	foreach(quint32 segment, unsynced) {
+		int fd = ::open(QFile::encodeName(segmentPath(segment)).constData(), O_RDONLY | O_CLOEXEC);
+		if ((fd == -1) || (fdatasync(fd) != 0)) {
+			if (fd != -1) ::close(fd);
+			qCritical("S3FS_Store_DataCache: failed to sync segment %s", qPrintable(segmentPath(segment)));
+			return false;
+		}
+		::close(fd);
+	}
+	unsynced.clear();
+	if ((active_fd != -1) && (fdatasync(active_fd) != 0)) {
+		qCritical("S3FS_Store_DataCache: failed to sync segment %s", qPrintable(segmentPath(active)));
+		return false;
+	}
+	return kv->sync();
+}
+
+bool S3FS_Store_DataCache::reserve(const QByteArray &hash, quint32 length, S3FS_Store_DataCacheReservation &res) {
+	qint64 rec_size = S3FS_DATACACHE_HEADER_SIZE + hash.size() + length;
+	if ((segments.value(active).size > 0) && (segments.value(active).size + rec_size > S3FS_DATACACHE_SEGMENT_SIZE)) {
+		if (!openActive(active+1)) return false;
+	}
+	res.fd = dup(active_fd);
+	if (res.fd == -1) return false;
+
+	// the io thread writes records in the order they were reserved, so the segment has no holes
+	S3FS_Store_DataCacheSegment &s = segments[active];
+	res.segment = active;
+	res.offset = s.size;
+	res.length = length;
+	s.size += rec_size;
+	s.pending++;
+	return true;
+}
+
+bool S3FS_Store_DataCache::writeRecord(const S3FS_Store_DataCacheReservation &res, const QByteArray &hash, const QByteArray &data) {
+	QVarLengthArray<uchar, 64> header(S3FS_DATACACHE_HEADER_SIZE + hash.size());
+	header[0] = hash.size();
+	qToBigEndian<quint32>(res.length, header.data()+1);
+	memcpy(header.data()+S3FS_DATACACHE_HEADER_SIZE, hash.constData(), hash.size());
+
+	struct iovec iov[2];
+	iov[0].iov_base = header.data();
+	iov[0].iov_len = header.size();
+	iov[1].iov_base = const_cast<char*>(data.constData());
+	iov[1].iov_len = res.length;
+
+	bool ok = (data.size() == (int)res.length) && (pwritev(res.fd, iov, 2, res.offset) == (ssize_t)(header.size() + res.length));
+	::close(res.fd);
+	return ok;
+}
+
+bool S3FS_Store_DataCache::commit(const QByteArray &hash, const S3FS_Store_DataCacheReservation &res, bool written) {
+	auto i = segments.find(res.segment);
+	if (i == segments.end()) return false;
+	i->pending--;
+	if (!written) {
+		// space stays used until the segment is compacted
+		qCritical("S3FS_Store_DataCache: failed to write to segment %s", qPrintable(segmentPath(res.segment)));
+		return false;
+	}
+
+	S3FS_Store_DataCacheLocation loc;
+	if (location(hash, loc)) return true; // stored meanwhile, this copy is not used
+
+	loc.segment = res.segment;
+	loc.offset = res.offset;
+	loc.length = res.length;
+	i->live += S3FS_DATACACHE_HEADER_SIZE + hash.size() + res.length;
+	updateSegment(res.segment);
+	return setLocation(hash, loc);
+}
+
+bool S3FS_Store_DataCache::openRecord(const QByteArray &hash, S3FS_Store_DataCacheRecord &rec) {
+	if (!location(hash, rec.loc)) return false;
+	if (!segments.contains(rec.loc.segment)) return false;
+	if (rec.loc.segment == active) {
+		rec.fd = dup(active_fd);
+	} else {
+		rec.fd = ::open(QFile::encodeName(segmentPath(rec.loc.segment)).constData(), O_RDONLY | O_CLOEXEC);
+	}
+	return rec.fd != -1;
+}
+
+QByteArray S3FS_Store_DataCache::readRecord(const S3FS_Store_DataCacheRecord &rec, const QByteArray &hash) {
+	int header_size = S3FS_DATACACHE_HEADER_SIZE + hash.size();
+	QVarLengthArray<uchar, 64> header(header_size);
+	QByteArray data(rec.loc.length, Qt::Uninitialized);
+	struct iovec iov[2];
+	iov[0].iov_base = header.data();
+	iov[0].iov_len = header_size;
+	iov[1].iov_base = data.data();
+	iov[1].iov_len = rec.loc.length;
+	bool ok = (preadv(rec.fd, iov, 2, rec.loc.offset) == (ssize_t)(header_size + rec.loc.length)) && (checkHeader(header.constData(), hash, rec.loc));
+	::close(rec.fd);
+	if (!ok) return QByteArray();
+	return data;
+}
+
+qint64 S3FS_Store_DataCache::diskUsage() const {
+	qint64 res = 0;
+	for(auto i = segments.begin(); i != segments.end(); ++i)
+		res += i->size;
+	return res;
+}
+
+bool S3FS_Store_DataCache::hasUnpinned(quint32 segment, const std::function<bool(const QByteArray&)> &pinned) {
+	const uchar *map = mapSegment(segment);
+	if (!map) return false;
+	qint64 size = segments.value(segment).size;
+	qint64 pos = 0;
+
+	while(pos + S3FS_DATACACHE_HEADER_SIZE <= size) {
+		int hash_len = map[pos];
+		quint32 len = qFromBigEndian<quint32>(map+pos+1);
+		qint64 rec_size = S3FS_DATACACHE_HEADER_SIZE + hash_len + len;
+		if (pos + rec_size > size) break; // torn tail
+		QByteArray hash((const char*)map+pos+S3FS_DATACACHE_HEADER_SIZE, hash_len);
+
+		S3FS_Store_DataCacheLocation loc;
+		if ((location(hash, loc)) && (loc.segment == segment) && (loc.offset == pos) && (!pinned(hash))) return true;
+		pos += rec_size;
+	}
+	return false;
+}
+
+qint64 S3FS_Store_DataCache::evictOldest(const std::function<bool(const QByteArray&)> &pinned, const std::function<bool(const QByteArray&, quint32, qint64)> &keep, QList<QByteArray> &evicted) {
+	// segments are numbered in order of creation, the active one is never evicted. A segment
+	// where everything is pinned (not uploaded yet) would only be copied as a whole, skip it
+	quint32 segment = 0;
+	bool found = false;
+	for(auto i = segments.begin(); i != segments.end(); ++i) {
+		if ((i.key() == active) || (i->pending > 0)) continue;
+		if (!hasUnpinned(i.key(), pinned)) continue;
+		segment = i.key();
+		found = true;
+		break;
+	}
+	if (!found) return -1;
+
+	qint64 size = segments.value(segment).size;
+	qint64 sealed = QFileInfo(segmentPath(segment)).lastModified().toMSecsSinceEpoch();
+	const uchar *map = mapSegment(segment);
+	qint64 pos = 0;
+	qint64 carried = 0;
+	bool complete = true;
+
+	if (map) {
+		KeyvalBatch batch(kv);
+		while(pos + S3FS_DATACACHE_HEADER_SIZE <= size) {
+			int hash_len = map[pos];
+			quint32 len = qFromBigEndian<quint32>(map+pos+1);
+			qint64 rec_size = S3FS_DATACACHE_HEADER_SIZE + hash_len + len;
+			if (pos + rec_size > size) break; // torn tail
+			QByteArray hash((const char*)map+pos+S3FS_DATACACHE_HEADER_SIZE, hash_len);
+
+			S3FS_Store_DataCacheLocation loc;
+			if ((location(hash, loc)) && (loc.segment == segment) && (loc.offset == pos)) {
+				if ((pinned(hash)) || (keep(hash, len, sealed))) {
+					S3FS_Store_DataCacheLocation new_loc;
+					if (!append(hash, (const char*)map+pos+S3FS_DATACACHE_HEADER_SIZE+hash_len, len, new_loc)) {
+						// might be the only copy of a block not uploaded yet, the segment stays
+						complete = false;
+						break;
+					}
+					setLocation(hash, new_loc);
+					carried += rec_size;
+				} else {
+					kv->remove(hash, index_table);
+					index.remove(hash);
+					evicted.append(hash);
+				}
+				segments[segment].live -= rec_size;
+			}
+			pos += rec_size;
+		}
+	}
+
+	// blocks carried over must be on disk before the old copies go away
+	if ((carried > 0) && (!sync())) return -1;
+	if (!complete) {
+		updateSegment(segment);
+		qWarning("S3FS_Store_DataCache: failed to carry blocks of segment %08x over, keeping it", segment);
+		return 0;
+	}
+	qDebug("S3FS_Store_DataCache: evicted segment %08x, %d blocks dropped, %lld kB carried over", segment, evicted.size(), carried / 1024);
+	dropSegment(segment);
+	return size - carried;
+}
+
+void S3FS_Store_DataCache::dropSegment(quint32 segment) {
+	auto i = segments.find(segment);
+	if (i == segments.end()) return;
+	if (i->map) munmap(i->map, i->size);
+	segments.erase(i);
+	unsynced.remove(segment);
+	QFile::remove(segmentPath(segment));
+	quint64 key_n = segment;
+	kv->remove(QByteArray::fromRawData((const char*)&key_n, sizeof(key_n)), segment_table);
+}
+
+void S3FS_Store_DataCache::compact() {
+	// segments with no live block left go away, the emptiest of the others gets rewritten
+	quint32 candidate = 0;
+	qint64 candidate_live = -1;
+	foreach(quint32 segment, segments.keys()) {
+		if (segment == active) continue;
+		const S3FS_Store_DataCacheSegment &s = segments[segment];
+		if (s.pending > 0) continue; // records still being written
+		if (s.live <= 0) {
+			dropSegment(segment);
+			continue;
+		}
+		if ((s.live * 2 < s.size) && ((candidate_live == -1) || (s.live < candidate_live))) {
+			candidate = segment;
+			candidate_live = s.live;
+		}
+	}
+	if (candidate_live != -1) compactSegment(candidate);
+}
+
+void S3FS_Store_DataCache::compactSegment(quint32 segment) {
+	const uchar *map = mapSegment(segment);
+	if (!map) return;
+	qint64 size = segments.value(segment).size;
+	qint64 pos = 0;
+	int moved = 0;
+
+	{
+		KeyvalBatch batch(kv);
+		while(pos + S3FS_DATACACHE_HEADER_SIZE <= size) {
+			int hash_len = map[pos];
+			quint32 len = qFromBigEndian<quint32>(map+pos+1);
+			qint64 rec_size = S3FS_DATACACHE_HEADER_SIZE + hash_len + len;
+			if (pos + rec_size > size) break; // torn tail
+			QByteArray hash((const char*)map+pos+S3FS_DATACACHE_HEADER_SIZE, hash_len);
+
+			S3FS_Store_DataCacheLocation loc;
+			if ((location(hash, loc)) && (loc.segment == segment) && (loc.offset == pos)) {
+				// still used, move to active segment
+				S3FS_Store_DataCacheLocation new_loc;
+				if (!append(hash, (const char*)map+pos+S3FS_DATACACHE_HEADER_SIZE+hash_len, len, new_loc)) return;
+				setLocation(hash, new_loc);
+				segments[segment].live -= rec_size;
+				moved++;
+			}
+			pos += rec_size;
+		}
+	}
+
+	// new locations must be on disk before the old copies go away
+	if (!sync()) return;
+	qDebug("S3FS_Store_DataCache: compacted segment %08x, %d blocks moved", segment, moved);
+	dropSegment(segment);
+}
+
+void S3FS_Store_DataCache::migrateLegacy() {
+	if (!legacy_it) legacy_it = new QDirIterator(path.path(), QStringList("*.dat"), QDir::Files, QDirIterator::Subdirectories);
+
+	{
+		KeyvalBatch batch(kv);
+		int count = 0;
+		while((count < S3FS_DATACACHE_MIGRATE_BATCH) && (legacy_it->hasNext())) {
+			QString file = legacy_it->next();
+			QByteArray hash = QByteArray::fromHex(QFileInfo(file).completeBaseName().toLatin1());
+			QFile f(file);
+			if ((!hash.isEmpty()) && (f.open(QIODevice::ReadOnly))) {
+				QByteArray data = f.readAll();
+				f.close();
+				if (!data.isEmpty()) insert(hash, data);
+			}
+			QFile::remove(file);
+			count++;
+		}
+	}
+	if (legacy_it->hasNext()) {
+		QTimer::singleShot(0, this, SLOT(migrateLegacy()));
+		return;
+	}
+	delete legacy_it;
+	legacy_it = NULL;
+
+	// remove directories of the old layout, deepest first
+	QStringList dirs;
+	QDirIterator d(path.path(), QDir::Dirs | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+	while(d.hasNext()) {
+		QString dir = d.next();
+		if (dir.startsWith(segment_dir.path())) continue;
+		dirs.append(dir);
+	}
+	std::sort(dirs.begin(), dirs.end(), [](const QString &a, const QString &b) { return a.length() > b.length(); });
+	foreach(const QString &dir, dirs)
+		path.rmdir(dir);
+
+	legacy = false;
+	qDebug("S3FS_Store_DataCache: previous cache layout fully migrated");
+}
@@ -0,0 +1,120 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QObject>
+#include <QDir>
+#include <QMap>
+#include <QSet>
+#include <QTimer>
+#include <functional>
+#include "Keyval.hpp"
+#include "S3FS_Store_BlockIndex.hpp"
+
+#pragma once
+
+class QDirIterator;
+
+#define S3FS_DATACACHE_SEGMENT_SIZE (64LL * 1024 * 1024)
+#define S3FS_DATACACHE_COMPACT_INTERVAL 60000 // ms
+#define S3FS_DATACACHE_MIGRATE_BATCH 256 // legacy block files moved per event loop iteration
+
+struct S3FS_Store_DataCacheSegment {
+	qint64 size; // bytes written or reserved
+	qint64 live; // bytes of records still in index
+	uchar *map; // sealed segments are mapped on first read
+	int pending; // reserved records not committed yet, segment is left alone until then
+};
+
+// record space handed out by reserve(), written from a worker thread by writeRecord()
+struct S3FS_Store_DataCacheReservation {
+	quint32 segment;
+	quint32 offset;
+	quint32 length; // block size
+	int fd; // own descriptor, closed by writeRecord()
+};
+
+// record to be read by readRecord() from a worker thread
+struct S3FS_Store_DataCacheRecord {
+	S3FS_Store_DataCacheLocation loc;
+	int fd; // own descriptor, closed by readRecord()
+};
+
+// local block cache, blocks are appended to segment files and located through an index in Keyval
+// the index is also kept in memory (S3FS_Store_BlockIndex), Keyval is only read at startup
+// record: hash_len(1) data_len(4, big endian) hash data
+// removing a block only drops it from the index, space is reclaimed by compacting segments
+class S3FS_Store_DataCache: public QObject {
+	Q_OBJECT
+public:
+	S3FS_Store_DataCache(Keyval *kv, QObject *parent = 0);
+	~S3FS_Store_DataCache();
+
+	bool open(const QDir &path);
+	bool contains(const QByteArray &hash);
+	bool insert(const QByteArray &hash, const QByteArray &data);
+	QByteArray read(const QByteArray &hash);
+	int openFile(const QByteArray &hash, qint64 &pos, qint64 &size); // returns fd to be closed by caller, or -1
+	void remove(const QByteArray &hash);
+	bool sync();
+	qint64 diskUsage() const; // bytes used by segment files
+
+	// writing and reading without blocking the main thread, only reserve(), commit() and openRecord() touch the cache
+	bool reserve(const QByteArray &hash, quint32 length, S3FS_Store_DataCacheReservation &res);
+	static bool writeRecord(const S3FS_Store_DataCacheReservation &res, const QByteArray &hash, const QByteArray &data);
+	bool commit(const QByteArray &hash, const S3FS_Store_DataCacheReservation &res, bool written); // written = false gives up the reservation
+	bool openRecord(const QByteArray &hash, S3FS_Store_DataCacheRecord &rec);
+	static QByteArray readRecord(const S3FS_Store_DataCacheRecord &rec, const QByteArray &hash); // null if damaged
+
+	// drop the oldest segment holding blocks that are not pinned. Pinned blocks, and those for which
+	// keep(hash, length, sealed time in ms) returns true, are carried to the active segment, others
+	// leave the cache and are added to evicted. If a pinned or kept block cannot be carried, the
+	// segment stays. Returns bytes freed, or -1 if there is nothing left to evict
+	qint64 evictOldest(const std::function<bool(const QByteArray&)> &pinned, const std::function<bool(const QByteArray&, quint32, qint64)> &keep, QList<QByteArray> &evicted);
+
+public slots:
+	void compact();
+	void migrateLegacy();
+
+private:
+	bool location(const QByteArray &hash, S3FS_Store_DataCacheLocation &loc);
+	bool setLocation(const QByteArray &hash, const S3FS_Store_DataCacheLocation &loc);
+	void loadIndex();
+	static bool checkHeader(const uchar *header, const QByteArray &hash, const S3FS_Store_DataCacheLocation &loc);
+	bool append(const QByteArray &hash, const char *data, quint32 len, S3FS_Store_DataCacheLocation &loc);
+	bool openActive(quint32 segment);
+	const uchar *mapSegment(quint32 segment);
+	void updateSegment(quint32 segment);
+	void dropSegment(quint32 segment);
+	bool hasUnpinned(quint32 segment, const std::function<bool(const QByteArray&)> &pinned);
+	void compactSegment(quint32 segment);
+	QString segmentPath(quint32 segment) const;
+	QString legacyPath(const QByteArray &hash) const;
+
+	Keyval *kv;
+	KeyvalTable index_table; // hash => location
+	S3FS_Store_BlockIndex index; // same, in memory
+	KeyvalTable segment_table; // segment => live bytes
+	QDir path;
+	QDir segment_dir;
+	QMap<quint32, S3FS_Store_DataCacheSegment> segments;
+	quint32 active;
+	int active_fd;
+	QSet<quint32> unsynced; // sealed segments written since last sync()
+	bool legacy; // old one file per block layout still has files
+	QDirIterator *legacy_it;
+	QTimer compact_timer;
+};
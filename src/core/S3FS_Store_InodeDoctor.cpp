@@ -3,8 +3,9 @@
 #include "S3FS_Store.hpp"
 #include "QtFuseCallback.hpp"
 #include <QDataStream>
+#include <QtEndian>
 
-#define INT_TO_BYTES(_x) QByteArray _x ## _b; { QDataStream s_tmp(&_x ## _b, QIODevice::WriteOnly); s_tmp << _x; }
+#define INT_TO_BYTES(_x) quint64 _x ## _be = qToBigEndian<quint64>(_x); QByteArray _x ## _b = QByteArray::fromRawData((const char*)&_x ## _be, sizeof(_x ## _be))
 
 // this class is instanciated when the current (latest) version of a given inode is broken, or some other kind of issue happened
 // First we will list all files in that inode's dir and attempt to load the latest file. 
@@ -62,17 +63,21 @@ void S3FS_Store_InodeDoctor::receivedInode(S3FS_Aws_S3 *r) {
 	INT_TO_BYTES(ino);
 
 	QDataStream s(data);
+	KeyvalBatch batch(&parent->kv);
 	while(!s.atEnd()) {
 		QByteArray key, val;
 		s >> key >> val;
-		if (!parent->kv.insert(QByteArrayLiteral("\x01")+ino_b+key, val)) {
-			qFatal("Insert into keyval failed for inode %llu", ino);
+		if (!parent->kv.insert(ino_b+key, val, parent->meta_table)) {
+			qCritical("S3FS_Store_InodeDoctor: could not store inode %llu", ino);
+			parent->removeInodeFromCache(ino);
+			failed();
+			return;
 		}
 	}
-	if (!parent->kv.contains(QByteArrayLiteral("\x01")+ino_b)) {
+	if (!parent->kv.contains(ino_b, parent->meta_table)) {
 		// missing "" entry
 //		S3FS_Aws_S3::deleteFile(parent->bucket, current_test_rev, parent->aws);
-		parent->kv.remove(QByteArrayLiteral("\x01")+ino_b); // avoid others to get this data
+		parent->kv.remove(ino_b, parent->meta_table); // avoid others to get this data
 		getLastRevision();
 		return;
 	}
@@ -82,7 +87,7 @@ void S3FS_Store_InodeDoctor::receivedInode(S3FS_Aws_S3 *r) {
 	if ((!ino_o->isValid()) || (ino_o->getInode() != ino)) {
 		// still not right
 //		S3FS_Aws_S3::deleteFile(parent->bucket, current_test_rev, parent->aws);
-		parent->kv.remove(QByteArrayLiteral("\x01")+ino_b);
+		parent->kv.remove(ino_b, parent->meta_table);
 		parent->inodes_cache.remove(ino);
 		getLastRevision();
 		return;
@@ -0,0 +1,262 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "S3FS_Store_Journal.hpp"
+#include "Keyval.hpp"
+#include <QtEndian>
+#include <unistd.h>
+#include <stdio.h>
+
+#define S3FS_JOURNAL_HEADER_SIZE 15 // type + id + key_len + data_len
+
+S3FS_Store_Journal::S3FS_Store_Journal(Keyval *_kv, QObject *parent): QObject(parent) {
+	kv = _kv;
+	next_id = 1;
+	live_bytes = 0;
+	dirty = false;
+}
+
+S3FS_Store_Journal::~S3FS_Store_Journal() {
+	if (file.isOpen()) {
+		sync();
+		file.close();
+	}
+}
+
+bool S3FS_Store_Journal::open(const QString &_filename) {
+	filename = _filename;
+	file.setFileName(filename);
+	if (!file.open(QIODevice::ReadWrite | QIODevice::Append | QIODevice::Unbuffered)) {
+		qCritical("S3FS_Store_Journal: failed to open %s", qPrintable(filename));
+		return false;
+	}
+	if (!replay()) return false;
+	if (!entries.isEmpty())
+		qDebug("S3FS_Store_Journal: %d uploads were not confirmed before last shutdown", entries.size());
+	return true;
+}
+
+bool S3FS_Store_Journal::replay() {
+	file.seek(0);
+	QByteArray buf = file.readAll();
+	qint64 pos = 0;
+
+	while(pos + S3FS_JOURNAL_HEADER_SIZE + 2 <= buf.size()) {
+		const uchar *h = (const uchar*)buf.constData() + pos;
+		char type = h[0];
+		quint64 id = qFromBigEndian<quint64>(h+1);
+		int key_len = qFromBigEndian<quint16>(h+9);
+		int data_len = qFromBigEndian<quint32>(h+11);
+		qint64 len = S3FS_JOURNAL_HEADER_SIZE + key_len + data_len;
+		if ((data_len < 0) || (pos + len + 2 > buf.size())) break; // incomplete record
+		quint16 checksum = qFromBigEndian<quint16>(h+len);
+		if (checksum != qChecksum((const char*)h, (uint)len)) break; // torn write
+
+		QByteArray key = buf.mid(pos + S3FS_JOURNAL_HEADER_SIZE, key_len);
+		if (type == 'D') {
+			if (key.size() == 8) {
+				auto i = entries.find(qFromBigEndian<quint64>((const uchar*)key.constData()));
+				if (i != entries.end()) {
+					live_bytes -= S3FS_JOURNAL_HEADER_SIZE + i->key.size() + i->length + 2;
+					entries.erase(i);
+				}
+			}
+		} else {
+			S3FS_Store_JournalEntry e;
+			e.type = type;
+			e.key = key;
+			e.offset = pos + S3FS_JOURNAL_HEADER_SIZE + key_len;
+			e.length = data_len;
+			entries.insert(id, e);
+			live_bytes += len + 2;
+		}
+		if (id >= next_id) next_id = id + 1;
+		pos += len + 2;
+	}
+
+	if (pos < buf.size()) {
+		qWarning("S3FS_Store_Journal: dropping %lld bytes of incomplete records", buf.size() - pos);
+		if (!file.resize(pos)) return false;
+	}
+	if (entries.isEmpty() && (pos > 0)) {
+		file.resize(0);
+	} else if ((pos > S3FS_JOURNAL_COMPACT_SIZE) && (live_bytes < pos / 2)) {
+		return compact();
+	}
+	return true;
+}
+
+quint64 S3FS_Store_Journal::append(char type, quint64 id, const QByteArray &key, const QByteArray &data) {
+	QByteArray rec(S3FS_JOURNAL_HEADER_SIZE, Qt::Uninitialized);
+	uchar *h = (uchar*)rec.data();
+	h[0] = type;
+	qToBigEndian<quint64>(id, h+1);
+	qToBigEndian<quint16>(key.size(), h+9);
+	qToBigEndian<quint32>(data.size(), h+11);
+	rec.reserve(S3FS_JOURNAL_HEADER_SIZE + key.size() + data.size() + 2);
+	rec.append(key);
+	rec.append(data);
+	QByteArray checksum(2, Qt::Uninitialized);
+	qToBigEndian<quint16>(qChecksum(rec.constData(), (uint)rec.size()), (uchar*)checksum.data());
+	rec.append(checksum);
+
+	qint64 pos = file.size();
+	if (file.write(rec) != rec.size()) {
+		qCritical("S3FS_Store_Journal: failed to write journal: %s", qPrintable(file.errorString()));
+		return 0;
+	}
+	dirty = true;
+
+	if (type != 'D') {
+		S3FS_Store_JournalEntry e;
+		e.type = type;
+		e.key = key;
+		e.offset = pos + S3FS_JOURNAL_HEADER_SIZE + key.size();
+		e.length = data.size();
+		entries.insert(id, e);
+		live_bytes += rec.size();
+	}
+	return id;
+}
+
+quint64 S3FS_Store_Journal::addInode(quint64 ino) {
+	QByteArray key(8, Qt::Uninitialized);
+	qToBigEndian<quint64>(ino, (uchar*)key.data());
+	return append('I', next_id++, key, QByteArray());
+}
+
+quint64 S3FS_Store_Journal::addBlock(const QByteArray &hash, const QByteArray &data) {
+	return append('B', next_id++, hash, data);
+}
+
+void S3FS_Store_Journal::done(quint64 id) {
+	auto i = entries.find(id);
+	if (i == entries.end()) return;
+	live_bytes -= S3FS_JOURNAL_HEADER_SIZE + i->key.size() + i->length + 2;
+	entries.erase(i);
+
+	if (entries.isEmpty()) {
+		// everything confirmed, start over
+		file.resize(0);
+		live_bytes = 0;
+		dirty = true;
+		return;
+	}
+
+	QByteArray key(8, Qt::Uninitialized);
+	qToBigEndian<quint64>(id, (uchar*)key.data());
+	append('D', id, key, QByteArray());
+
+	qint64 size = file.size();
+	if ((size > S3FS_JOURNAL_COMPACT_SIZE) && (live_bytes < size / 2))
+		compact();
+}
+
+const QMap<quint64, S3FS_Store_JournalEntry> &S3FS_Store_Journal::pending() const {
+	return entries;
+}
+
+QByteArray S3FS_Store_Journal::data(quint64 id) {
+	auto i = entries.find(id);
+	if ((i == entries.end()) || (i->length == 0)) return QByteArray();
+	if (!file.seek(i->offset)) return QByteArray();
+	return file.read(i->length);
+}
+
+bool S3FS_Store_Journal::openRecord(quint64 id, S3FS_Store_JournalRecord &rec) {
+	auto i = entries.find(id);
+	if ((i == entries.end()) || (i->length == 0)) return false;
+	// file is unbuffered, and a compacted journal is a new file so this one keeps its content
+	rec.fd = dup(file.handle());
+	rec.offset = i->offset;
+	rec.length = i->length;
+	return rec.fd != -1;
+}
+
+QByteArray S3FS_Store_Journal::readRecord(const S3FS_Store_JournalRecord &rec) {
+	QByteArray buf(rec.length, Qt::Uninitialized);
+	bool ok = (pread(rec.fd, buf.data(), rec.length, rec.offset) == rec.length);
+	::close(rec.fd);
+	if (!ok) return QByteArray();
+	return buf;
+}
+
+QSet<QByteArray> S3FS_Store_Journal::cachedBlocks() const {
+	QSet<QByteArray> res;
+	for(auto i = entries.begin(); i != entries.end(); ++i) {
+		if ((i->type == 'B') && (i->length == 0)) res.insert(i->key);
+	}
+	return res;
+}
+
+bool S3FS_Store_Journal::compact() {
+	// copy pending records to a new file, then replace the journal with it
+	QFile new_file(filename+".new");
+	if (!new_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qCritical("S3FS_Store_Journal: failed to create %s", qPrintable(new_file.fileName()));
+		return false;
+	}
+	QMap<quint64, S3FS_Store_JournalEntry> new_entries;
+	for(auto i = entries.begin(); i != entries.end(); ++i) {
+		qint64 start = i->offset - i->key.size() - S3FS_JOURNAL_HEADER_SIZE;
+		qint64 len = S3FS_JOURNAL_HEADER_SIZE + i->key.size() + i->length + 2;
+		if (!file.seek(start)) return false;
+		QByteArray rec = file.read(len);
+		if (rec.size() != len) return false;
+		S3FS_Store_JournalEntry e = i.value();
+		e.offset = new_file.pos() + S3FS_JOURNAL_HEADER_SIZE + e.key.size();
+		if (new_file.write(rec) != len) return false;
+		new_entries.insert(i.key(), e);
+	}
+	new_file.flush();
+	fdatasync(new_file.handle());
+	new_file.close();
+
+	// current journal may not be synced yet, but the new one holds everything still needed
+	if (::rename(new_file.fileName().toLocal8Bit().data(), filename.toLocal8Bit().data()) != 0) {
+		qCritical("S3FS_Store_Journal: failed to replace journal");
+		return false;
+	}
+	file.close();
+	file.setFileName(filename);
+	if (!file.open(QIODevice::ReadWrite | QIODevice::Append | QIODevice::Unbuffered)) {
+		qCritical("S3FS_Store_Journal: failed to reopen %s", qPrintable(filename));
+		return false;
+	}
+	qDebug("S3FS_Store_Journal: compacted journal to %lld bytes", file.size());
+	entries = new_entries;
+	return true;
+}
+
+bool S3FS_Store_Journal::isDirty() const {
+	return dirty;
+}
+
+bool S3FS_Store_Journal::sync() {
+	if (!dirty) return true;
+
+	// metadata referenced by journal records must be on disk first
+	if (!kv->sync()) return false;
+
+	if (fdatasync(file.handle()) != 0) {
+		qCritical("S3FS_Store_Journal: failed to sync journal");
+		return false;
+	}
+	// only now, a failed sync has to be tried again by the next one
+	dirty = false;
+	return true;
+}
@@ -0,0 +1,79 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QObject>
+#include <QFile>
+#include <QMap>
+#include <QSet>
+
+#pragma once
+
+class Keyval;
+
+#define S3FS_JOURNAL_SYNC_INTERVAL 1000 // ms, see S3FS_Store::periodicSync()
+#define S3FS_JOURNAL_COMPACT_SIZE (64LL * 1024 * 1024) // rewrite journal past this size if mostly done
+
+struct S3FS_Store_JournalEntry {
+	char type; // 'I' = inode metadata, 'B' = block
+	QByteArray key; // big endian inode number, or block hash
+	qint64 offset; // position of data in journal file
+	int length; // 0 if block data is in local cache
+};
+
+// data of a pending record, to be read away from the main thread
+struct S3FS_Store_JournalRecord {
+	int fd; // own descriptor, closed by readRecord()
+	qint64 offset;
+	int length;
+};
+
+// write-ahead journal of uploads to S3 that have not been confirmed yet, replayed on startup
+// record: type(1) id(8) key_len(2) data_len(4) key data checksum(2), integers are big endian
+// 'D' records (key = id) mark a previous record as done
+class S3FS_Store_Journal: public QObject {
+	Q_OBJECT
+public:
+	S3FS_Store_Journal(Keyval *kv, QObject *parent = 0);
+	~S3FS_Store_Journal();
+
+	bool open(const QString &filename);
+	quint64 addInode(quint64 ino);
+	quint64 addBlock(const QByteArray &hash, const QByteArray &data); // data may be empty if block is cached locally
+	void done(quint64 id);
+
+	const QMap<quint64, S3FS_Store_JournalEntry> &pending() const; // records left after replay
+	QByteArray data(quint64 id); // data of a pending record
+	bool openRecord(quint64 id, S3FS_Store_JournalRecord &rec); // false if the record has no data
+	static QByteArray readRecord(const S3FS_Store_JournalRecord &rec); // any thread, stays valid through compact()
+	QSet<QByteArray> cachedBlocks() const; // pending blocks whose data is only in the local cache
+	bool isDirty() const;
+
+	bool sync(); // make journal and kv durable, blocks in the local cache must be synced before
+
+private:
+	quint64 append(char type, quint64 id, const QByteArray &key, const QByteArray &data);
+	bool replay();
+	bool compact();
+
+	Keyval *kv;
+	QFile file;
+	QString filename;
+	QMap<quint64, S3FS_Store_JournalEntry> entries;
+	quint64 next_id;
+	qint64 live_bytes; // bytes used by pending records
+	bool dirty; // written since last successful sync
+};
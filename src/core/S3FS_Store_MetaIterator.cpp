@@ -17,12 +17,18 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-S3FS_Store_MetaIterator::S3FS_Store_MetaIterator(Keyval*kv, const QByteArray &_prefix): KeyvalIterator(kv) {
+S3FS_Store_MetaIterator::S3FS_Store_MetaIterator(Keyval*kv, const QByteArray &_prefix, KeyvalTable table): KeyvalIterator(kv, table) {
 	prefix = _prefix;
-	KeyvalIterator::find(prefix);
+	prefix.detach(); // prefix may be raw data on caller's stack
+	if (prefix.isEmpty()) {
+		positioned = KeyvalIterator::first(); // whole table
+	} else {
+		positioned = KeyvalIterator::find(prefix);
+	}
 }
 
 bool S3FS_Store_MetaIterator::isValid() {
+	if (!positioned) return false;
 	return (KeyvalIterator::key().left(prefix.length()) == prefix);
 }
 
@@ -47,5 +53,6 @@ QByteArray S3FS_Store_MetaIterator::value() {
 }
 
 bool S3FS_Store_MetaIterator::find(const QByteArray &k) {
-	return KeyvalIterator::find(prefix+k);
+	positioned = KeyvalIterator::find(prefix+k);
+	return positioned;
 }
@@ -21,7 +21,7 @@
 
 class S3FS_Store_MetaIterator: private KeyvalIterator {
 public:
-	S3FS_Store_MetaIterator(Keyval*, const QByteArray &prefix); // prefix is the actual key
+	S3FS_Store_MetaIterator(Keyval*, const QByteArray &prefix, KeyvalTable table = 0); // prefix is the actual key, empty for the whole table
 	QByteArray key();
 	QByteArray fullKey();
 	QByteArray value();
@@ -32,4 +32,5 @@ public:
 
 private:
 	QByteArray prefix;
+	bool positioned; // false if nothing matched
 };
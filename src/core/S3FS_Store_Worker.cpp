@@ -0,0 +1,92 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "S3FS_Store_Worker.hpp"
+#include <QRunnable>
+#include <QThread>
+
+class S3FS_Store_WorkerJob: public QRunnable {
+public:
+	S3FS_Store_WorkerJob(S3FS_Store_Worker *_parent, const S3FS_Store_WorkerTask &_work, const S3FS_Store_WorkerTask &_done): parent(_parent), work(_work), done(_done) {
+		setAutoDelete(true);
+	}
+	void run() {
+		work();
+		parent->finished(done);
+	}
+
+private:
+	S3FS_Store_Worker *parent;
+	S3FS_Store_WorkerTask work;
+	S3FS_Store_WorkerTask done;
+};
+
+S3FS_Store_Worker::S3FS_Store_Worker(QObject *parent): QObject(parent) {
+	running = 0;
+	io_pool.setMaxThreadCount(1);
+	pool.setMaxThreadCount(qMax(QThread::idealThreadCount(), 2));
+}
+
+S3FS_Store_Worker::~S3FS_Store_Worker() {
+	waitForDone();
+}
+
+void S3FS_Store_Worker::setThreadCount(int count) {
+	if (count <= 0) count = qMax(QThread::idealThreadCount(), 2);
+	pool.setMaxThreadCount(count);
+}
+
+void S3FS_Store_Worker::run(const S3FS_Store_WorkerTask &work, const S3FS_Store_WorkerTask &done) {
+	running++;
+	pool.start(new S3FS_Store_WorkerJob(this, work, done));
+}
+
+void S3FS_Store_Worker::runIo(const S3FS_Store_WorkerTask &work, const S3FS_Store_WorkerTask &done) {
+	running++;
+	io_pool.start(new S3FS_Store_WorkerJob(this, work, done));
+}
+
+void S3FS_Store_Worker::finished(const S3FS_Store_WorkerTask &done) {
+	QMutexLocker l(&lock);
+	completed.append(done);
+	// one wakeup is enough for everything completed until the main thread picks it up
+	if (completed.size() == 1) QMetaObject::invokeMethod(this, "deliver", Qt::QueuedConnection);
+}
+
+void S3FS_Store_Worker::deliver() {
+	QList<S3FS_Store_WorkerTask> list;
+	{
+		QMutexLocker l(&lock);
+		list.swap(completed);
+	}
+	foreach(const S3FS_Store_WorkerTask &done, list) {
+		running--;
+		done();
+	}
+}
+
+void S3FS_Store_Worker::waitForDone() {
+	while(running > 0) {
+		pool.waitForDone();
+		io_pool.waitForDone();
+		deliver();
+	}
+}
+
+int S3FS_Store_Worker::pending() const {
+	return running;
+}
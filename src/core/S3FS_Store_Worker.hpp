@@ -0,0 +1,53 @@
+/*  S3ClFS - AWS S3 backed cluster filesystem
+ *  Copyright (C) 2015 Mark Karpeles
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <QObject>
+#include <QThreadPool>
+#include <QMutex>
+#include <QList>
+#include <functional>
+
+#pragma once
+
+typedef std::function<void()> S3FS_Store_WorkerTask;
+
+// runs hashing and local cache I/O away from the main thread
+// work runs in a pool thread, then done is called on the thread owning the worker (the main thread)
+// io tasks all run in a single thread in submission order, so segment files are written sequentially
+class S3FS_Store_Worker: public QObject {
+	Q_OBJECT
+public:
+	S3FS_Store_Worker(QObject *parent = 0);
+	~S3FS_Store_Worker();
+
+	void setThreadCount(int);
+	void run(const S3FS_Store_WorkerTask &work, const S3FS_Store_WorkerTask &done);
+	void runIo(const S3FS_Store_WorkerTask &work, const S3FS_Store_WorkerTask &done);
+	void waitForDone(); // blocks until everything ran, including done callbacks and what they started
+	int pending() const; // tasks whose done callback was not called yet
+
+	void finished(const S3FS_Store_WorkerTask &done); // called by pool threads
+
+public slots:
+	void deliver();
+
+private:
+	QThreadPool pool;
+	QThreadPool io_pool;
+	QMutex lock;
+	QList<S3FS_Store_WorkerTask> completed; // protected by lock
+	int running;
+};
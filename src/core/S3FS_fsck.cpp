@@ -247,8 +247,9 @@ void S3FS_fsck::process_2(QtFuseCallback *_cb) {
 
 	do {
 		if (!iterator->isValid()) break;
-		quint64 ino_n;
-		QDataStream(iterator->key()) >> ino_n;
+		quint64 ino_n = 0;
+		QByteArray ino_k = iterator->key(); // native integer key
+		if (ino_k.length() == sizeof(ino_n)) memcpy(&ino_n, ino_k.constData(), sizeof(ino_n));
 		if (ino_n > fsck_ino_max) continue; // out of bound inode (we should probably be able to break here)
 		if (known_inodes.contains(ino_n)) continue; // inode is in the known inodes tree
 		if (!store.hasInodeLocally(ino_n)) {
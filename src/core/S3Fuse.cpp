@@ -21,6 +21,8 @@
 
 S3Fuse::S3Fuse(S3FS_Config *cfg, S3FS *_parent): QtFuse(cfg->mountPath(), cfg->bucket(), cfg->mountOptions(), _parent) {
 	parent = _parent;
+	setThreadCount(cfg->fuseThreads());
+	splice_read = cfg->spliceRead();
 
 	// connect
 	connect(this, &S3Fuse::signal_forget, parent, &S3FS::fuse_forget);
@@ -32,6 +34,9 @@ void S3Fuse::fuse_init(struct fuse_conn_info *ci) {
 	ci->max_readahead = S3FUSE_BLOCK_SIZE * 32;
 	ci->capable &= ~FUSE_CAP_SPLICE_READ;
 	ci->want = FUSE_CAP_ASYNC_READ | FUSE_CAP_ATOMIC_O_TRUNC | FUSE_CAP_EXPORT_SUPPORT | FUSE_CAP_BIG_WRITES | FUSE_CAP_IOCTL_DIR;
+	// read replies can be spliced from block files to the device, without this libfuse copies them through memory
+	if (splice_read && (ci->capable & FUSE_CAP_SPLICE_WRITE))
+		ci->want |= FUSE_CAP_SPLICE_WRITE;
 	ci->max_background = 16;
 	ci->congestion_threshold = 32;
 }
@@ -44,6 +49,6 @@ void S3Fuse::fuse_getxattr(QtFuseRequest *req) {
 	req->error(ENOTSUP); // just return ENOSYS here to avoid log full of "getxattr not impl"
 }
 
-#define s3fuse_sig_handle(_x) void S3Fuse::fuse_ ## _x(QtFuseRequest *req) { req->setMethod<S3FS>(parent, &S3FS::fuse_ ## _x); req->triggerLater(); }
+#define s3fuse_sig_handle(_x) void S3Fuse::fuse_ ## _x(QtFuseRequest *req) { req->setMethod<S3FS>(parent, &S3FS::fuse_ ## _x); req->trigger(); }
 FOREACH_s3fuseOps(s3fuse_sig_handle);
 
@@ -24,7 +24,7 @@
 #define FOREACH_s3fuseOps(X) \
 	X(lookup) X(getattr) X(setattr) X(unlink) X(readlink) \
 	X(mkdir) X(rmdir) X(symlink) X(rename) X(link) \
-	X(open) X(read) X(write) X(flush) X(release) \
+	X(open) X(read) X(write) X(flush) X(release) X(fsync) \
 	X(opendir) X(readdir) X(releasedir) \
 	X(create)
 
@@ -51,4 +51,5 @@ protected:
 
 private:
 	S3FS *parent;
+	bool splice_read;
 };